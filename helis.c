@@ -2,25 +2,73 @@
 #define _DEFAULT_SOURCE
 #define _BSD_SOURCE
 #define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /* Defines */
 #define CTRL_KEY(k) ((k)&0x1f)
 #define HELIS_VERSION "0.0.0.0.1"
 #define HELIS_TAB_STOP 4
 #define HELIS_QUIT_TIMES 1
+#define HELIS_LONG_LINE 65536 // Rows at least this long get a chunk index
+#define HELIS_CHUNK_SIZE 4096 // Chars per chunk of a long row
+#define HELIS_GAP_SIZE 65536  // Room a long row being typed into keeps
+#define HELIS_MAX_FPS 60      // Frame rate cap, 0 disables it
+#define HELIS_ESC_TIMEOUT 100 // Ms to wait for the rest of an escape seq
+#define HELIS_INPUT_BUF 4096  // Size of the input buffer
+#define HELIS_SWAP_MAGIC "HELISWP1"
+#define HELIS_SWAP_SYNC_MS 1000 // Max time a journaled edit stays unsynced
+#define HELIS_COLD_ROWS 20000   // Files with this many rows compress cold
+                                // rows, 0 disables it
+#define HELIS_COLD_DISTANCE 2000 // Rows this close to the screen stay hot
+#define HELIS_BLOCK_ROWS 256    // Rows per compressed block
+#define HELIS_BLOCK_CACHE 8     // Decompressed blocks kept around
+#define HELIS_LZ_HASH_BITS 14   // Size of the compressor's match table
+#define HELIS_FINDER_THREADS 4  // Threads indexing and matching files
+#define HELIS_MATCH_SLICE 32768 // Fewest paths worth a matcher thread
+#define HELIS_GREP_THREADS 4    // Threads searching files for :grep
+#define HELIS_GREP_TEXT 256     // Bytes of a matching line kept for the list
+#define HELIS_GREP_BINARY 8192  // Bytes checked for NUL to skip binary files
+#define HELIS_WORD_MAX 64       // Longest word offered for completion
+#define HELIS_CACHE_MAGIC "HELISIX1"
+#define HELIS_CACHE_ROWS 20000  // Files with this many rows get an open
+                                // cache, 0 disables it
+#define HELIS_MAX_ROW (INT_MAX / HELIS_TAB_STOP) // Longest row, so that its
+                                                 // render size fits an int
+#define HELIS_MACRO_POLL 4096 // Keys replayed between checks for typed ones
+#define HELIS_FILTER_BUF 65536 // Bytes moved per read or write of a filter
+#define HELIS_SAVE_BUF (1 << 20) // Bytes gathered per write of a save
 
 // Keys bindings
 enum editorKey {
@@ -55,8 +103,26 @@ enum editorHighlight {
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 
+// Separator characters (besides whitespace and '\0')
+#define HL_SEPARATORS ",.()+-/*=~%<>[];"
+
+// Character classes of the lexer table
+#define CC_SEP (1 << 0)   // Ends a word
+#define CC_SPACE (1 << 1) // Whitespace that can't start a token
+#define CC_DIGIT (1 << 2) // Decimal digit
+#define CC_WORD (1 << 3)  // Plain word char that can't start a token
+#define CC_KW (1 << 4)    // First char of a keyword
+#define CC_INWORD (1 << 5) // Plain char once past the start of a word
+
 /* Data */
 
+// Keyword prepared for lookup
+struct editorKeyword {
+  char *s;
+  int len;
+  unsigned char hl;
+};
+
 // Syntax
 struct editorSyntax {
   char *filetype;
@@ -66,6 +132,14 @@ struct editorSyntax {
   char *multiline_comment_start;
   char *multiline_comment_end;
   int flags;
+
+  // Filled by editorSyntaxCompile
+  int compiled;
+  int simd_word;                // [0-9A-Za-z_\x80-\xff] are all CC_INWORD
+  int lookahead;                // Max chars a lexing decision looks at
+  unsigned char cclass[256];    // Character classes
+  struct editorKeyword *kw;     // Keywords bucketed by first char
+  unsigned short kwstart[257];  // Bucket bounds in kw
 };
 
 // Editor modes
@@ -73,6 +147,35 @@ enum editorMode { Normal, Visual, Insert, Cmd };
 
 char *editorModes[] = {"Normal", "Visual", "Insert", "Cmd"};
 
+// Kinds of visual selection, also kinds of yanked text
+enum editorVisualKind { VISUAL_CHAR, VISUAL_LINE, VISUAL_BLOCK };
+
+// Yanked text
+struct editorRegister {
+  char **lines;
+  size_t *lens;
+  int n;
+  enum editorVisualKind kind;
+};
+
+// Start of a chunk of a long row, always at the start of a char
+struct erowChunk {
+  int cx;   // Offset in chars
+  int rx;   // Render x
+  int ri;   // Offset in render, which is rx only on ASCII rows
+  int tabs; // Tabs in the chunk
+};
+
+// Offsets a chunk of a long row can be looked up by
+enum erowChunkKey { CHUNK_CX, CHUNK_RX, CHUNK_RI };
+
+// Nesting of one kind of bracket over a row, opening ones counting +1
+// and closing ones -1
+struct erowBrackets {
+  int delta; // Depth at the end of the row
+  int min;   // Lowest depth reached in the row, at most 0
+};
+
 // Row of text
 typedef struct erow {
   int idx;
@@ -82,13 +185,297 @@ typedef struct erow {
   char *render;      // Chars in a row(to render)
   unsigned char *hl; // Highlight
   int hl_open_comment;
+  struct erowChunk *chunks; // Chunk index of long rows, NULL otherwise
+  int nchunks;
+  int gap;  // A long row being typed into has a gap before this chunk,
+  int cgap; // nchunks if none, of cgap bytes in chars and rgap bytes in
+  int rgap; // render and hl, so that edits only move the bytes up to it
+  int ascii; // All chars are ASCII, so render bytes are columns
+  int width; // Columns the render takes, -1 until needed if never rendered
+  struct editorBlock *block; // Block holding the chars of a cold row
+  size_t boff;               // Offset of the chars in the block
+  struct erowBrackets brackets[3]; // Depth of (), [] and {} outside of
+                                   // strings and comments
+  int brackets_stale;              // Highlight changed since brackets
+  int hl_stale;                    // Lexed with an open comment state that
+                                   // changed during a macro replay
+  int shared;                      // Chars are in the snapshot of a save
 } erow;
 
+// Compressed chars of a run of cold rows
+struct editorBlock {
+  char *data;
+  int clen;      // Compressed size
+  size_t rawlen; // Uncompressed size
+  int refs;   // Cold rows still in the block
+};
+
+// Header of the open cache of a file, followed by a struct editorCacheRow
+// for each row. Records have a fixed size so the cache is used mmapped
+struct editorCacheHeader {
+  char magic[8];
+  uint64_t size;                 // Of the file
+  int64_t mtime_sec, mtime_nsec; // Of the file
+  uint64_t hash;                 // Of the file's contents
+  uint64_t syntax;               // Of the syntax it was lexed with
+  uint64_t rows_hash;            // Of the row records, to catch torn writes
+  uint64_t numrows;
+};
+
+// Row of the open cache of a file
+struct editorCacheRow {
+  uint64_t off;            // Offset of the chars in the file
+  uint32_t len;            // Chars without the line ending
+  uint32_t flags;          // CACHE_* bits
+  int16_t brackets[3][2];  // Bracket summary, delta and min
+  int16_t pad[2];
+};
+
+enum editorCacheFlags {
+  CACHE_OPEN_COMMENT = 1, // Lexer state at the end of the row
+  CACHE_BRACKETS = 2      // Bracket summary is known and fits
+};
+
+// Distinct word of the buffer
+struct editorWord {
+  int len;
+  int count; // Occurrences in the buffer, 0 once they are all gone
+  char s[];
+};
+
+// Words of the buffer for completion, built on first use and kept up to
+// date by the row edits from then on
+struct editorWordIndex {
+  struct editorWord **table; // Open addressing hash of the words
+  int cap, n;                // Table size (a power of 2) and words in it
+  struct editorWord **words; // Sorted words, then the ones added since
+  int nwords, capwords;
+  int nsorted;               // Length of the sorted part of words
+  int built;
+};
+
+// Keyword completion in progress
+struct editorCompletion {
+  const char **cands; // Words starting with prefix, in order
+  int n;
+  int cur;            // Candidate in the row, -1 for the prefix
+  char *prefix;       // Word as typed
+  int y, x;           // Start of the word
+  int len;            // Current length of the word
+};
+
+// Cursor besides the main one
+struct editorCursor {
+  int x, y;
+};
+
+// Extra cursors of multi-cursor editing, sorted by row then column and
+// never on the main cursor
+struct editorCursors {
+  struct editorCursor *c;
+  int n, cap;
+  int next_y, next_x; // Where the search for the next match goes on
+};
+
+// Keys recorded into a macro register
+struct editorMacro {
+  int *keys;
+  int len, cap;
+};
+
+// Replay of a macro: its own copy of the keys, the next one to play and
+// how many more times to play them all
+struct editorReplay {
+  int *keys;
+  int len, pos;
+  int left;
+};
+
+// Macro registers a-z, and the replays in progress, nested ones on top
+struct editorMacros {
+  struct editorMacro reg[26];
+  int recording;               // Register being recorded into, 0 if none
+  int last;                    // Register last replayed, for @@
+  struct editorReplay *play;
+  int depth, cap;
+  long played;                 // Keys replayed, to look for typed ones
+  int stale;                   // Rows were left to lex at the end
+};
+
+// Rows that can be folded away behind their first row
+struct editorFold {
+  int start, end;
+  int closed;
+};
+
+// Run of rows hidden by a closed fold
+struct editorHidden {
+  int start, end; // First and last hidden row
+  int before;     // Rows hidden by the runs before this one
+};
+
+// Folds in order of start, outer ones first, so that their nesting is a
+// tree laid out in preorder. The runs of rows hidden by the outermost
+// closed folds map screen rows to file rows by binary search
+struct editorFolds {
+  struct editorFold *f;
+  int n, cap;
+  struct editorHidden *hidden;
+  int nhidden;
+};
+
+// Screen lines of the rows when soft wrapping, summed by a Fenwick tree so
+// that file rows and screen lines map to each other in O(log n). Rows in a
+// closed fold take no line and the fold takes one
+struct editorWrap {
+  int on;
+  int *tree; // Fenwick tree over the lines of each row, 1-based
+  int n;     // Rows in the tree, -1 when it needs a rebuild
+  int cols;  // Screen width the lines were counted for
+};
+
+// Slot of the LRU of decompressed blocks
+struct editorBlockCache {
+  struct editorBlock *block;
+  char *data;
+  unsigned long used; // Clock of the last use, 0 for an empty slot
+};
+
+// Append-only journal of the edits made to a buffer
+struct editorJournal {
+  char *path;           // Swap file path
+  int fd;               // Swap file, only used by the writer thread
+  pthread_t thread;     // Writer thread
+  pthread_mutex_t lock; // Guards the fields below
+  pthread_cond_t cond;  // Signals new records or stop
+  char *buf;            // Records not yet written
+  size_t len, cap;      // Records length and capacity
+  int reset;            // Truncate the swap file before writing buf
+  int stop;             // Writer should flush and exit
+  int keeping;          // Copy records to kept too
+  char *kept;           // Records since a save started, to follow the
+  size_t keptlen, keptcap; // header of the file it writes
+};
+
+// Row of a save snapshot: the chars of a resident row, shared with it
+// until it changes them, or the block holding the chars of a cold one
+struct editorSaveRow {
+  const char *chars;         // NULL for a cold row
+  struct editorBlock *block; // Referenced by the snapshot
+  size_t boff;
+  int size;
+};
+
+// Save writing a snapshot of the rows from a background thread
+struct editorSave {
+  char *filename;
+  struct editorSaveRow *rows;
+  int numrows;
+  size_t len;            // Bytes to write
+  int dirty;             // E.dirty as of the snapshot
+  int hash;              // Hash the contents for the open cache
+  mode_t mode;           // Of the file if the save creates it
+  char **orphans;        // Shared chars the rows let go of meanwhile
+  int norphans, caporphans;
+  pthread_t thread;
+  int threaded;          // Thread was started, so it has to be joined
+  int wake;              // Pipe to wake the main thread with once done
+  pthread_mutex_t lock;  // Guards finished
+  int finished;
+  int err;               // errno of the failure, 0 once written
+  struct stat st;        // File as written
+  uint64_t sum;          // Hash of the contents written
+};
+
+// Rules of one .gitignore
+struct editorIgnore {
+  char **patterns;
+  int *flags;                  // IGNORE_* bits of each pattern
+  int n;
+  int baselen;                 // Length of the directory prefix it is in
+  struct timespec mtime;       // Of the .gitignore file
+  struct editorIgnore *parent; // Rules of the enclosing directories
+};
+
+enum editorIgnoreFlags { IGNORE_NEGATE = 1, IGNORE_DIR = 2, IGNORE_ANCHORED = 4 };
+
+// Directory in the file finder's index
+struct editorDir {
+  char *path;                  // Relative to the working directory
+  struct timespec mtime;       // As of the last read, 0 if never read
+  struct editorIgnore *ignore; // Its own .gitignore, NULL if none
+  char **files;                // Paths of the files it holds
+  int nfiles;
+  struct editorDir **dirs;     // Subdirectories, sorted by path
+  int ndirs;
+};
+
+// Directory waiting to be read by the walker threads
+struct editorWalkJob {
+  struct editorDir *dir;
+  struct editorIgnore *chain; // Rules in effect above the directory
+  int force;                  // Reread even if the mtime is unchanged
+};
+
+// Path the fuzzy matcher can pick
+struct editorCandidate {
+  const char *path;
+  char *lower;   // Lowercased path, path itself if it has no capitals
+  uint64_t mask; // Chars present in path, for a quick reject
+  int len;
+  int base;      // Offset of the basename
+};
+
+// Slice of the hits one matcher thread filters
+struct editorMatchJob {
+  struct editorFinder *f;
+  const char *q; // Lowercased query
+  int qlen;
+  uint64_t qmask;
+  int from, to;  // Slice of the hits
+  int n;         // Hits still matching, moved to the start of the slice
+  int *top;      // Best of them, best first
+  int *topscore;
+  int ntop;
+};
+
+// File finder state, the index is built by background walker threads
+struct editorFinder {
+  struct editorDir root;
+  pthread_t thread;              // Walk coordinator
+  int walking;                   // A walk is running, main thread only
+  pthread_mutex_t lock;          // Guards next and garbage
+  struct editorCandidate *next;  // Index published by the last walk
+  int nnext;
+  char **garbage;                // Paths dropped by the walk, freed once
+  int ngarbage, capgarbage;      // the main thread stops using them
+
+  pthread_mutex_t qlock;         // Guards the walk queue
+  pthread_cond_t qcond;
+  struct editorWalkJob *jobs;
+  int njobs, capjobs;
+  int active;                    // Jobs being processed
+
+  struct editorCandidate *cand;  // Index the picker matches against
+  int ncand;
+  int *hits;                     // Candidates matching query
+  int nhits;
+  char *query;                   // Query of hits, NULL when stale
+  int *top;                      // Best hits, best first
+  int *topscore;                 // Scores of top
+  int ntop;
+  int sel;                       // Selected entry of top
+  int open;                      // Picker is on screen
+  char *choice;                  // Path picked with Enter
+  int wake;                      // Wake pipe of the editor
+};
+
 // Editor config
 struct editorConfig {
   int cx, cy;                  // Cursor coords
   int rx;                      // Render coord
   int rowoff;                  // Row offset
+  int lineoff;                 // Wrapped line of rowoff at the top
   int coloff;                  // Column offset
   int screenrows;              // Screen row count
   int screencols;              // Screen columns count
@@ -101,10 +488,65 @@ struct editorConfig {
   struct editorSyntax *syntax; // Syntax
   struct termios orig_termios; // Terminal attributes
   enum editorMode mode;        // Editor mode
+  int inotify_fd;              // Watch of the file's directory
+  struct stat disk_stat;       // File on disk as of last open/save
+  int disk_changed;            // File was changed on disk under edits
+  struct editorJournal *journal; // Swap journal, NULL when not journaling
+  char inbuf[HELIS_INPUT_BUF]; // Bytes read but not consumed yet
+  int inlen, inpos;            // Input buffer length and read position
+  long last_frame;             // Time of the last refresh in ms
+  enum editorVisualKind vkind; // Kind of visual selection
+  int vx, vy;                  // Visual selection anchor
+  struct editorRegister reg;   // Last yanked or deleted text
+  uint64_t *screen;            // Hash of each text line on the terminal
+  int screen_valid;            // Whether screen matches the terminal
+  int screen_rowoff;           // Row offset the terminal is showing
+  int screen_lineoff;          // and its line offset
+  struct editorBlockCache bcache[HELIS_BLOCK_CACHE]; // Decompressed blocks
+  int cold_rowoff;             // Row offset of the last cold row sweep
+  int wake[2];                 // Pipe background threads wake input with
+  struct editorFinder *finder; // File finder, NULL until first used
+  struct editorGrep *grep;     // Last :grep, NULL if none
+  struct editorWordIndex words; // Words for completion
+  struct editorCompletion *complete; // Completion in progress, or NULL
+  int pair_y, pair_at;         // Render offset of the bracket matching the
+                               // one under the cursor, pair_y -1 if none
+  int pair_from;               // Render offset of the one under the cursor
+  struct editorFolds folds;    // Folded ranges of rows
+  struct editorWrap wrap;      // Soft wrap
+  struct editorCursors cursors; // Extra cursors
+  struct editorSearch *search; // Matches of the last search, NULL if none
+  struct editorMacros macros;  // Recorded keys
+  struct editorSave *save;     // Save in progress, NULL if none
+  int prompting;               // Prompts reading a line
+  int gaprow;                  // Row with a gap, -1 if none
+  int typing;                  // The key being handled only types
 };
 
 struct editorConfig E;
 
+// Buffer kept by the server while no terminal shows it
+struct editorBuffer {
+  char *path;                // Real path of the file
+  char *cwd;                 // Directory the file was opened from
+  struct editorConfig state; // E while the buffer is not attached
+};
+
+// Server holding buffers for helis --remote. E is swapped with the state
+// of the buffer a client attaches to, so the server lives outside of it
+struct editorServer {
+  int fd;                      // Listening socket, -1 unless serving
+  int attached;                // A client is using E
+  int gone;                    // Its terminal went away, so the key loop
+                               // should detach
+  jmp_buf detach;              // Back to the server loop
+  struct editorConfig blank;   // E of a buffer before opening a file
+  struct editorBuffer *bufs;
+  int nbufs;
+};
+
+struct editorServer Srv = {.fd = -1};
+
 /* Filetypes */
 
 // Language extensions for highlight
@@ -119,7 +561,9 @@ char *C_HL_keywords[] = {"switch",    "if",      "while",   "for",    "break",
 // Higlight database
 struct editorSyntax HLDB[] = {
     {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/",
-     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+     // Lexer tables, built by editorSyntaxCompile
+     0, 0, 0, {0}, NULL, {0}},
 };
 
 // Length of database
@@ -129,6 +573,49 @@ struct editorSyntax HLDB[] = {
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorCheckDisk();
+void editorWatchFile();
+void journalEdit(int row, int at, int del, const char *s, int len);
+void journalRows(int at, int del, char **lines, size_t *lens, int n);
+int editorSelectionRange(int filerow, int *start, int *end);
+void editorUpdateRow(erow *row);
+erow *editorRowResident(erow *row);
+void editorRowThaw(erow *row);
+void editorRowGapTo(erow *row, int k);
+void editorGapClose();
+void editorBlockRelease(struct editorBlock *b);
+void editorFinderWake();
+void editorGrepWake();
+uint64_t editorHashBytes(const char *s, size_t len);
+int editorIsWordChar(char c);
+void editorWordsScan(const char *s, int len, int dir);
+const char *editorRowChars(erow *row);
+void editorRowBrackets(erow *row);
+void editorBracketsSum(struct erowBrackets *brackets, const char *render,
+                       const unsigned char *hl, int rsize);
+int editorRenderChars(char *dst, const char *s, int len, int rx);
+void editorFoldsShift(int at, int del, int n);
+int editorRowToScreen(int y);
+int editorScreenToRow(int s);
+int editorWrapRowToScreen(int y);
+int editorWrapScreenToRow(int s);
+void editorWrapUpdate(erow *row);
+void editorWrapInvalidate();
+int editorScreenTop();
+void editorCursorsClear();
+void editorMoveCursor(int key);
+void editorSearchUpdate(erow *row);
+void editorSearchEdit(erow *row, int at, int del, int len);
+int editorSearchLen();
+void editorSearchShift(int at, int del, int n);
+void editorSearchFree();
+int editorMacroNext(int *key);
+void editorMacroRecord(int key);
+int editorMacroPlaying();
+void editorMacroAbort();
+void editorDetach();
+void editorSaveWake();
+void editorSaveWait();
 
 /* Terminal */
 
@@ -141,6 +628,20 @@ void die(const char *s) {
   exit(1);
 }
 
+// Write all of len bytes of s to fd, returns -1 on failure
+int editorWriteAll(int fd, const char *s, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, s, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    s += n;
+    len -= n;
+  }
+  return 0;
+}
+
 // Disabling raw mode at exit to prevent issues
 void disableRawMode() {
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
@@ -171,26 +672,118 @@ void enableRawMode() {
     die("tcsetattr");
 }
 
-// Reading the key from stdin
-int editorReadKey() {
-  int nread;
-  char seq[6];
+// Wait for input, handling changes of the file on disk and results of
+// background threads meanwhile
+void editorWaitInput() {
+  struct pollfd fds[3] = {{STDIN_FILENO, POLLIN, 0},
+                          {E.inotify_fd, POLLIN, 0},
+                          {E.wake[0], POLLIN, 0}};
+  while (1) {
+    if (poll(fds, 3, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      die("poll");
+    }
+    if (fds[1].revents & POLLIN) {
+      char buf[4096];
+      while (read(E.inotify_fd, buf, sizeof(buf)) > 0)
+        ;
+      editorCheckDisk();
+    }
+    if (fds[2].revents & POLLIN) {
+      char buf[64];
+      while (read(E.wake[0], buf, sizeof(buf)) > 0)
+        ;
+      editorFinderWake();
+      editorGrepWake();
+      editorSaveWake();
+    }
+    if (fds[0].revents)
+      return;
+  }
+}
+
+// Monotonic time in ms
+long editorNowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+// Read whatever input arrives within timeout ms (-1 waits forever) into
+// the input buffer, returns 0 if nothing came
+int editorFillInput(int timeout) {
+  if (Srv.gone)
+    return 0;
+  if (E.inpos == E.inlen)
+    E.inpos = E.inlen = 0;
+  if (E.inlen == HELIS_INPUT_BUF) {
+    memmove(E.inbuf, &E.inbuf[E.inpos], E.inlen - E.inpos);
+    E.inlen -= E.inpos;
+    E.inpos = 0;
+  }
+
+  if (timeout < 0) {
+    editorWaitInput();
+  } else {
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    if (poll(&pfd, 1, timeout) <= 0)
+      return 0;
+  }
+  int nread = read(STDIN_FILENO, &E.inbuf[E.inlen], HELIS_INPUT_BUF - E.inlen);
+  // The terminal of a server client went away. Whatever is waiting for
+  // keys is let go with Escape, and the key loop detaches
+  if (Srv.attached &&
+      (nread == 0 || (nread == -1 && errno != EAGAIN && errno != EINTR))) {
+    Srv.gone = 1;
+    return 0;
+  }
+  if (nread == -1 && errno != EAGAIN && errno != EINTR)
+    die("read");
+  if (nread <= 0)
+    return 0;
+  E.inlen += nread;
+  return 1;
+}
+
+// Input is already buffered or arrives within timeout ms
+int editorInputPending(int timeout) {
+  return editorMacroPlaying() || E.inpos < E.inlen ||
+         editorFillInput(timeout);
+}
 
-  while ((nread = read(STDIN_FILENO, &seq[0], 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN)
-      die("read");
+// Next input byte, waiting at most timeout ms (-1 forever); -1 on timeout
+int editorReadByte(int timeout) {
+  while (E.inpos == E.inlen) {
+    if (Srv.gone)
+      return timeout < 0 ? '\x1b' : -1;
+    if (!editorFillInput(timeout) && timeout >= 0)
+      return -1;
   }
+  return (unsigned char)E.inbuf[E.inpos++];
+}
+
+// Reading the key from stdin
+int editorReadTermKey() {
+  int seq[4];
+
+  seq[0] = editorReadByte(-1);
 
   if (seq[0] == '\x1b') {
 
-    if (read(STDIN_FILENO, &seq[1], 1) != 1)
+    if ((seq[1] = editorReadByte(HELIS_ESC_TIMEOUT)) == -1)
       return '\x1b';
-    if (read(STDIN_FILENO, &seq[2], 1) != 1)
+    // A key typed right after Escape is not part of a sequence
+    if (seq[1] != '[' && seq[1] != 'O') {
+      E.inpos--;
+      return '\x1b';
+    }
+    if ((seq[2] = editorReadByte(HELIS_ESC_TIMEOUT)) == -1)
       return '\x1b';
 
     if (seq[1] == '[') {
       if (seq[2] >= '0' && seq[2] <= '9') {
-        if (read(STDIN_FILENO, &seq[3], 1) != 1)
+        if ((seq[3] = editorReadByte(HELIS_ESC_TIMEOUT)) == -1)
           return '\x1b';
         if (seq[3] == '~') {
           switch (seq[2]) {
@@ -237,12 +830,13 @@ int editorReadKey() {
       }
     }
     return '\x1b';
-  } else if (seq[0] == 'g') {
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) {
+  } else if (seq[0] == 'g' && (E.mode == Normal || E.mode == Visual)) {
+    if ((seq[1] = editorReadByte(HELIS_ESC_TIMEOUT)) == -1) {
       return 'g';
     } else if (seq[1] == 'g') {
       return GG_SEQ;
     } else {
+      E.inpos--;
       return seq[0];
     }
 
@@ -251,6 +845,18 @@ int editorReadKey() {
   }
 }
 
+// Next key, taken from a macro being replayed before the terminal. Typed
+// keys are recorded while recording a macro
+int editorReadKey() {
+  int c;
+  if (editorMacroNext(&c))
+    return c;
+  c = editorReadTermKey();
+  if (!Srv.gone)
+    editorMacroRecord(c);
+  return c;
+}
+
 // Getting the cursor position
 int getCursorPosition(int *rows, int *cols) {
   char buf[32];
@@ -291,128 +897,431 @@ int getWindowSize(int *rows, int *cols) {
 
 /* Syntax Highlight */
 
-int is_separator(int c) {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
-}
+// Build the character class table and keyword buckets of a syntax
+void editorSyntaxCompile(struct editorSyntax *s) {
+  if (s->compiled)
+    return;
 
-// Update Highlight
-void editorUpdateSyntax(erow *row) {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
+  char *scs = s->singleline_comment_start;
+  char *mcs = s->multiline_comment_start;
+  int nkw = 0;
+  while (s->keywords[nkw])
+    nkw++;
+
+  for (int c = 0; c < 256; c++) {
+    unsigned char cls = 0;
+    int starts_token = (scs && scs[0] == c) || (mcs && mcs[0] == c) ||
+                       ((s->flags & HL_HIGHLIGHT_STRINGS) &&
+                        (c == '"' || c == '\''));
+    for (int j = 0; j < nkw; j++)
+      if ((unsigned char)s->keywords[j][0] == c)
+        cls |= CC_KW;
+
+    if (c == '\0' || isspace(c) || strchr(HL_SEPARATORS, c) != NULL)
+      cls |= CC_SEP;
+    if (isdigit(c))
+      cls |= CC_DIGIT;
+    if (!starts_token && !(cls & CC_KW)) {
+      if (isspace(c))
+        cls |= CC_SPACE;
+      else if (!(cls & CC_SEP))
+        cls |= CC_WORD;
+    }
+    // A keyword only starts after a separator, so within a word its first
+    // char is as plain as any other
+    if ((cls & CC_WORD) ||
+        ((cls & CC_KW) && !starts_token && !(cls & CC_SEP) && !isspace(c)))
+      cls |= CC_INWORD;
+    s->cclass[c] = cls;
+  }
 
-  // If no syntax return
-  if (E.syntax == NULL)
-    return;
+  // The vectorized word scan checks ranges, so it is only valid when the
+  // whole range is plain word chars for this syntax
+  s->simd_word = 1;
+  for (int c = 0; c < 256; c++) {
+    if ((isalnum(c) || c == '_' || c >= 0x80) && !(s->cclass[c] & CC_INWORD))
+      s->simd_word = 0;
+  }
 
-  char **keywords = E.syntax->keywords;
+  // Counting sort of keywords by first char, keeping their order
+  s->kw = malloc(sizeof(struct editorKeyword) * (nkw ? nkw : 1));
+  memset(s->kwstart, 0, sizeof(s->kwstart));
+  for (int j = 0; j < nkw; j++)
+    s->kwstart[(unsigned char)s->keywords[j][0] + 1]++;
+  for (int c = 0; c < 256; c++)
+    s->kwstart[c + 1] += s->kwstart[c];
+  unsigned short fill[256];
+  memcpy(fill, s->kwstart, sizeof(fill));
+  for (int j = 0; j < nkw; j++) {
+    struct editorKeyword *kw = &s->kw[fill[(unsigned char)s->keywords[j][0]]++];
+    kw->s = s->keywords[j];
+    kw->len = strlen(kw->s);
+    kw->hl = HL_KEYWORD1;
+    if (kw->s[kw->len - 1] == '|') {
+      kw->len--;
+      kw->hl = HL_KEYWORD2;
+    }
+  }
 
-  char *scs = E.syntax->singleline_comment_start;
-  char *mcs = E.syntax->multiline_comment_start;
-  char *mce = E.syntax->multiline_comment_end;
+  // A keyword match also looks at the char after it
+  s->lookahead = 1;
+  char *delims[] = {scs, mcs, s->multiline_comment_end};
+  for (int j = 0; j < 3; j++)
+    if (delims[j] && (int)strlen(delims[j]) > s->lookahead)
+      s->lookahead = strlen(delims[j]);
+  for (int j = 0; j < nkw; j++)
+    if (s->kw[j].len + 1 > s->lookahead)
+      s->lookahead = s->kw[j].len + 1;
+
+  s->compiled = 1;
+}
 
-  int scs_len = scs ? strlen(scs) : 0;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
+// Index of the first a or b in s[i..n), or n
+int hlFindByte(const char *s, int i, int n, char a, char b) {
+#ifdef __SSE2__
+  __m128i va = _mm_set1_epi8(a);
+  __m128i vb = _mm_set1_epi8(b);
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)&s[i]);
+    int m = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(x, va), _mm_cmpeq_epi8(x, vb)));
+    if (m)
+      return i + __builtin_ctz(m);
+  }
+#endif
+  for (; i < n; i++)
+    if (s[i] == a || s[i] == b)
+      return i;
+  return n;
+}
 
-  int prev_sep = 1;
-  int in_string = 0;
-  int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+// Index of the first char in s[i..n) that is not of class cls, or n
+int hlSkipClass(const unsigned char *cclass, const char *s, int i, int n,
+                unsigned char cls) {
+  while (i < n && (cclass[(unsigned char)s[i]] & cls))
+    i++;
+  return i;
+}
 
-  int i = 0;
-  while (i < row->rsize) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+// Skip a run of whitespace
+int hlSkipSpaces(const unsigned char *cclass, const char *s, int i, int n) {
+#ifdef __SSE2__
+  __m128i sp = _mm_set1_epi8(' ');
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)&s[i]);
+    int m = _mm_movemask_epi8(_mm_cmpeq_epi8(x, sp)) ^ 0xffff;
+    if (m) {
+      i += __builtin_ctz(m);
+      break;
+    }
+  }
+#endif
+  return hlSkipClass(cclass, s, i, n, CC_SPACE);
+}
 
-    if (scs_len && !in_string && !in_comment) {
-      if (!strncmp(&row->render[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+// Skip the rest of a word, from a char past its start
+int hlSkipWord(struct editorSyntax *syn, const char *s, int i, int n) {
+#ifdef __SSE2__
+  if (syn->simd_word) {
+    __m128i a1 = _mm_set1_epi8('a' - 1), z1 = _mm_set1_epi8('z' + 1);
+    __m128i d1 = _mm_set1_epi8('0' - 1), d9 = _mm_set1_epi8('9' + 1);
+    __m128i us = _mm_set1_epi8('_'), lc = _mm_set1_epi8(0x20);
+    for (; i + 16 <= n; i += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i *)&s[i]);
+      __m128i l = _mm_or_si128(x, lc);
+      __m128i word = _mm_and_si128(_mm_cmpgt_epi8(l, a1), _mm_cmplt_epi8(l, z1));
+      word = _mm_or_si128(
+          word, _mm_and_si128(_mm_cmpgt_epi8(x, d1), _mm_cmplt_epi8(x, d9)));
+      word = _mm_or_si128(word, _mm_cmpeq_epi8(x, us));
+      int m = (_mm_movemask_epi8(word) | _mm_movemask_epi8(x)) ^ 0xffff;
+      if (m) {
+        i += __builtin_ctz(m);
         break;
       }
     }
+  }
+#endif
+  return hlSkipClass(syn->cclass, s, i, n, CC_INWORD);
+}
 
-    if (mcs_len && mce_len && !in_string) {
-      if (in_comment) {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len)) {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
-          continue;
-        } else {
-          i++;
-          continue;
-        }
-      } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-        i += mcs_len;
-        in_comment = 1;
+// Lexer state between two chars of a row
+struct hlState {
+  int in_comment;
+  int in_string;
+  int prev_sep;
+};
+
+// Render offset a row can be lexed up to, a little before the gap of a
+// long row being typed into so that no token looks past it
+int hlGapEnd(erow *row) {
+  if (row->gap >= row->nchunks)
+    return row->rsize;
+  return row->chunks[row->gap].ri - E.syntax->lookahead - 1;
+}
+
+// Lex row->render from i with state st, writing every hl byte on the way.
+// From conv on, stop as soon as a plain separator is reached that the
+// previous highlight also left plain: everything after it is unchanged.
+// Returns 1 on such convergence, otherwise st holds the end of row state
+int hlLex(erow *row, int i, int conv, struct hlState *st) {
+  struct editorSyntax *syn = E.syntax;
+  const unsigned char *cclass = syn->cclass;
+  char *render = row->render;
+  unsigned char *hl = row->hl;
+  int rsize = row->rsize;
+
+  char *scs = syn->singleline_comment_start;
+  char *mcs = syn->multiline_comment_start;
+  char *mce = syn->multiline_comment_end;
+
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+
+  int prev_sep = st->prev_sep;
+  int in_string = st->in_string;
+  int in_comment = st->in_comment;
+  int lim = hlGapEnd(row);
+
+  while (i < rsize) {
+    // A long row being typed into is lexed up to a little before its gap,
+    // which moves on when the lexing gets there
+    if (i >= lim) {
+      editorRowGapTo(row, row->gap + 1);
+      lim = hlGapEnd(row);
+      continue;
+    }
+
+    // Inside a multiline comment jump straight to the next terminator
+    if (in_comment) {
+      int j = hlFindByte(render, i, lim, mce[0], mce[0]);
+      memset(&hl[i], HL_MLCOMMENT, j - i);
+      i = j;
+      if (i >= lim)
         continue;
+      if (!strncmp(&render[i], mce, mce_len)) {
+        memset(&hl[i], HL_MLCOMMENT, mce_len);
+        i += mce_len;
+        in_comment = 0;
+        prev_sep = 1;
+      } else {
+        hl[i++] = HL_MLCOMMENT;
       }
+      continue;
     }
 
-    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (in_string) {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->rsize) {
-          row->hl[i + 1] = HL_STRING;
-          i += 2;
-          continue;
-        }
-        if (c == in_string)
-          in_string = 0;
-        i++;
-        prev_sep = 1;
+    // Inside a string jump to the next quote or escape
+    if (in_string) {
+      int j = hlFindByte(render, i, lim, in_string, '\\');
+      memset(&hl[i], HL_STRING, j - i);
+      i = j;
+      if (i >= lim)
+        continue;
+      hl[i] = HL_STRING;
+      if (render[i] == '\\' && i + 1 < rsize) {
+        hl[i + 1] = HL_STRING;
+        i += 2;
         continue;
-      } else {
-        if (c == '"' || c == '\'') {
-          in_string = c;
-          row->hl[i] = HL_STRING;
-          i++;
-          continue;
-        }
       }
+      if (render[i] == in_string)
+        in_string = 0;
+      i++;
+      prev_sep = 1;
+      continue;
+    }
+
+    char c = render[i];
+    unsigned char cls = cclass[(unsigned char)c];
+
+    // Runs of whitespace and of word chars that can't start a token
+    if (cls & CC_SPACE) {
+      if (i >= conv && hl[i] == HL_NORMAL)
+        return 1;
+      int j = hlSkipSpaces(cclass, render, i, lim);
+      memset(&hl[i], HL_NORMAL, j - i);
+      i = j;
+      prev_sep = 1;
+      continue;
+    }
+    if ((cls & CC_WORD) && !(cls & CC_DIGIT)) {
+      int j = hlSkipWord(syn, render, i + 1, lim);
+      memset(&hl[i], HL_NORMAL, j - i);
+      i = j;
+      prev_sep = 0;
+      continue;
+    }
+
+    unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
+
+    if (scs_len && !strncmp(&render[i], scs, scs_len)) {
+      // On both sides of the gap of a long row being typed into
+      int r = row->gap < row->nchunks ? row->chunks[row->gap].ri : rsize;
+      memset(&hl[i], HL_COMMENT, r - i);
+      memset(&hl[r + row->rgap], HL_COMMENT, rsize - r);
+      i = rsize;
+      break;
+    }
+
+    if (mcs_len && mce_len && !strncmp(&render[i], mcs, mcs_len)) {
+      memset(&hl[i], HL_MLCOMMENT, mcs_len);
+      i += mcs_len;
+      in_comment = 1;
+      continue;
     }
 
-    if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
+    if ((syn->flags & HL_HIGHLIGHT_STRINGS) && (c == '"' || c == '\'')) {
+      in_string = c;
+      hl[i++] = HL_STRING;
+      continue;
+    }
+
+    if (syn->flags & HL_HIGHLIGHT_NUMBERS) {
+      if (((cls & CC_DIGIT) && (prev_sep || prev_hl == HL_NUMBER)) ||
           (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
-        i++;
+        hl[i++] = HL_NUMBER;
         prev_sep = 0;
         continue;
       }
     }
 
-    if (prev_sep) {
-      int j;
-      for (j = 0; keywords[j]; j++) {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2)
-          klen--;
-
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-            is_separator(row->render[i + klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
+    if (prev_sep && (cls & CC_KW)) {
+      int k;
+      int kend = syn->kwstart[(unsigned char)c + 1];
+      for (k = syn->kwstart[(unsigned char)c]; k < kend; k++) {
+        struct editorKeyword *kw = &syn->kw[k];
+        if (!strncmp(&render[i], kw->s, kw->len) &&
+            (cclass[(unsigned char)render[i + kw->len]] & CC_SEP)) {
+          memset(&hl[i], kw->hl, kw->len);
+          i += kw->len;
           break;
         }
       }
-      if (keywords[j] != NULL) {
+      if (k < kend) {
+        prev_sep = 0;
+        continue;
+      }
+      // Not a keyword, the rest of the word is plain
+      if (cls & CC_INWORD) {
+        int j = hlSkipWord(syn, render, i + 1, lim);
+        memset(&hl[i], HL_NORMAL, j - i);
+        i = j;
         prev_sep = 0;
         continue;
       }
     }
 
-    prev_sep = is_separator(c);
-    i++;
+    prev_sep = (cls & CC_SEP) != 0;
+    if (prev_sep && i >= conv && hl[i] == HL_NORMAL)
+      return 1;
+    hl[i++] = HL_NORMAL;
+  }
+
+  st->prev_sep = prev_sep;
+  st->in_string = in_string;
+  st->in_comment = in_comment;
+  return 0;
+}
+
+// Lex a cold row aside from the chars in its block, keeping only what
+// outlives the highlight: the open comment state and the bracket summary.
+// Returns 1 if the open comment state changed
+int editorHighlightCold(erow *row) {
+  const char *chars = editorRowChars(row);
+  int tabs = 0;
+  for (int j = 0; j < row->size; j++)
+    tabs += chars[j] == '\t';
+  erow tmp = {.idx = row->idx};
+  tmp.render = malloc(row->size + tabs * (HELIS_TAB_STOP - 1) + 1);
+  tmp.rsize = editorRenderChars(tmp.render, chars, row->size, 0);
+  tmp.hl = malloc(tmp.rsize + 1);
+
+  struct hlState st = {0, 0, 1};
+  if (E.syntax) {
+    st.in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+    hlLex(&tmp, 0, tmp.rsize, &st);
+  } else {
+    memset(tmp.hl, HL_NORMAL, tmp.rsize);
+    st.in_comment = row->hl_open_comment;
+  }
+  editorBracketsSum(row->brackets, tmp.render, tmp.hl, tmp.rsize);
+  row->brackets_stale = 0;
+  free(tmp.render);
+  free(tmp.hl);
+
+  int changed = (row->hl_open_comment != st.in_comment);
+  row->hl_open_comment = st.in_comment;
+  return changed;
+}
+
+// Highlight a single row, returns 1 if its open comment state changed
+int editorHighlightRow(erow *row) {
+  // A comment cascading through cold rows leaves them cold
+  if (row->chars == NULL)
+    return editorHighlightCold(row);
+  if (row->idx == E.gaprow)
+    editorGapClose();
+  row->hl = realloc(row->hl, row->rsize + 1);
+  row->brackets_stale = 1;
+
+  // If no syntax return
+  if (E.syntax == NULL) {
+    memset(row->hl, HL_NORMAL, row->rsize);
+    return 0;
+  }
+
+  struct hlState st = {0, 0, 1};
+  st.in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+  hlLex(row, 0, row->rsize, &st);
+
+  int changed = (row->hl_open_comment != st.in_comment);
+  row->hl_open_comment = st.in_comment;
+  return changed;
+}
+
+// Update Highlight, following an open comment into the next rows
+void editorUpdateSyntax(erow *row) {
+  while (editorHighlightRow(row) && row->idx + 1 < E.numrows) {
+    row = &E.row[row->idx + 1];
+    // While a macro replays the rest is only marked, and lexed once at
+    // its end
+    if (E.macros.depth > 0) {
+      row->hl_stale = 1;
+      E.macros.stale = 1;
+      return;
+    }
+  }
+}
+
+// Re-lex a row after its render changed in [at, end), starting from the
+// last plain separator whose lexing could not have seen the edit
+void editorUpdateSyntaxLocal(erow *row, int at, int end) {
+  row->brackets_stale = 1;
+  if (E.syntax == NULL) {
+    memset(&row->hl[at], HL_NORMAL, end - at);
+    return;
   }
 
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < E.numrows)
-    editorUpdateSyntax(&E.row[row->idx + 1]);
+  struct hlState st = {0, 0, 1};
+  int i = at - E.syntax->lookahead;
+  if (i > row->rsize)
+    i = row->rsize;
+  if (i < 0)
+    i = 0;
+  while (--i >= 0) {
+    if (row->hl[i] == HL_NORMAL &&
+        (E.syntax->cclass[(unsigned char)row->render[i]] & CC_SEP))
+      break;
+  }
+  if (++i == 0)
+    st.in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+
+  if (hlLex(row, i, end, &st))
+    return;
+  if (row->hl_open_comment != st.in_comment) {
+    row->hl_open_comment = st.in_comment;
+    if (row->idx + 1 < E.numrows)
+      editorUpdateSyntax(&E.row[row->idx + 1]);
+  }
 }
 
 // Syntax to Color
@@ -449,6 +1358,7 @@ void editorSelectSyntaxHighlight() {
       if (p != NULL) {
         int patlen = strlen(s->filematch[i]);
         if (s->filematch[i][0] != '.' || p[patlen] == '\0') {
+          editorSyntaxCompile(s);
           E.syntax = s;
           int filerow;
           for (filerow = 0; filerow < E.numrows; filerow++) {
@@ -462,70 +1372,869 @@ void editorSelectSyntaxHighlight() {
   }
 }
 
-/* Row Functions */
+/* Unicode */
 
-// Convert chars x to render x
-int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t') {
-      rx += (HELIS_TAB_STOP - 1) - (rx % HELIS_TAB_STOP);
+// Inclusive range of codepoints
+struct editorRange {
+  int lo, hi;
+};
+
+// Zero width codepoints (combining marks, joiners, variation selectors)
+static const struct editorRange editorZeroWidth[] = {
+    {0x0300, 0x036F},   {0x0483, 0x0489},   {0x0591, 0x05BD},
+    {0x05BF, 0x05BF},   {0x05C1, 0x05C2},   {0x05C4, 0x05C5},
+    {0x05C7, 0x05C7},   {0x0610, 0x061A},   {0x064B, 0x065F},
+    {0x0670, 0x0670},   {0x06D6, 0x06DC},   {0x06DF, 0x06E4},
+    {0x06E7, 0x06E8},   {0x06EA, 0x06ED},   {0x0711, 0x0711},
+    {0x0730, 0x074A},   {0x07A6, 0x07B0},   {0x07EB, 0x07F3},
+    {0x0816, 0x082D},   {0x0859, 0x085B},   {0x08D3, 0x08E1},
+    {0x08E3, 0x0902},   {0x093A, 0x093A},   {0x093C, 0x093C},
+    {0x0941, 0x0948},   {0x094D, 0x094D},   {0x0951, 0x0957},
+    {0x0962, 0x0963},   {0x0981, 0x0981},   {0x09BC, 0x09BC},
+    {0x09C1, 0x09C4},   {0x09CD, 0x09CD},   {0x09E2, 0x09E3},
+    {0x0A01, 0x0A02},   {0x0A3C, 0x0A3C},   {0x0A41, 0x0A51},
+    {0x0A70, 0x0A71},   {0x0A75, 0x0A75},   {0x0A81, 0x0A82},
+    {0x0ABC, 0x0ABC},   {0x0AC1, 0x0AC8},   {0x0ACD, 0x0ACD},
+    {0x0AE2, 0x0AE3},   {0x0B01, 0x0B01},   {0x0B3C, 0x0B3C},
+    {0x0B3F, 0x0B3F},   {0x0B41, 0x0B44},   {0x0B4D, 0x0B4D},
+    {0x0B56, 0x0B56},   {0x0B62, 0x0B63},   {0x0B82, 0x0B82},
+    {0x0BC0, 0x0BC0},   {0x0BCD, 0x0BCD},   {0x0C00, 0x0C00},
+    {0x0C3E, 0x0C40},   {0x0C46, 0x0C56},   {0x0C62, 0x0C63},
+    {0x0CBC, 0x0CBC},   {0x0CCC, 0x0CCD},   {0x0CE2, 0x0CE3},
+    {0x0D00, 0x0D01},   {0x0D41, 0x0D44},   {0x0D4D, 0x0D4D},
+    {0x0D62, 0x0D63},   {0x0DCA, 0x0DCA},   {0x0DD2, 0x0DD6},
+    {0x0E31, 0x0E31},   {0x0E34, 0x0E3A},   {0x0E47, 0x0E4E},
+    {0x0EB1, 0x0EB1},   {0x0EB4, 0x0EBC},   {0x0EC8, 0x0ECD},
+    {0x0F18, 0x0F19},   {0x0F35, 0x0F35},   {0x0F37, 0x0F37},
+    {0x0F39, 0x0F39},   {0x0F71, 0x0F7E},   {0x0F80, 0x0F84},
+    {0x0F86, 0x0F87},   {0x0F8D, 0x0FBC},   {0x0FC6, 0x0FC6},
+    {0x102D, 0x1030},   {0x1032, 0x1037},   {0x1039, 0x103A},
+    {0x103D, 0x103E},   {0x1058, 0x1059},   {0x1160, 0x11FF},
+    {0x135D, 0x135F},   {0x1712, 0x1714},   {0x1732, 0x1734},
+    {0x1752, 0x1753},   {0x1772, 0x1773},   {0x17B4, 0x17B5},
+    {0x17B7, 0x17BD},   {0x17C6, 0x17C6},   {0x17C9, 0x17D3},
+    {0x17DD, 0x17DD},   {0x180B, 0x180E},   {0x18A9, 0x18A9},
+    {0x1920, 0x1922},   {0x1927, 0x1928},   {0x1932, 0x1932},
+    {0x1939, 0x193B},   {0x1A17, 0x1A18},   {0x1AB0, 0x1AFF},
+    {0x1B00, 0x1B03},   {0x1B34, 0x1B34},   {0x1B36, 0x1B3A},
+    {0x1B3C, 0x1B3C},   {0x1B42, 0x1B42},   {0x1B6B, 0x1B73},
+    {0x1DC0, 0x1DFF},   {0x200B, 0x200F},   {0x202A, 0x202E},
+    {0x2060, 0x2064},   {0x20D0, 0x20F0},   {0x2CEF, 0x2CF1},
+    {0x2DE0, 0x2DFF},   {0x302A, 0x302D},   {0x3099, 0x309A},
+    {0xA66F, 0xA672},   {0xA674, 0xA67D},   {0xA69E, 0xA69F},
+    {0xA6F0, 0xA6F1},   {0xA802, 0xA802},   {0xA806, 0xA806},
+    {0xA80B, 0xA80B},   {0xA825, 0xA826},   {0xA8C4, 0xA8C5},
+    {0xA8E0, 0xA8F1},   {0xA926, 0xA92D},   {0xA947, 0xA951},
+    {0xA980, 0xA982},   {0xA9B3, 0xA9B3},   {0xA9B6, 0xA9B9},
+    {0xA9BC, 0xA9BC},   {0xAA29, 0xAA2E},   {0xAA31, 0xAA32},
+    {0xAA35, 0xAA36},   {0xAA43, 0xAA43},   {0xAA4C, 0xAA4C},
+    {0xAAB0, 0xAAB0},   {0xAAB2, 0xAAB4},   {0xAAB7, 0xAAB8},
+    {0xAABE, 0xAABF},   {0xAAC1, 0xAAC1},   {0xAAEC, 0xAAED},
+    {0xAAF6, 0xAAF6},   {0xABE5, 0xABE5},   {0xABE8, 0xABE8},
+    {0xABED, 0xABED},   {0xFB1E, 0xFB1E},   {0xFE00, 0xFE0F},
+    {0xFE20, 0xFE2F},   {0xFEFF, 0xFEFF},   {0xFFF9, 0xFFFB},
+    {0x101FD, 0x101FD}, {0x10A01, 0x10A0F}, {0x10A38, 0x10A3F},
+    {0x1D167, 0x1D169}, {0x1D173, 0x1D182}, {0x1D185, 0x1D18B},
+    {0x1D1AA, 0x1D1AD}, {0x1D242, 0x1D244}, {0xE0001, 0xE0001},
+    {0xE0020, 0xE007F}, {0xE0100, 0xE01EF},
+};
+
+// Double width codepoints (East Asian Wide and Fullwidth, emoji)
+static const struct editorRange editorWide[] = {
+    {0x1100, 0x115F},   {0x231A, 0x231B},   {0x2329, 0x232A},
+    {0x23E9, 0x23EC},   {0x23F0, 0x23F0},   {0x23F3, 0x23F3},
+    {0x25FD, 0x25FE},   {0x2614, 0x2615},   {0x2648, 0x2653},
+    {0x267F, 0x267F},   {0x2693, 0x2693},   {0x26A1, 0x26A1},
+    {0x26AA, 0x26AB},   {0x26BD, 0x26BE},   {0x26C4, 0x26C5},
+    {0x26CE, 0x26CE},   {0x26D4, 0x26D4},   {0x26EA, 0x26EA},
+    {0x26F2, 0x26F3},   {0x26F5, 0x26F5},   {0x26FA, 0x26FA},
+    {0x26FD, 0x26FD},   {0x2705, 0x2705},   {0x270A, 0x270B},
+    {0x2728, 0x2728},   {0x274C, 0x274C},   {0x274E, 0x274E},
+    {0x2753, 0x2755},   {0x2757, 0x2757},   {0x2795, 0x2797},
+    {0x27B0, 0x27B0},   {0x27BF, 0x27BF},   {0x2B1B, 0x2B1C},
+    {0x2B50, 0x2B50},   {0x2B55, 0x2B55},   {0x2E80, 0x303E},
+    {0x3041, 0x33FF},   {0x3400, 0x4DBF},   {0x4E00, 0x9FFF},
+    {0xA000, 0xA4CF},   {0xA960, 0xA97F},   {0xAC00, 0xD7A3},
+    {0xF900, 0xFAFF},   {0xFE10, 0xFE19},   {0xFE30, 0xFE6F},
+    {0xFF00, 0xFF60},   {0xFFE0, 0xFFE6},   {0x16FE0, 0x16FE4},
+    {0x17000, 0x18AFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004},
+    {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A},
+    {0x1F200, 0x1F202}, {0x1F210, 0x1F23B}, {0x1F240, 0x1F248},
+    {0x1F250, 0x1F251}, {0x1F260, 0x1F265}, {0x1F300, 0x1F320},
+    {0x1F32D, 0x1F335}, {0x1F337, 0x1F37C}, {0x1F37E, 0x1F393},
+    {0x1F3A0, 0x1F3CA}, {0x1F3CF, 0x1F3D3}, {0x1F3E0, 0x1F3F0},
+    {0x1F3F4, 0x1F3F4}, {0x1F3F8, 0x1F43E}, {0x1F440, 0x1F440},
+    {0x1F442, 0x1F4FC}, {0x1F4FF, 0x1F53D}, {0x1F54B, 0x1F54E},
+    {0x1F550, 0x1F567}, {0x1F57A, 0x1F57A}, {0x1F595, 0x1F596},
+    {0x1F5A4, 0x1F5A4}, {0x1F5FB, 0x1F64F}, {0x1F680, 0x1F6C5},
+    {0x1F6CC, 0x1F6CC}, {0x1F6D0, 0x1F6D2}, {0x1F6D5, 0x1F6D7},
+    {0x1F6EB, 0x1F6EC}, {0x1F6F4, 0x1F6FC}, {0x1F7E0, 0x1F7EB},
+    {0x1F90C, 0x1F93A}, {0x1F93C, 0x1F945}, {0x1F947, 0x1F9FF},
+    {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+};
+
+// Widths of the Basic Multilingual Plane, filled by editorWidthInit
+static unsigned char editorWidthBmp[0x10000];
+
+// Whether cp is in one of n sorted ranges
+int editorRangeFind(const struct editorRange *r, int n, int cp) {
+  int lo = 0, hi = n - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (cp < r[mid].lo)
+      hi = mid - 1;
+    else if (cp > r[mid].hi)
+      lo = mid + 1;
+    else
+      return 1;
+  }
+  return 0;
+}
+
+// Precompute the BMP width table from the ranges
+void editorWidthInit() {
+  memset(editorWidthBmp, 1, sizeof(editorWidthBmp));
+  int nz = sizeof(editorZeroWidth) / sizeof(editorZeroWidth[0]);
+  int nw = sizeof(editorWide) / sizeof(editorWide[0]);
+  for (int j = 0; j < nw && editorWide[j].lo < 0x10000; j++)
+    memset(&editorWidthBmp[editorWide[j].lo], 2,
+           editorWide[j].hi - editorWide[j].lo + 1);
+  for (int j = 0; j < nz && editorZeroWidth[j].lo < 0x10000; j++)
+    memset(&editorWidthBmp[editorZeroWidth[j].lo], 0,
+           editorZeroWidth[j].hi - editorZeroWidth[j].lo + 1);
+}
+
+// Columns taken by a codepoint, invalid ones are shown as one column
+int editorCodepointWidth(int cp) {
+  if (cp < 0)
+    return 1;
+  if (cp < 0x10000)
+    return editorWidthBmp[cp];
+  if (editorRangeFind(editorZeroWidth,
+                      sizeof(editorZeroWidth) / sizeof(editorZeroWidth[0]), cp))
+    return 0;
+  if (editorRangeFind(editorWide, sizeof(editorWide) / sizeof(editorWide[0]),
+                      cp))
+    return 2;
+  return 1;
+}
+
+// Decode the UTF-8 sequence at s into cp, returns its length; malformed
+// sequences decode as a single byte with cp -1
+int editorUtf8Decode(const char *s, int len, int *cp) {
+  const unsigned char *u = (const unsigned char *)s;
+  int n, min;
+  if (u[0] < 0x80) {
+    *cp = u[0];
+    return 1;
+  } else if ((u[0] & 0xE0) == 0xC0) {
+    n = 2;
+    min = 0x80;
+    *cp = u[0] & 0x1F;
+  } else if ((u[0] & 0xF0) == 0xE0) {
+    n = 3;
+    min = 0x800;
+    *cp = u[0] & 0x0F;
+  } else if ((u[0] & 0xF8) == 0xF0) {
+    n = 4;
+    min = 0x10000;
+    *cp = u[0] & 0x07;
+  } else {
+    *cp = -1;
+    return 1;
+  }
+
+  if (n > len) {
+    *cp = -1;
+    return 1;
+  }
+  for (int j = 1; j < n; j++) {
+    if ((u[j] & 0xC0) != 0x80) {
+      *cp = -1;
+      return 1;
     }
-    rx++;
+    *cp = (*cp << 6) | (u[j] & 0x3F);
   }
-  return rx;
+  // Reject overlong forms, surrogates and C1 controls
+  if (*cp < min || *cp > 0x10FFFF || (*cp >= 0xD800 && *cp <= 0xDFFF) ||
+      *cp < 0xA0)
+    *cp = -1;
+  return *cp == -1 ? 1 : n;
 }
 
-// Convert rendex x to chars x
-int editorRowRxToCx(erow *row, int rx) {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t')
-      cur_rx += (HELIS_TAB_STOP - 1) - (cur_rx % HELIS_TAB_STOP);
-    cur_rx++;
+// Whether len bytes of s are all ASCII
+int editorIsAscii(const char *s, int len) {
+  int j = 0;
+#ifdef __SSE2__
+  for (; j + 64 <= len; j += 64) {
+    __m128i x = _mm_or_si128(
+        _mm_or_si128(_mm_loadu_si128((const __m128i *)&s[j]),
+                     _mm_loadu_si128((const __m128i *)&s[j + 16])),
+        _mm_or_si128(_mm_loadu_si128((const __m128i *)&s[j + 32]),
+                     _mm_loadu_si128((const __m128i *)&s[j + 48])));
+    if (_mm_movemask_epi8(x))
+      return 0;
+  }
+#endif
+  for (; j < len; j++)
+    if (s[j] & 0x80)
+      return 0;
+  return 1;
+}
 
-    if (cur_rx > rx)
-      return cx;
+// Start of the char after the one at cx, skipping combining marks
+int editorRowNextCx(erow *row, int cx) {
+  editorRowResident(row);
+  if (cx >= row->size)
+    return row->size;
+  int cp;
+  cx += editorUtf8Decode(&row->chars[cx], row->size - cx, &cp);
+  if (row->ascii)
+    return cx;
+  while (cx < row->size && (unsigned char)row->chars[cx] >= 0x80) {
+    int n = editorUtf8Decode(&row->chars[cx], row->size - cx, &cp);
+    if (editorCodepointWidth(cp) != 0 || cp == -1)
+      break;
+    cx += n;
   }
   return cx;
 }
 
-// Update Row
-void editorUpdateRow(erow *row) {
-
-  // Handling tabs
-  int tabs = 0;
-  int j;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t')
-      tabs++;
+// Start of the char before cx, including its combining marks
+int editorRowPrevCx(erow *row, int cx) {
+  editorRowResident(row);
+  if (cx <= 0)
+    return 0;
+  if (row->ascii)
+    return cx - 1;
+  while (cx > 0) {
+    int at = cx - 1;
+    // Back up over continuation bytes to a lead byte
+    while (at > 0 && cx - at < 4 && (row->chars[at] & 0xC0) == 0x80)
+      at--;
+    int cp;
+    if (editorUtf8Decode(&row->chars[at], row->size - at, &cp) != cx - at) {
+      cx--;
+      break;
+    }
+    cx = at;
+    if (editorCodepointWidth(cp) != 0)
+      break;
   }
+  return cx;
+}
 
-  free(row->render);
-  row->render = malloc(row->size + tabs * (HELIS_TAB_STOP - 1) + 1);
+/* Row Functions */
 
-  int idx = 0;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while ((idx % HELIS_TAB_STOP) != 0)
-        row->render[idx++] = ' ';
+// Render x reached after rendering len chars starting at render x rx
+int editorRenderWidth(const char *s, int len, int rx) {
+  for (int j = 0; j < len; j++) {
+    if (s[j] == '\t') {
+      rx += HELIS_TAB_STOP - (rx % HELIS_TAB_STOP);
+    } else if (s[j] & 0x80) {
+      int cp;
+      j += editorUtf8Decode(&s[j], len - j, &cp) - 1;
+      rx += editorCodepointWidth(cp);
     } else {
-      row->render[idx++] = row->chars[j];
+      rx++;
     }
   }
+  return rx;
+}
+
+// Move render x rx and render offset ri past len chars of s
+void editorRenderAdvance(const char *s, int len, int *rx, int *ri) {
+  for (int j = 0; j < len; j++) {
+    if (s[j] == '\t') {
+      int w = HELIS_TAB_STOP - (*rx % HELIS_TAB_STOP);
+      *rx += w;
+      *ri += w;
+    } else if (s[j] & 0x80) {
+      int cp;
+      int n = editorUtf8Decode(&s[j], len - j, &cp);
+      j += n - 1;
+      *rx += editorCodepointWidth(cp);
+      *ri += n;
+    } else {
+      (*rx)++;
+      (*ri)++;
+    }
+  }
+}
+
+// Render len chars into dst starting at render x rx, returns the bytes
+// written; tabs expand to spaces and multibyte chars are copied as is
+int editorRenderChars(char *dst, const char *s, int len, int rx) {
+  int idx = 0;
+  for (int j = 0; j < len; j++) {
+    if (s[j] == '\t') {
+      dst[idx++] = ' ';
+      while ((++rx % HELIS_TAB_STOP) != 0)
+        dst[idx++] = ' ';
+    } else if (s[j] & 0x80) {
+      int cp;
+      int n = editorUtf8Decode(&s[j], len - j, &cp);
+      memcpy(&dst[idx], &s[j], n);
+      idx += n;
+      j += n - 1;
+      rx += editorCodepointWidth(cp);
+    } else {
+      dst[idx++] = s[j];
+      rx++;
+    }
+  }
+  return idx;
+}
+
+// Last chunk of a long row starting at or before x, an offset of the kind
+// given by key
+struct erowChunk *editorRowFindChunk(erow *row, int x, enum erowChunkKey key) {
+  int lo = 0, hi = row->nchunks - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    struct erowChunk *ch = &row->chunks[mid];
+    int start = key == CHUNK_CX ? ch->cx : key == CHUNK_RX ? ch->rx : ch->ri;
+    if (start <= x)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return &row->chunks[lo];
+}
+
+// Chars offset the gap of a long row being typed into is at, the size of
+// the row if it has none
+int editorRowGapCx(erow *row) {
+  return row->gap < row->nchunks ? row->chunks[row->gap].cx : row->size;
+}
+
+// Render offset the gap of a long row being typed into is at, the render
+// size of the row if it has none
+int editorRowGapRi(erow *row) {
+  return row->gap < row->nchunks ? row->chunks[row->gap].ri : row->rsize;
+}
+
+// Chars of a row indexed by chars offsets on the same side of its gap as
+// cx, which go up to *end
+const char *editorRowSide(erow *row, int cx, int *end) {
+  int g = editorRowGapCx(row);
+  if (cx < g) {
+    *end = g;
+    return row->chars;
+  }
+  *end = row->size;
+  return row->chars + row->cgap;
+}
+
+// Index in render and hl of render offset i of a row
+int editorRowRi(erow *row, int i) {
+  return i < editorRowGapRi(row) ? i : i + row->rgap;
+}
+
+// Convert chars x to render x
+int editorRowCxToRx(erow *row, int cx) {
+  editorRowResident(row);
+  if (row->chunks) {
+    struct erowChunk *ch = editorRowFindChunk(row, cx, CHUNK_CX);
+    int end;
+    const char *s = editorRowSide(row, ch->cx, &end);
+    return editorRenderWidth(&s[ch->cx], cx - ch->cx, ch->rx);
+  }
+  return editorRenderWidth(row->chars, cx, 0);
+}
+
+// Convert rendex x to chars x
+int editorRowRxToCx(erow *row, int rx) {
+  editorRowResident(row);
+  int cur_rx = 0;
+  int cx = 0;
+  if (row->chunks) {
+    struct erowChunk *ch = editorRowFindChunk(row, rx, CHUNK_RX);
+    cur_rx = ch->rx;
+    cx = ch->cx;
+  }
+  int end;
+  const char *s = editorRowSide(row, cx, &end);
+  while (cx < end) {
+    int n = 1, w = 1;
+    if (s[cx] == '\t') {
+      w = HELIS_TAB_STOP - (cur_rx % HELIS_TAB_STOP);
+    } else if (s[cx] & 0x80) {
+      int cp;
+      n = editorUtf8Decode(&s[cx], end - cx, &cp);
+      w = editorCodepointWidth(cp);
+    }
+    if (cur_rx + w > rx)
+      return cx;
+    cur_rx += w;
+    cx += n;
+  }
+  return cx;
+}
+
+// Convert chars x to an offset into render
+int editorRowCxToRender(erow *row, int cx) {
+  editorRowResident(row);
+  if (row->ascii)
+    return editorRowCxToRx(row, cx);
+  int rx = 0, idx = 0, j = 0;
+  if (row->chunks) {
+    struct erowChunk *ch = editorRowFindChunk(row, cx, CHUNK_CX);
+    rx = ch->rx;
+    idx = ch->ri;
+    j = ch->cx;
+  }
+  if (cx > row->size)
+    cx = row->size;
+  int end;
+  const char *s = editorRowSide(row, j, &end);
+  editorRenderAdvance(&s[j], cx - j, &rx, &idx);
+  return idx;
+}
+
+// Convert an offset into render to chars x
+int editorRowRenderToCx(erow *row, int at) {
+  editorRowResident(row);
+  if (row->ascii)
+    return editorRowRxToCx(row, at);
+  int rx = 0, idx = 0, cx = 0;
+  if (row->chunks) {
+    struct erowChunk *ch = editorRowFindChunk(row, at, CHUNK_RI);
+    rx = ch->rx;
+    idx = ch->ri;
+    cx = ch->cx;
+  }
+  int end;
+  const char *s = editorRowSide(row, cx, &end);
+  while (cx < end) {
+    int n = 1, w = 1, bytes = 1;
+    if (s[cx] == '\t') {
+      w = bytes = HELIS_TAB_STOP - (rx % HELIS_TAB_STOP);
+    } else if (s[cx] & 0x80) {
+      int cp;
+      n = bytes = editorUtf8Decode(&s[cx], end - cx, &cp);
+      w = editorCodepointWidth(cp);
+    }
+    // The spaces of a tab map back to it, the bytes of a multibyte char
+    // to its own bytes
+    if (idx + bytes > at)
+      return s[cx] == '\t' ? cx : cx + (at - idx);
+    idx += bytes;
+    rx += w;
+    cx += n;
+  }
+  return row->size;
+}
+
+// Move a chunk start forward to the first char starting at or after cx
+void editorRowWalk(erow *row, struct erowChunk *ch, int cx) {
+  int end;
+  const char *s = editorRowSide(row, ch->cx, &end);
+  while (ch->cx < cx && ch->cx < end) {
+    int n = 1;
+    if (s[ch->cx] == '\t') {
+      int w = HELIS_TAB_STOP - (ch->rx % HELIS_TAB_STOP);
+      ch->rx += w;
+      ch->ri += w;
+    } else if (s[ch->cx] & 0x80) {
+      int cp;
+      n = editorUtf8Decode(&s[ch->cx], end - ch->cx, &cp);
+      ch->rx += editorCodepointWidth(cp);
+      ch->ri += n;
+    } else {
+      ch->rx++;
+      ch->ri++;
+    }
+    ch->cx += n;
+  }
+}
+
+// Count the tabs of chunk j of a long row
+void editorRowCountTabs(erow *row, int j) {
+  struct erowChunk *ch = &row->chunks[j];
+  int next = j + 1 < row->nchunks ? ch[1].cx : row->size;
+  int end;
+  const char *s = editorRowSide(row, ch->cx, &end);
+  ch->tabs = 0;
+  for (int x = ch->cx; x < next; x++)
+    ch->tabs += s[x] == '\t';
+}
+
+// Offset of the first tab of a row at or after cx, the size of the row if
+// there is none. Long rows only look into chunks that have tabs
+int editorRowFindTab(erow *row, int cx) {
+  if (row->chunks == NULL) {
+    char *p = memchr(&row->chars[cx], '\t', row->size - cx);
+    return p ? p - row->chars : row->size;
+  }
+  int j = editorRowFindChunk(row, cx, CHUNK_CX) - row->chunks;
+  for (; j < row->nchunks; j++) {
+    struct erowChunk *ch = &row->chunks[j];
+    if (ch->tabs == 0)
+      continue;
+    int from = ch->cx > cx ? ch->cx : cx;
+    int next = j + 1 < row->nchunks ? ch[1].cx : row->size;
+    int end;
+    const char *s = editorRowSide(row, ch->cx, &end);
+    const char *p = memchr(&s[from], '\t', next - from);
+    if (p)
+      return p - s;
+  }
+  return row->size;
+}
+
+// Rebuild the chunk index of a row, dropping it for short rows
+void editorRowBuildChunks(erow *row) {
+  free(row->chunks);
+  row->chunks = NULL;
+  row->nchunks = row->gap = 0;
+  if (row->size < HELIS_LONG_LINE)
+    return;
+
+  // Chunks start at chars, so a multibyte one can push a start forward
+  row->chunks = malloc(sizeof(struct erowChunk) *
+                       ((row->size + HELIS_CHUNK_SIZE - 1) / HELIS_CHUNK_SIZE));
+  struct erowChunk ch = {0, 0, 0, 0};
+  while (ch.cx < row->size) {
+    row->chunks[row->nchunks++] = ch;
+    editorRowWalk(row, &ch, ch.cx + HELIS_CHUNK_SIZE);
+  }
+  row->gap = row->nchunks;
+  for (int j = 0; j < row->nchunks; j++)
+    editorRowCountTabs(row, j);
+}
+
+// Shift the chunk index after an edit, splitting the chunk that grew. The
+// edit starts at render x rx_at and render offset ri_at, chunks up to the
+// next tab move by dc columns and db render bytes, the ones after it by
+// tc and tb
+void editorRowShiftChunks(erow *row, int at, int del, int len, int rx_at,
+                          int ri_at, int tab, int dc, int db, int tc,
+                          int tb) {
+  int j;
+  for (j = 0; j < row->nchunks; j++) {
+    struct erowChunk *ch = &row->chunks[j];
+    if (ch->cx <= at)
+      continue;
+    if (ch->cx < at + del) {
+      ch->cx = at;
+      ch->rx = rx_at;
+      ch->ri = ri_at;
+    } else {
+      ch->rx += (ch->cx <= tab) ? dc : tc;
+      ch->ri += (ch->cx <= tab) ? db : tb;
+      ch->cx += len - del;
+    }
+  }
+
+  // Keep chunks bounded so that conversions stay local
+  struct erowChunk *ch = editorRowFindChunk(row, at, CHUNK_CX);
+  j = ch - row->chunks;
+  int end = (j + 1 < row->nchunks) ? row->chunks[j + 1].cx : row->size;
+  if (end - ch->cx > 2 * HELIS_CHUNK_SIZE) {
+    row->chunks =
+        realloc(row->chunks, sizeof(struct erowChunk) * (row->nchunks + 1));
+    ch = &row->chunks[j];
+    memmove(&ch[2], &ch[1],
+            sizeof(struct erowChunk) * (row->nchunks - j - 1));
+    ch[1] = ch[0];
+    editorRowWalk(row, &ch[1], ch->cx + HELIS_CHUNK_SIZE);
+    row->nchunks++;
+    if (row->gap > j)
+      row->gap++;
+  }
+
+  // Chunks the edit put chars in or took chars from count their tabs again
+  j = editorRowFindChunk(row, at + len, CHUNK_CX) - row->chunks;
+  for (; j >= 0; j--) {
+    editorRowCountTabs(row, j);
+    if (row->chunks[j].cx < at)
+      break;
+  }
+}
+
+// Move the gap of a long row being typed into before chunk k, to the end
+// of the row for nchunks, moving the chars, render and hl in between
+void editorRowGapTo(erow *row, int k) {
+  int g0 = editorRowGapCx(row), r0 = editorRowGapRi(row);
+  row->gap = k;
+  int g1 = editorRowGapCx(row), r1 = editorRowGapRi(row);
+  if (g1 > g0) {
+    memmove(&row->chars[g0], &row->chars[g0 + row->cgap], g1 - g0);
+    memmove(&row->render[r0], &row->render[r0 + row->rgap], r1 - r0);
+    memmove(&row->hl[r0], &row->hl[r0 + row->rgap], r1 - r0);
+  } else {
+    memmove(&row->chars[g1 + row->cgap], &row->chars[g1], g0 - g1);
+    memmove(&row->render[r1 + row->rgap], &row->render[r1], r0 - r1);
+    memmove(&row->hl[r1 + row->rgap], &row->hl[r1], r0 - r1);
+  }
+  if (k == row->nchunks) {
+    row->chars[row->size] = '\0';
+    row->render[row->rsize] = '\0';
+  }
+}
+
+// Move the gap of a long row being typed into right after the chunk
+// holding cx
+void editorRowGapPast(erow *row, int cx) {
+  editorRowGapTo(row, editorRowFindChunk(row, cx, CHUNK_CX) - row->chunks + 1);
+}
+
+// Make the gap of a long row being typed into at least cneed chars and
+// rneed render bytes long
+void editorRowGapGrow(erow *row, int cneed, int rneed) {
+  if (row->cgap < cneed) {
+    int g = editorRowGapCx(row), gap = cneed + HELIS_GAP_SIZE;
+    row->chars = realloc(row->chars, row->size + gap + 1);
+    memmove(&row->chars[g + gap], &row->chars[g + row->cgap],
+            row->size - g + 1);
+    row->cgap = gap;
+  }
+  if (row->rgap < rneed) {
+    int r = editorRowGapRi(row), gap = rneed + HELIS_GAP_SIZE;
+    row->render = realloc(row->render, row->rsize + gap + 1);
+    row->hl = realloc(row->hl, row->rsize + gap + 1);
+    memmove(&row->render[r + gap], &row->render[r + row->rgap],
+            row->rsize - r + 1);
+    memmove(&row->hl[r + gap], &row->hl[r + row->rgap], row->rsize - r + 1);
+    row->rgap = gap;
+  }
+}
+
+// Close the gap of the row being typed into, if there is one, leaving its
+// chars, render and hl contiguous again
+void editorGapClose() {
+  if (E.gaprow == -1)
+    return;
+  erow *row = &E.row[E.gaprow];
+  E.gaprow = -1;
+  editorRowGapTo(row, row->nchunks);
+  row->chars = realloc(row->chars, row->size + 1);
+  row->render = realloc(row->render, row->rsize + 1);
+  row->hl = realloc(row->hl, row->rsize + 1);
+  row->cgap = row->rgap = 0;
+}
+
+// Let go of the chars of a row, leaving them to the save that shares them
+void editorRowDropChars(erow *row) {
+  if (row->shared) {
+    struct editorSave *s = E.save;
+    if (s->norphans == s->caporphans) {
+      s->caporphans = s->caporphans ? s->caporphans * 2 : 64;
+      s->orphans = realloc(s->orphans, sizeof(char *) * s->caporphans);
+    }
+    s->orphans[s->norphans++] = row->chars;
+  } else {
+    free(row->chars);
+  }
+  row->chars = NULL;
+  row->shared = 0;
+}
+
+// Copy the chars of a row a save is writing before they are changed
+void editorRowOwnChars(erow *row) {
+  if (!row->shared)
+    return;
+  char *chars = malloc(row->size + 1);
+  memcpy(chars, row->chars, row->size + 1);
+  editorRowDropChars(row);
+  row->chars = chars;
+}
+
+// Replace del chars at `at` with len chars from s in chars only. On the
+// row being typed into the edit is before the gap, which takes the change
+// in size
+void editorRowSplice(erow *row, int at, int del, const char *s, int len) {
+  int gapped = row->idx == E.gaprow;
+  // Words touching the edit may be split or joined by it, one running into
+  // the gap pushes it on
+  int wl = at, wr = at + del;
+  if (E.words.built) {
+    while (wl > 0 && editorIsWordChar(row->chars[wl - 1]))
+      wl--;
+    for (; wr < row->size; wr++) {
+      while (gapped && wr == editorRowGapCx(row))
+        editorRowGapTo(row, row->gap + 1);
+      if (!editorIsWordChar(row->chars[wr]))
+        break;
+    }
+    editorWordsScan(&row->chars[wl], wr - wl, -1);
+  }
+
+  editorRowOwnChars(row);
+  if (gapped) {
+    memmove(&row->chars[at + len], &row->chars[at + del],
+            editorRowGapCx(row) - at - del);
+    row->cgap -= len - del;
+    if (row->gap == row->nchunks)
+      row->chars[row->size + len - del] = '\0';
+  } else {
+    if (len > del)
+      row->chars = realloc(row->chars, row->size - del + len + 1);
+    memmove(&row->chars[at + len], &row->chars[at + del],
+            row->size - at - del + 1);
+  }
+  if (len)
+    memcpy(&row->chars[at], s, len);
+  row->size += len - del;
+  editorWordsScan(&row->chars[wl], wr - wl + len - del, 1);
+  editorSearchEdit(row, at, del, len);
+}
+
+// Whether an edit of del chars at `at` to s keeps every char around it
+// whole, so that only the chars it replaces render differently
+int editorRowCharsKept(erow *row, int at, int del, const char *s, int len) {
+  if (row->ascii && editorIsAscii(s, len))
+    return 1;
+  // A lead byte at the end of s and continuation bytes after it or at
+  // its start would make a char out of bytes from both sides
+  if ((at + del < row->size && (row->chars[at + del] & 0xC0) == 0x80) ||
+      (at < row->size && (row->chars[at] & 0xC0) == 0x80) ||
+      (len && (s[0] & 0xC0) == 0x80))
+    return 0;
+  return 1;
+}
+
+// Replace del chars at `at` with len chars from s, patching render and
+// highlight around the edit instead of rebuilding the whole row. Keys that
+// only type into a long row leave a gap right after the chunks the edit
+// touches, so that the next ones move no more than those chunks
+void editorRowPatch(erow *row, int at, int del, const char *s, int len) {
+  editorRowResident(row);
+  int gapped = E.typing && row->chunks;
+  if (!gapped || E.gaprow != row->idx)
+    editorGapClose();
+
+  // Chars between the edit and the next tab are only shifted, the tab
+  // absorbs the shift up to a whole tab stop so the tail moves by the
+  // width change plus the tab's. With a gap everything up to the tab and
+  // the matches the search may find again comes before it
+  int tab = editorRowFindTab(row, at + del);
+  if (gapped) {
+    editorRowOwnChars(row);
+    E.gaprow = row->idx;
+    int past = at + del + editorSearchLen();
+    if (tab < row->size && tab + 1 > past)
+      past = tab + 1;
+    editorRowGapPast(row, past);
+  }
+  if (!editorRowCharsKept(row, at, del, s, len)) {
+    editorGapClose();
+    editorRowSplice(row, at, del, s, len);
+    editorUpdateRow(row);
+    return;
+  }
+
+  // Render x (rx) and render offset (ri) of the edit and of its end
+  int rx0 = editorRowCxToRx(row, at);
+  int ri0 = editorRowCxToRender(row, at);
+  int rxa = rx0, ria = ri0;
+  editorRenderAdvance(&row->chars[at], del, &rxa, &ria);
+
+  int has_tab = tab < row->size;
+  int xt = has_tab ? editorRowCxToRx(row, tab) : 0;
+  int wt_old = has_tab ? HELIS_TAB_STOP - (xt % HELIS_TAB_STOP) : 0;
+
+  int rxe = rx0, rie = ri0;
+  editorRenderAdvance(s, len, &rxe, &rie);
+  int dc = rxe - rxa, db = rie - ria;
+  int wt_new = has_tab ? HELIS_TAB_STOP - ((xt + dc) % HELIS_TAB_STOP) : 0;
+  int tc = dc + wt_new - wt_old, tb = db + wt_new - wt_old;
+  if (gapped)
+    editorRowGapGrow(row, len - del, tb);
+
+  editorRowSplice(row, at, del, s, len);
+
+  // Render past the gap stays where it is
+  int old_rsize = row->rsize;
+  int rend = gapped ? editorRowGapRi(row) : old_rsize;
+  int rt = has_tab ? ria + (tab - (at + del)) : rend;
+  int tail = rt + wt_old;
+  unsigned char tab_hl = has_tab ? row->hl[rt] : HL_NORMAL;
+
+  if (!gapped && tb > 0) {
+    row->render = realloc(row->render, old_rsize + tb + 1);
+    row->hl = realloc(row->hl, old_rsize + tb + 1);
+  }
+  // Move right to left when growing and left to right when shrinking
+  if (db > 0) {
+    memmove(&row->render[tail + tb], &row->render[tail], rend - tail);
+    memmove(&row->hl[tail + tb], &row->hl[tail], rend - tail);
+    memmove(&row->render[ria + db], &row->render[ria], rt - ria);
+    memmove(&row->hl[ria + db], &row->hl[ria], rt - ria);
+  } else {
+    memmove(&row->render[ria + db], &row->render[ria], rt - ria);
+    memmove(&row->hl[ria + db], &row->hl[ria], rt - ria);
+    memmove(&row->render[tail + tb], &row->render[tail], rend - tail);
+    memmove(&row->hl[tail + tb], &row->hl[tail], rend - tail);
+  }
+  editorRenderChars(&row->render[ri0], s, len, rx0);
+  memset(&row->render[rt + db], ' ', wt_new);
+  memset(&row->hl[rt + db], tab_hl, wt_new);
+  row->rsize = old_rsize + tb;
+  if (gapped)
+    row->rgap -= tb;
+  if (row->gap == row->nchunks)
+    row->render[row->rsize] = '\0';
+  row->ascii = row->ascii && editorIsAscii(s, len);
+  row->width += tc;
+  editorWrapUpdate(row);
+
+  if (row->chunks)
+    editorRowShiftChunks(row, at, del, len, rx0, ri0, tab, dc, db, tc, tb);
+  else if (row->size >= HELIS_LONG_LINE)
+    editorRowBuildChunks(row);
+
+  editorUpdateSyntaxLocal(row, ri0, rie);
+}
+
+// Rebuild render of a row
+void editorRenderRow(erow *row) {
+  if (row->idx == E.gaprow)
+    editorGapClose();
+
+  // Handling tabs
+  int tabs = 0;
+  int j;
+  for (j = 0; j < row->size; j++) {
+    if (row->chars[j] == '\t')
+      tabs++;
+  }
+
+  free(row->render);
+  row->render = malloc(row->size + tabs * (HELIS_TAB_STOP - 1) + 1);
+  row->ascii = editorIsAscii(row->chars, row->size);
+
+  int idx = editorRenderChars(row->render, row->chars, row->size, 0);
 
   row->render[idx] = '\0';
   row->rsize = idx;
+  row->width = row->ascii ? idx : editorRenderWidth(row->chars, row->size, 0);
+  editorRowBuildChunks(row);
+  editorWrapUpdate(row);
+}
+
+// Update Row
+void editorUpdateRow(erow *row) {
+  editorRenderRow(row);
   editorUpdateSyntax(row);
 }
 
+// Whether a row can hold size chars, telling the user if it can't
+int editorRowFits(size_t size) {
+  if (size <= HELIS_MAX_ROW)
+    return 1;
+  editorSetStatusMessage("Line too long");
+  return 0;
+}
+
 // Insert row
 void editorInsertRow(int at, char *s, size_t len) {
-  if (at < 0 || at > E.numrows)
+  if (at < 0 || at > E.numrows || !editorRowFits(len))
     return;
+  editorGapClose();
+  journalRows(at, 0, &s, &len, 1);
+  editorWrapInvalidate();
 
   E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
   memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
@@ -538,34 +2247,129 @@ void editorInsertRow(int at, char *s, size_t len) {
   E.row[at].chars = malloc(len + 1);
   memcpy(E.row[at].chars, s, len);
   E.row[at].chars[len] = '\0';
+  editorWordsScan(s, len, 1);
 
   E.row[at].rsize = 0;
   E.row[at].render = NULL;
   E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
+  // The row after this one was lexed with the state of the row before
+  E.row[at].hl_open_comment = (at > 0) ? E.row[at - 1].hl_open_comment : 0;
+  E.row[at].chunks = NULL;
+  E.row[at].nchunks = 0;
+  E.row[at].gap = E.row[at].cgap = E.row[at].rgap = 0;
+  E.row[at].block = NULL;
+  E.row[at].brackets_stale = 1;
+  E.row[at].hl_stale = 0;
+  E.row[at].shared = 0;
+  E.numrows++;
+  editorFoldsShift(at, 0, 1);
+  editorSearchShift(at, 0, 1);
   editorUpdateRow(&E.row[at]);
 
-  E.numrows++;
   // Update dirtiness
   E.dirty++;
 }
 
 // Free memory of erow
 void editorFreeRow(erow *row) {
+  if (row->block)
+    editorBlockRelease(row->block);
   free(row->render);
-  free(row->chars);
+  editorRowDropChars(row);
   free(row->hl);
+  free(row->chunks);
 }
 
 // Delete row
 void editorDelRow(int at) {
   if (at < 0 || at >= E.numrows)
     return;
+  editorGapClose();
+  journalRows(at, 1, NULL, NULL, 0);
+  editorWrapInvalidate();
+  int open_before = (at > 0) ? E.row[at - 1].hl_open_comment : 0;
+  int resync = (E.row[at].hl_open_comment != open_before);
+  editorWordsScan(editorRowChars(&E.row[at]), E.row[at].size, -1);
   editorFreeRow(&E.row[at]);
   memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
   for (int j = at; j < E.numrows - 1; j++)
     E.row[j].idx--;
   E.numrows--;
+  editorFoldsShift(at, 1, 0);
+  editorSearchShift(at, 1, 0);
+  // The next row was lexed with the state of the deleted one
+  if (resync && at < E.numrows)
+    editorUpdateSyntax(&E.row[at]);
+  E.dirty++;
+}
+
+// Replace del rows at `at` with n new rows, renumbering the rows after
+// them and resyncing the highlight only once; returns -1 if it didn't
+int editorReplaceRows(int at, int del, char **lines, size_t *lens, int n) {
+  if (at < 0 || del < 0 || at + del > E.numrows)
+    return -1;
+  for (int j = 0; j < n; j++) {
+    if (!editorRowFits(lens[j]))
+      return -1;
+  }
+  editorGapClose();
+  journalRows(at, del, lines, lens, n);
+  editorWrapInvalidate();
+
+  // Open comment state the first row after the gap was lexed with
+  int open_before = (at + del > 0) ? E.row[at + del - 1].hl_open_comment : 0;
+
+  for (int j = at; j < at + del; j++) {
+    editorWordsScan(editorRowChars(&E.row[j]), E.row[j].size, -1);
+    editorFreeRow(&E.row[j]);
+  }
+  if (n > del)
+    E.row = realloc(E.row, sizeof(erow) * (E.numrows + n - del));
+  memmove(&E.row[at + n], &E.row[at + del],
+          sizeof(erow) * (E.numrows - at - del));
+  E.numrows += n - del;
+  for (int j = at + n; j < E.numrows; j++)
+    E.row[j].idx = j;
+  editorFoldsShift(at, del, n);
+
+  for (int j = 0; j < n; j++) {
+    erow *row = &E.row[at + j];
+    row->idx = at + j;
+    row->size = lens[j];
+    row->chars = malloc(lens[j] + 1);
+    memcpy(row->chars, lines[j], lens[j]);
+    row->chars[lens[j]] = '\0';
+    editorWordsScan(row->chars, row->size, 1);
+    row->rsize = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->hl_open_comment = 0;
+    row->chunks = NULL;
+    row->nchunks = 0;
+    row->gap = row->cgap = row->rgap = 0;
+    row->block = NULL;
+    row->brackets_stale = 1;
+    row->hl_stale = 0;
+    row->shared = 0;
+    editorRenderRow(row);
+    editorHighlightRow(row);
+  }
+  editorSearchShift(at, del, n);
+
+  int open_after = (at + n > 0) ? E.row[at + n - 1].hl_open_comment : 0;
+  if (open_after != open_before && at + n < E.numrows)
+    editorUpdateSyntax(&E.row[at + n]);
+  E.dirty++;
+  return 0;
+}
+
+// Replace del chars at `at` of a row with len chars of s, unless that
+// makes the row too long
+void editorRowReplace(erow *row, int at, int del, const char *s, int len) {
+  if (!editorRowFits((size_t)(row->size - del) + len))
+    return;
+  journalEdit(row->idx, at, del, s, len);
+  editorRowPatch(row, at, del, s, len);
   E.dirty++;
 }
 
@@ -573,281 +2377,4640 @@ void editorDelRow(int at) {
 void editorRowInsertChar(erow *row, int at, int c) {
   if (at < 0 || at > row->size)
     at = row->size;
-  // Allocate memory for new char
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  // Update row
-  editorUpdateRow(row);
-  // Update dirtiness
-  E.dirty++;
+  char ch = c;
+  editorRowReplace(row, at, 0, &ch, 1);
 }
 
 // Delete character
 void editorRowDelChar(erow *row, int at) {
   if (at < 0 || at >= row->size)
     return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  // Set dirty to true
-  E.dirty++;
+  editorRowReplace(row, at, 1, NULL, 0);
 }
 
-/* Editor Functions */
+/* Cold Rows */
 
-// Insert character
-void editorInsertChar(int c) {
-  if (E.cy == E.numrows) {
-    editorInsertRow(E.numrows, "", 0);
+// Hash slot of the 4 bytes at p for the LZ match finder
+unsigned editorLzHash(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return (v * 2654435761u) >> (32 - HELIS_LZ_HASH_BITS);
+}
+
+// Append an LZ length continuation (runs of 255 ended by a smaller byte)
+unsigned char *editorLzPutLen(unsigned char *op, int len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = len;
+  return op;
+}
+
+// Compress n bytes of src into dst, which must hold editorLzBound(n)
+// bytes; returns the compressed size. The format is a sequence of
+// token, literals, 16-bit match offset, like LZ4 blocks
+int editorLzCompress(const char *src, int n, char *dst) {
+  const unsigned char *s = (const unsigned char *)src;
+  unsigned char *op = (unsigned char *)dst;
+  int *table = calloc(1 << HELIS_LZ_HASH_BITS, sizeof(int));
+  int anchor = 0, i = 0;
+
+  while (i + 4 <= n) {
+    unsigned h = editorLzHash(&s[i]);
+    int ref = table[h] - 1;
+    table[h] = i + 1;
+    if (ref < 0 || i - ref > 0xFFFF || memcmp(&s[ref], &s[i], 4) != 0) {
+      i++;
+      continue;
+    }
+
+    int mlen = 4;
+    while (i + mlen < n && s[ref + mlen] == s[i + mlen])
+      mlen++;
+    int lit = i - anchor;
+    unsigned char *token = op++;
+    *token = (lit < 15 ? lit : 15) << 4 | (mlen - 4 < 15 ? mlen - 4 : 15);
+    if (lit >= 15)
+      op = editorLzPutLen(op, lit - 15);
+    memcpy(op, &s[anchor], lit);
+    op += lit;
+    *op++ = (i - ref) & 0xFF;
+    *op++ = (i - ref) >> 8;
+    if (mlen - 4 >= 15)
+      op = editorLzPutLen(op, mlen - 4 - 15);
+    i += mlen;
+    anchor = i;
+  }
+
+  // Trailing literals, without a match
+  int lit = n - anchor;
+  *op++ = (lit < 15 ? lit : 15) << 4;
+  if (lit >= 15)
+    op = editorLzPutLen(op, lit - 15);
+  memcpy(op, &s[anchor], lit);
+  op += lit;
+  free(table);
+  return op - (unsigned char *)dst;
+}
+
+// Worst case compressed size of n bytes
+int editorLzBound(int n) { return n + n / 255 + 16; }
+
+// Decompress clen bytes of src into dst of n bytes, returns -1 on
+// malformed input
+int editorLzDecompress(const char *src, int clen, char *dst, int n) {
+  const unsigned char *ip = (const unsigned char *)src;
+  const unsigned char *end = ip + clen;
+  int o = 0;
+  while (ip < end) {
+    int token = *ip++;
+    int lit = token >> 4;
+    if (lit == 15) {
+      int b;
+      do {
+        if (ip >= end)
+          return -1;
+        b = *ip++;
+        lit += b;
+      } while (b == 255);
+    }
+    if (lit > end - ip || lit > n - o)
+      return -1;
+    memcpy(&dst[o], ip, lit);
+    ip += lit;
+    o += lit;
+    if (ip == end)
+      break;
+
+    if (end - ip < 2)
+      return -1;
+    int off = ip[0] | ip[1] << 8;
+    ip += 2;
+    int mlen = (token & 15) + 4;
+    if ((token & 15) == 15) {
+      int b;
+      do {
+        if (ip >= end)
+          return -1;
+        b = *ip++;
+        mlen += b;
+      } while (b == 255);
+    }
+    if (off == 0 || off > o || mlen > n - o)
+      return -1;
+    // Byte by byte, the match may overlap what it produces
+    for (int j = 0; j < mlen; j++, o++)
+      dst[o] = dst[o - off];
+  }
+  return o == n ? 0 : -1;
+}
+
+// Drop a reference to a block, freeing it with its last cold row
+void editorBlockRelease(struct editorBlock *b) {
+  if (--b->refs > 0)
+    return;
+  for (int j = 0; j < HELIS_BLOCK_CACHE; j++) {
+    if (E.bcache[j].block == b) {
+      free(E.bcache[j].data);
+      E.bcache[j].block = NULL;
+      E.bcache[j].data = NULL;
+    }
+  }
+  free(b->data);
+  free(b);
+}
+
+// Uncompressed contents of a block, from the LRU of decompressed blocks
+const char *editorBlockData(struct editorBlock *b) {
+  static unsigned long clock;
+  struct editorBlockCache *slot = &E.bcache[0];
+  for (int j = 0; j < HELIS_BLOCK_CACHE; j++) {
+    struct editorBlockCache *c = &E.bcache[j];
+    if (c->block == b) {
+      c->used = ++clock;
+      return c->data;
+    }
+    if (c->used < slot->used)
+      slot = c;
+  }
+
+  // Evict the least recently used block
+  free(slot->data);
+  slot->block = b;
+  slot->data = malloc(b->rawlen ? b->rawlen : 1);
+  slot->used = ++clock;
+  if (editorLzDecompress(b->data, b->clen, slot->data, b->rawlen) == -1)
+    die("decompress");
+  return slot->data;
+}
+
+// Chars of a row for reading, without making a cold row resident
+const char *editorRowChars(erow *row) {
+  if (row->chars)
+    return row->chars;
+  return &editorBlockData(row->block)[row->boff];
+}
+
+// Restore chars and render of a cold row, leaving it out of its block
+void editorRowThaw(erow *row) {
+  const char *s = editorRowChars(row);
+  row->chars = malloc(row->size + 1);
+  memcpy(row->chars, s, row->size);
+  row->chars[row->size] = '\0';
+  editorBlockRelease(row->block);
+  row->block = NULL;
+  editorRenderRow(row);
+}
+
+// Make a row resident if it is cold
+erow *editorRowResident(erow *row) {
+  if (row->chars == NULL) {
+    editorRowThaw(row);
+    // The open comment state was kept, so this only cascades if the row
+    // is behind a pending resync
+    if (editorHighlightRow(row) && row->idx + 1 < E.numrows)
+      editorUpdateSyntax(&E.row[row->idx + 1]);
+  }
+  return row;
+}
+
+// Compressed block of the rawlen chars of raw, for refs cold rows
+struct editorBlock *editorBlockPack(const char *raw, int rawlen, int refs) {
+  struct editorBlock *b = malloc(sizeof(struct editorBlock));
+  char *tmp = malloc(editorLzBound(rawlen));
+  b->clen = editorLzCompress(raw, rawlen, tmp);
+  b->data = realloc(tmp, b->clen ? b->clen : 1);
+  b->rawlen = rawlen;
+  b->refs = refs;
+  return b;
+}
+
+// Pack runs of rows from `from` on that are far from the cursor and the
+// screen into compressed blocks, dropping their chars, render and highlight
+void editorFreezeRows(int from) {
+  if (HELIS_COLD_ROWS <= 0 || E.numrows < HELIS_COLD_ROWS)
+    return;
+  // Folds can put rows far below rowoff on the screen
+  int bottom = editorScreenToRow(editorScreenTop() + E.screenrows);
+  int hot0 = (E.rowoff < E.cy ? E.rowoff : E.cy) - HELIS_COLD_DISTANCE;
+  int hot1 = (bottom > E.cy ? bottom : E.cy) +
+             HELIS_COLD_DISTANCE;
+  E.cold_rowoff = E.rowoff;
+
+  int y = from;
+  while (y < E.numrows) {
+    // Find a run of resident rows outside of the hot window
+    int start = y;
+    int rawlen = 0;
+    // Blocks hold no more chars than a row may, so their sizes fit an int
+    while (y < E.numrows && y - start < HELIS_BLOCK_ROWS &&
+           E.row[y].size <= HELIS_MAX_ROW - rawlen &&
+           E.row[y].chars && (y < hot0 || y > hot1) &&
+           !(E.mode == Visual && y == E.vy)) {
+      rawlen += E.row[y].size;
+      y++;
+    }
+    if (y - start < HELIS_BLOCK_ROWS / 4) {
+      if (y == start)
+        y++;
+      continue;
+    }
+
+    char *raw = malloc(rawlen ? rawlen : 1);
+    int off = 0;
+    for (int j = start; j < y; j++) {
+      memcpy(&raw[off], E.row[j].chars, E.row[j].size);
+      off += E.row[j].size;
+    }
+    struct editorBlock *b = editorBlockPack(raw, rawlen, y - start);
+    free(raw);
+
+    off = 0;
+    for (int j = start; j < y; j++) {
+      erow *row = &E.row[j];
+      // Cold rows keep their bracket summary to be skipped over unthawed
+      editorRowBrackets(row);
+      editorRowDropChars(row);
+      free(row->render);
+      free(row->hl);
+      free(row->chunks);
+      row->chars = row->render = NULL;
+      row->hl = NULL;
+      row->chunks = NULL;
+      row->nchunks = row->gap = 0;
+      row->rsize = 0;
+      row->block = b;
+      row->boff = off;
+      off += row->size;
+    }
+  }
+}
+
+/* Word Index */
+
+// Whether c can be part of a word for completion
+int editorIsWordChar(char c) {
+  return isalnum((unsigned char)c) || c == '_' || (unsigned char)c >= 0x80;
+}
+
+// Slot of a word in the hash table, empty if the word isn't there
+struct editorWord **editorWordsSlot(const char *s, int len) {
+  struct editorWordIndex *w = &E.words;
+  unsigned mask = w->cap - 1;
+  for (unsigned h = editorHashBytes(s, len) & mask;; h = (h + 1) & mask) {
+    struct editorWord *word = w->table[h];
+    if (word == NULL || (word->len == len && memcmp(word->s, s, len) == 0))
+      return &w->table[h];
+  }
+}
+
+// Rebuild the hash table with cap slots from the list of words
+void editorWordsRehash(int cap) {
+  struct editorWordIndex *w = &E.words;
+  free(w->table);
+  w->table = calloc(cap, sizeof(struct editorWord *));
+  w->cap = cap;
+  w->n = w->nwords;
+  for (int j = 0; j < w->nwords; j++)
+    *editorWordsSlot(w->words[j]->s, w->words[j]->len) = w->words[j];
+}
+
+// Take a word out of the hash table, moving later words of its probe run
+// back so that they stay reachable
+void editorWordsUnhash(struct editorWord *word) {
+  struct editorWordIndex *w = &E.words;
+  unsigned mask = w->cap - 1;
+  unsigned i = editorWordsSlot(word->s, word->len) - w->table;
+  w->table[i] = NULL;
+  w->n--;
+  for (unsigned j = (i + 1) & mask; w->table[j]; j = (j + 1) & mask) {
+    struct editorWord *next = w->table[j];
+    unsigned h = editorHashBytes(next->s, next->len) & mask;
+    // Move it unless its home slot lies cyclically in (i, j]
+    if (i < j ? (h <= i || h > j) : (h <= i && h > j)) {
+      w->table[i] = next;
+      w->table[j] = NULL;
+      i = j;
+    }
+  }
+}
+
+// Count one more (dir 1) or one less (dir -1) occurrence of a word
+void editorWordsCount(const char *s, int len, int dir) {
+  struct editorWordIndex *w = &E.words;
+  if ((w->n + 1) * 2 > w->cap)
+    editorWordsRehash(w->cap ? w->cap * 2 : 1024);
+  struct editorWord **slot = editorWordsSlot(s, len);
+  if (*slot == NULL) {
+    if (dir < 0)
+      return;
+    struct editorWord *word = malloc(sizeof(struct editorWord) + len + 1);
+    word->len = len;
+    word->count = 0;
+    memcpy(word->s, s, len);
+    word->s[len] = '\0';
+    *slot = word;
+    w->n++;
+    if (w->nwords == w->capwords) {
+      w->capwords = w->capwords ? w->capwords * 2 : 1024;
+      w->words = realloc(w->words, sizeof(struct editorWord *) * w->capwords);
+    }
+    w->words[w->nwords++] = word;
+  }
+  if (dir > 0 || (*slot)->count > 0)
+    (*slot)->count += dir;
+}
+
+// Count the words of s one more (dir 1) or one less (dir -1) time
+void editorWordsScan(const char *s, int len, int dir) {
+  if (!E.words.built)
+    return;
+  int j = 0;
+  while (j < len) {
+    if (!editorIsWordChar(s[j])) {
+      j++;
+      continue;
+    }
+    int start = j;
+    while (j < len && editorIsWordChar(s[j]))
+      j++;
+    // Numbers and single letters aren't worth completing
+    if (j - start >= 2 && j - start <= HELIS_WORD_MAX &&
+        !isdigit((unsigned char)s[start]))
+      editorWordsCount(&s[start], j - start, dir);
+  }
+}
+
+// Order of words
+int editorWordCmp(const void *a, const void *b) {
+  return strcmp((*(struct editorWord **)a)->s, (*(struct editorWord **)b)->s);
+}
+
+// Merge the words added since the last lookup into the sorted ones,
+// dropping the words no longer in the buffer
+void editorWordsSort() {
+  struct editorWordIndex *w = &E.words;
+  if (w->nsorted == w->nwords)
+    return;
+  qsort(&w->words[w->nsorted], w->nwords - w->nsorted,
+        sizeof(struct editorWord *), editorWordCmp);
+
+  struct editorWord **merged = malloc(sizeof(struct editorWord *) * w->nwords);
+  int i = 0, j = w->nsorted, n = 0;
+  while (i < w->nsorted || j < w->nwords) {
+    struct editorWord *word;
+    if (j == w->nwords ||
+        (i < w->nsorted && strcmp(w->words[i]->s, w->words[j]->s) < 0))
+      word = w->words[i++];
+    else
+      word = w->words[j++];
+    if (word->count > 0) {
+      merged[n++] = word;
+    } else {
+      editorWordsUnhash(word);
+      free(word);
+    }
+  }
+  free(w->words);
+  w->capwords = w->nwords;
+  w->words = merged;
+  w->nwords = w->nsorted = n;
+}
+
+// Forget the words, the buffer is being replaced
+void editorWordsFree() {
+  struct editorWordIndex *w = &E.words;
+  for (int j = 0; j < w->nwords; j++)
+    free(w->words[j]);
+  free(w->words);
+  free(w->table);
+  memset(w, 0, sizeof(struct editorWordIndex));
+}
+
+// Words of the buffer longer than prefix and starting with it, in order;
+// they stay valid until the next lookup
+const char **editorWordsFind(const char *prefix, int *n) {
+  struct editorWordIndex *w = &E.words;
+  if (!w->built) {
+    w->built = 1;
+    for (int j = 0; j < E.numrows; j++)
+      editorWordsScan(editorRowChars(&E.row[j]), E.row[j].size, 1);
+  }
+  editorWordsSort();
+
+  int len = strlen(prefix);
+  int lo = 0, hi = w->nsorted;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (strcmp(w->words[mid]->s, prefix) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  int end = lo;
+  while (end < w->nsorted && strncmp(w->words[end]->s, prefix, len) == 0)
+    end++;
+
+  const char **cands = malloc(sizeof(char *) * (end - lo + 1));
+  *n = 0;
+  for (int j = lo; j < end; j++)
+    if (w->words[j]->count > 0 && w->words[j]->len > len)
+      cands[(*n)++] = w->words[j]->s;
+  return cands;
+}
+
+// Stop completing, leaving the chosen word in place
+void editorCompleteEnd() {
+  struct editorCompletion *c = E.complete;
+  if (c == NULL)
+    return;
+  E.complete = NULL;
+  free(c->cands);
+  free(c->prefix);
+  free(c);
+}
+
+// Complete the word before the cursor with the next (dir 1) or previous
+// (dir -1) word of the buffer starting like it
+void editorComplete(int dir) {
+  struct editorCompletion *c = E.complete;
+  if (c == NULL) {
+    if (E.cy >= E.numrows)
+      return;
+    erow *row = editorRowResident(&E.row[E.cy]);
+    int x = E.cx;
+    while (x > 0 && editorIsWordChar(row->chars[x - 1]))
+      x--;
+    c = calloc(1, sizeof(struct editorCompletion));
+    c->prefix = malloc(E.cx - x + 1);
+    memcpy(c->prefix, &row->chars[x], E.cx - x);
+    c->prefix[E.cx - x] = '\0';
+    c->cands = editorWordsFind(c->prefix, &c->n);
+    c->cur = -1;
+    c->y = E.cy;
+    c->x = x;
+    c->len = E.cx - x;
+    E.complete = c;
+    if (c->n == 0) {
+      editorCompleteEnd();
+      editorSetStatusMessage("Pattern not found");
+      return;
+    }
+  }
+
+  // Cycle through the candidates and back to the prefix
+  c->cur += dir;
+  if (c->cur >= c->n)
+    c->cur = -1;
+  else if (c->cur < -1)
+    c->cur = c->n - 1;
+  const char *word = c->cur == -1 ? c->prefix : c->cands[c->cur];
+  int len = strlen(word);
+  editorRowReplace(&E.row[c->y], c->x, c->len, word, len);
+  c->len = len;
+  E.cx = c->x + len;
+  if (c->cur == -1)
+    editorSetStatusMessage("Back at original");
+  else
+    editorSetStatusMessage("match %d of %d", c->cur + 1, c->n);
+}
+
+/* Bracket Matching */
+
+// Kind of bracket c as 0 to 2 for (), [] and {}, setting *open for the
+// opening one, or -1 if c is no bracket
+int editorBracketKind(char c, int *open) {
+  static const char brackets[] = "()[]{}";
+  const char *p = c ? strchr(brackets, c) : NULL;
+  if (p == NULL)
+    return -1;
+  *open = !((p - brackets) & 1);
+  return (p - brackets) / 2;
+}
+
+// Sum up the brackets of a render highlighted as hl
+void editorBracketsSum(struct erowBrackets *brackets, const char *render,
+                       const unsigned char *hl, int rsize) {
+  memset(brackets, 0, sizeof(struct erowBrackets) * 3);
+  for (int j = 0; j < rsize; j++) {
+    int open, k = editorBracketKind(render[j], &open);
+    if (k == -1 || hl[j] != HL_NORMAL)
+      continue;
+    struct erowBrackets *b = &brackets[k];
+    b->delta += open ? 1 : -1;
+    if (b->delta < b->min)
+      b->min = b->delta;
+  }
+}
+
+// Recompute the bracket summary of a row from its highlight if stale
+void editorRowBrackets(erow *row) {
+  if (!row->brackets_stale)
+    return;
+  // Cold rows of a cached open that were never highlighted are lexed
+  // aside, the others keep the summary they had
+  if (row->chars == NULL) {
+    if (editorHighlightCold(row) && row->idx + 1 < E.numrows)
+      editorUpdateSyntax(&E.row[row->idx + 1]);
+    return;
+  }
+  // The sides of the gap of a long row being typed into sum up as one
+  int r = editorRowGapRi(row);
+  editorBracketsSum(row->brackets, row->render, row->hl, r);
+  if (r < row->rsize) {
+    struct erowBrackets after[3];
+    editorBracketsSum(after, &row->render[r + row->rgap],
+                      &row->hl[r + row->rgap], row->rsize - r);
+    for (int k = 0; k < 3; k++) {
+      struct erowBrackets *b = &row->brackets[k];
+      if (b->delta + after[k].min < b->min)
+        b->min = b->delta + after[k].min;
+      b->delta += after[k].delta;
+    }
+  }
+  row->brackets_stale = 0;
+}
+
+// Scan for brackets of kind k from render offset j of row y in direction
+// dir, with depth brackets waiting for their match, skipping rows whose
+// summary shows they can't close the nesting. Returns 0 and sets *my and
+// *mat to the bracket that closes it, -1 if there is none
+int editorBracketScan(int y, int j, int k, int dir, int depth, int *my,
+                      int *mat) {
+  erow *row = editorRowResident(&E.row[y]);
+  char oc = "([{"[k], cc = ")]}"[k];
+  while (1) {
+    for (; j >= 0 && j < row->rsize; j += dir) {
+      int p = editorRowRi(row, j);
+      if (row->hl[p] != HL_NORMAL)
+        continue;
+      if (row->render[p] == oc)
+        depth += dir;
+      else if (row->render[p] == cc)
+        depth -= dir;
+      if (depth == 0) {
+        *my = y;
+        *mat = j;
+        return 0;
+      }
+    }
+
+    // Rows whose lowest depth stays above the wanted one are skipped
+    // whole. Going backwards the lowest depth is that of a suffix
+    while (1) {
+      y += dir;
+      if (y < 0 || y >= E.numrows)
+        return -1;
+      erow *r = &E.row[y];
+      editorRowBrackets(r);
+      struct erowBrackets *b = &r->brackets[k];
+      int low = dir > 0 ? b->min : b->min - b->delta;
+      if (depth + low <= 0)
+        break;
+      depth += dir * b->delta;
+    }
+    row = editorRowResident(&E.row[y]);
+    j = dir > 0 ? 0 : row->rsize - 1;
+  }
+}
+
+// Find the bracket matching the one at render offset at of row y.
+// Returns 0 and sets *my and *mat if there is one, -1 otherwise
+int editorBracketMatch(int y, int at, int *my, int *mat) {
+  erow *row = editorRowResident(&E.row[y]);
+  int open, k, p = editorRowRi(row, at);
+  if (at >= row->rsize || row->hl[p] != HL_NORMAL ||
+      (k = editorBracketKind(row->render[p], &open)) == -1)
+    return -1;
+  return editorBracketScan(y, at + (open ? 1 : -1), k, open ? 1 : -1, 1, my,
+                           mat);
+}
+
+// Remember the bracket matching the one under the cursor for drawing
+void editorFindPair() {
+  E.pair_y = -1;
+  if (E.cy >= E.numrows || E.mode == Visual)
+    return;
+  int at = editorRowCxToRender(&E.row[E.cy], E.cx);
+  int y, mat;
+  if (editorBracketMatch(E.cy, at, &y, &mat) == 0) {
+    E.pair_y = y;
+    E.pair_at = mat;
+    E.pair_from = at;
+  }
+}
+
+// Jump to the bracket matching the one under or after the cursor
+void editorJumpToPair() {
+  if (E.cy >= E.numrows)
+    return;
+  erow *row = editorRowResident(&E.row[E.cy]);
+  int open;
+  int at = editorRowCxToRender(row, E.cx);
+  while (at < row->rsize && (row->hl[at] != HL_NORMAL ||
+                             editorBracketKind(row->render[at], &open) == -1))
+    at++;
+  int y, mat;
+  if (editorBracketMatch(E.cy, at, &y, &mat) == -1)
+    return;
+  E.cy = y;
+  E.cx = editorRowRenderToCx(&E.row[y], mat);
+}
+
+/* Folds */
+
+// Rebuild the runs of hidden rows after the folds changed
+void editorFoldsUpdate() {
+  struct editorFolds *fs = &E.folds;
+  fs->hidden = realloc(fs->hidden, sizeof(struct editorHidden) *
+                                       (fs->n ? fs->n : 1));
+  fs->nhidden = 0;
+  int last = -1, before = 0;
+  for (int j = 0; j < fs->n; j++) {
+    struct editorFold *f = &fs->f[j];
+    // Folds inside a hidden run are hidden along with it
+    if (!f->closed || f->start <= last || f->end <= f->start)
+      continue;
+    struct editorHidden *h = &fs->hidden[fs->nhidden++];
+    h->start = f->start + 1;
+    h->end = f->end;
+    h->before = before;
+    before += h->end - h->start + 1;
+    last = f->end;
+  }
+  editorWrapInvalidate();
+}
+
+// Drop all folds
+void editorFoldsFree() {
+  free(E.folds.f);
+  free(E.folds.hidden);
+  memset(&E.folds, 0, sizeof(E.folds));
+  editorWrapInvalidate();
+}
+
+// Last hidden run starting at or before row y, or -1
+int editorFoldRun(int y) {
+  struct editorHidden *h = E.folds.hidden;
+  int lo = 0, hi = E.folds.nhidden - 1, run = -1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (h[mid].start <= y) {
+      run = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return run;
+}
+
+// Whether row y is hidden by a closed fold
+int editorRowHidden(int y) {
+  int run = editorFoldRun(y);
+  return run != -1 && y <= E.folds.hidden[run].end;
+}
+
+// Screen row of file row y counted from the top of the file, hidden rows
+// being on the row of their fold. With soft wrap it is the first line of
+// the row
+int editorRowToScreen(int y) {
+  if (E.wrap.on)
+    return editorWrapRowToScreen(y);
+  int run = editorFoldRun(y);
+  if (run == -1)
+    return y;
+  struct editorHidden *h = &E.folds.hidden[run];
+  if (y <= h->end)
+    return h->start - 1 - h->before;
+  return y - h->before - (h->end - h->start + 1);
+}
+
+// File row shown on screen row s counted from the top of the file
+int editorScreenToRow(int s) {
+  if (E.wrap.on)
+    return editorWrapScreenToRow(s);
+  struct editorHidden *h = E.folds.hidden;
+  // The first row after run j is on screen row h[j].start - h[j].before
+  int lo = 0, hi = E.folds.nhidden - 1, run = -1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (h[mid].start - h[mid].before <= s) {
+      run = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  if (run == -1)
+    return s;
+  return s + h[run].before + (h[run].end - h[run].start + 1);
+}
+
+// Next row on screen after row y in direction dir
+int editorNextVisible(int y, int dir) {
+  y += dir;
+  int run = editorFoldRun(y);
+  if (run != -1 && y <= E.folds.hidden[run].end)
+    y = dir > 0 ? E.folds.hidden[run].end + 1 : E.folds.hidden[run].start - 1;
+  return y;
+}
+
+// Move folds along with the rows after del rows at `at` were replaced by
+// n rows. Folds starting in the replaced rows go away, the others grow or
+// shrink with them
+void editorFoldsShift(int at, int del, int n) {
+  struct editorFolds *fs = &E.folds;
+  if (fs->n == 0)
+    return;
+  int d = n - del, kept = 0;
+  for (int j = 0; j < fs->n; j++) {
+    struct editorFold f = fs->f[j];
+    if (f.start >= at + del)
+      f.start += d;
+    else if (f.start >= at && del > 0)
+      continue;
+    if (f.end >= at + del)
+      f.end += d;
+    else if (f.end >= at)
+      f.end = at - 1;
+    if (f.end > f.start)
+      fs->f[kept++] = f;
+  }
+  fs->n = kept;
+  editorFoldsUpdate();
+}
+
+// Order folds by start, outer ones first
+int editorFoldCmp(const void *a, const void *b) {
+  const struct editorFold *fa = a, *fb = b;
+  if (fa->start != fb->start)
+    return fa->start < fb->start ? -1 : 1;
+  return fa->end > fb->end ? -1 : fa->end < fb->end;
+}
+
+// Append a fold of rows start to end, leaving the order to the caller
+void editorFoldPush(int start, int end) {
+  struct editorFolds *fs = &E.folds;
+  if (fs->n == fs->cap) {
+    fs->cap = fs->cap ? fs->cap * 2 : 16;
+    fs->f = realloc(fs->f, sizeof(struct editorFold) * fs->cap);
+  }
+  fs->f[fs->n++] = (struct editorFold){start, end, 0};
+}
+
+// Index of a new fold of rows start to end, or of the fold already there.
+// Returns -1 if it would cross another fold
+int editorFoldAdd(int start, int end) {
+  struct editorFolds *fs = &E.folds;
+  int at = fs->n;
+  for (int j = 0; j < fs->n; j++) {
+    struct editorFold *f = &fs->f[j];
+    if (f->start == start && f->end == end)
+      return j;
+    if ((f->start < start && start <= f->end && f->end < end) ||
+        (start < f->start && f->start <= end && end < f->end))
+      return -1;
+    if (at == fs->n &&
+        (f->start > start || (f->start == start && f->end < end)))
+      at = j;
+  }
+  editorFoldPush(start, end);
+  memmove(&fs->f[at + 1], &fs->f[at],
+          sizeof(struct editorFold) * (fs->n - 1 - at));
+  fs->f[at] = (struct editorFold){start, end, 0};
+  return at;
+}
+
+// Width of the indentation of row y, or -1 for a blank row
+int editorRowIndent(int y) {
+  erow *row = &E.row[y];
+  const char *s = editorRowChars(row);
+  int w = 0;
+  for (int j = 0; j < row->size; j++) {
+    if (s[j] == '\t')
+      w += HELIS_TAB_STOP - (w % HELIS_TAB_STOP);
+    else if (s[j] == ' ')
+      w++;
+    else
+      return w;
+  }
+  return -1;
+}
+
+// Rows from y to the last one indented deeper than y, or -1 if none is
+int editorIndentEnd(int y) {
+  int indent = editorRowIndent(y), end = -1;
+  for (int j = y + 1; j < E.numrows; j++) {
+    int w = editorRowIndent(j);
+    if (w == -1)
+      continue;
+    if (w <= indent)
+      break;
+    end = j;
+  }
+  return end;
+}
+
+// Last row of a block of braces closed on row y. When the row opens
+// another block, as in } else {, the block ends on the row before
+int editorBraceEnd(int y) {
+  erow *row = &E.row[y];
+  editorRowBrackets(row);
+  struct erowBrackets *b = &row->brackets[2];
+  return b->delta - b->min > 0 ? y - 1 : y;
+}
+
+// Find the block of rows starting on row y, or with outer the one around
+// it: braces, otherwise the rows indented deeper than it or than the row
+// it is indented under. Returns -1 if there is none
+int editorFoldBlock(int y, int outer, int *y0, int *y1) {
+  erow *row = editorRowResident(&E.row[y]);
+  int my, mat;
+
+  // First brace left open by the row
+  int open = -1, pending = 0;
+  for (int j = row->rsize - 1; j >= 0; j--) {
+    if (row->hl[j] != HL_NORMAL)
+      continue;
+    if (row->render[j] == '}') {
+      pending++;
+    } else if (row->render[j] == '{') {
+      if (pending == 0)
+        open = j;
+      else
+        pending--;
+    }
+  }
+  if (!outer && open != -1 && editorBracketMatch(y, open, &my, &mat) == 0 &&
+      editorBraceEnd(my) > y) {
+    *y0 = y;
+    *y1 = editorBraceEnd(my);
+    return 0;
+  }
+
+  // Innermost braces around the row, or around the block it opens
+  int oy, oat;
+  if (editorBracketScan(y, outer && open != -1 ? open - 1 : -1, 2, -1, 1, &oy,
+                        &oat) == 0 &&
+      editorBracketMatch(oy, oat, &my, &mat) == 0 && editorBraceEnd(my) > oy) {
+    *y0 = oy;
+    *y1 = editorBraceEnd(my);
+    return 0;
+  }
+
+  // Indentation, for text without braces
+  int top = y;
+  int end = outer ? -1 : editorIndentEnd(y);
+  if (end == -1) {
+    int indent = editorRowIndent(y);
+    if (indent <= 0)
+      return -1;
+    while (--top >= 0) {
+      int w = editorRowIndent(top);
+      if (w != -1 && w < indent)
+        break;
+    }
+    if (top < 0)
+      return -1;
+    end = editorIndentEnd(top);
+  }
+  *y0 = top;
+  *y1 = end;
+  return 0;
+}
+
+// Fold every block of braces spanning rows, or of indentation if there
+// are no such braces. Rows are only read through their bracket summaries
+// and chars, so cold rows stay cold
+void editorFoldAll() {
+  struct editorFolds *fs = &E.folds;
+  int had = fs->n;
+  // Rows of the blocks still open, with their indentation
+  int *stack = NULL, *indent = NULL;
+  int n = 0, cap = 0;
+  for (int y = 0; y < E.numrows; y++) {
+    erow *row = &E.row[y];
+    editorRowBrackets(row);
+    struct erowBrackets *b = &row->brackets[2];
+    int end = b->delta - b->min > 0 ? y - 1 : y;
+    for (int j = 0; j < -b->min && n > 0; j++) {
+      int start = stack[--n];
+      if (end > start)
+        editorFoldPush(start, end);
+    }
+    for (int j = 0; j < b->delta - b->min; j++) {
+      if (n == cap) {
+        cap = cap ? cap * 2 : 64;
+        stack = realloc(stack, sizeof(int) * cap);
+        indent = realloc(indent, sizeof(int) * cap);
+      }
+      stack[n++] = y;
+    }
+  }
+
+  if (fs->n == had) {
+    n = 0;
+    int last = -1;
+    for (int y = 0; y <= E.numrows; y++) {
+      int w = y < E.numrows ? editorRowIndent(y) : 0;
+      if (w == -1)
+        continue;
+      while (n > 0 && indent[n - 1] >= w) {
+        int start = stack[--n];
+        if (last > start)
+          editorFoldPush(start, last);
+      }
+      if (n == cap) {
+        cap = cap ? cap * 2 : 64;
+        stack = realloc(stack, sizeof(int) * cap);
+        indent = realloc(indent, sizeof(int) * cap);
+      }
+      stack[n] = y;
+      indent[n++] = w;
+      last = y;
+    }
+  }
+  if (fs->n == 0) {
+    free(stack);
+    free(indent);
+    return;
+  }
+
+  // Blocks opening and closing on the same rows are folded once, and
+  // folds made before that cross the blocks are dropped
+  qsort(fs->f, fs->n, sizeof(struct editorFold), editorFoldCmp);
+  int kept = 0;
+  n = 0;
+  for (int j = 0; j < fs->n; j++) {
+    struct editorFold *f = &fs->f[j];
+    while (n > 0 && fs->f[stack[n - 1]].end < f->start)
+      n--;
+    if (n > 0 && (fs->f[stack[n - 1]].end < f->end ||
+                  (fs->f[stack[n - 1]].start == f->start &&
+                   fs->f[stack[n - 1]].end == f->end)))
+      continue;
+    fs->f[kept] = *f;
+    if (n == cap) {
+      cap = cap ? cap * 2 : 64;
+      stack = realloc(stack, sizeof(int) * cap);
+    }
+    stack[n++] = kept++;
+  }
+  fs->n = kept;
+  free(stack);
+  free(indent);
+}
+
+// Innermost fold around row y that is open (closed if closed), or -1
+int editorFoldAt(int y, int closed) {
+  int found = -1;
+  for (int j = 0; j < E.folds.n && E.folds.f[j].start <= y; j++) {
+    struct editorFold *f = &E.folds.f[j];
+    if (y <= f->end && f->closed == closed) {
+      found = j;
+      // The outermost closed fold is the one on screen
+      if (closed)
+        break;
+    }
+  }
+  return found;
+}
+
+// Open every closed fold hiding row y
+void editorFoldReveal(int y) {
+  for (int j = 0; j < E.folds.n && E.folds.f[j].start <= y; j++)
+    if (y <= E.folds.f[j].end)
+      E.folds.f[j].closed = 0;
+  editorFoldsUpdate();
+}
+
+// Fold commands typed after z
+void editorFoldCommand(int c) {
+  if (E.cy >= E.numrows)
+    return;
+  struct editorFolds *fs = &E.folds;
+  int j, y0, y1;
+  switch (c) {
+  case 'a':
+    if (editorFoldAt(E.cy, 1) != -1) {
+      editorFoldCommand('o');
+      return;
+    }
+    // fallthrough
+  case 'c':
+    // Fold the block at the cursor first unless it already is, or the one
+    // around it if that is folded and closed
+    if (editorFoldBlock(E.cy, 0, &y0, &y1) == 0 &&
+        (j = editorFoldAdd(y0, y1)) != -1 && fs->f[j].closed &&
+        editorFoldBlock(y0, 1, &y0, &y1) == 0)
+      editorFoldAdd(y0, y1);
+    if ((j = editorFoldAt(E.cy, 0)) == -1) {
+      editorSetStatusMessage("No fold found");
+      return;
+    }
+    fs->f[j].closed = 1;
+    break;
+  case 'o':
+    if ((j = editorFoldAt(E.cy, 1)) != -1)
+      fs->f[j].closed = 0;
+    break;
+  case 'R':
+  case 'M':
+    if (c == 'M')
+      editorFoldAll();
+    for (j = 0; j < fs->n; j++)
+      fs->f[j].closed = (c == 'M');
+    break;
+  case 'E':
+    editorFoldsFree();
+    break;
+  default:
+    return;
+  }
+  editorFoldsUpdate();
+  // Stay on the row of the fold the cursor went into
+  E.cy = editorScreenToRow(editorRowToScreen(E.cy));
+}
+
+/* Fenwick Trees */
+
+// Turn tree[1..n], holding one value each, into a Fenwick tree of their
+// sums. Each node adds itself into its parent, building the tree in O(n)
+void editorFenwickBuild(int *tree, int n) {
+  tree[0] = 0;
+  for (int i = 1; i <= n; i++) {
+    int parent = i + (i & -i);
+    if (parent <= n)
+      tree[parent] += tree[i];
+  }
+}
+
+// Sum of the first i values
+int editorFenwickSum(int *tree, int i) {
+  int sum = 0;
+  for (; i > 0; i -= i & -i)
+    sum += tree[i];
+  return sum;
+}
+
+// Add d to value i, counted from 0
+void editorFenwickAdd(int *tree, int n, int i, int d) {
+  for (i++; d && i <= n; i += i & -i)
+    tree[i] += d;
+}
+
+// Number of leading values whose sum is at most *s, found by walking down
+// the tree. That is the index of the value *s falls in, and *s is left
+// with what falls in it
+int editorFenwickFind(int *tree, int n, int *s) {
+  int i = 0;
+  int step = 1;
+  while (step * 2 <= n)
+    step *= 2;
+  for (; step; step /= 2) {
+    if (i + step <= n && tree[i + step] <= *s) {
+      i += step;
+      *s -= tree[i];
+    }
+  }
+  return i;
+}
+
+/* Soft Wrap */
+
+// Screen lines row y takes when soft wrapping
+int editorWrapLines(int y) {
+  if (editorRowHidden(y))
+    return 0;
+  int run = editorFoldRun(y + 1);
+  if (run != -1 && E.folds.hidden[run].start == y + 1)
+    return 1;
+  erow *row = &E.row[y];
+  if (row->width == -1)
+    row->width = editorRenderWidth(editorRowChars(row), row->size, 0);
+  if (row->width <= E.screencols)
+    return 1;
+  return (row->width + E.screencols - 1) / E.screencols;
+}
+
+// Drop the line counts after rows were added or removed or folds changed,
+// they are counted again when next needed
+void editorWrapInvalidate() {
+  E.wrap.n = -1;
+}
+
+// Count the lines of every row if the rows or the screen width changed
+void editorWrapValidate() {
+  struct editorWrap *w = &E.wrap;
+  if (w->n == E.numrows && w->cols == E.screencols)
+    return;
+  w->tree = realloc(w->tree, sizeof(int) * (E.numrows + 1));
+  for (int y = 0; y < E.numrows; y++)
+    w->tree[y + 1] = editorWrapLines(y);
+  editorFenwickBuild(w->tree, E.numrows);
+  w->n = E.numrows;
+  w->cols = E.screencols;
+}
+
+// Lines of the rows before row y
+int editorWrapPrefix(int y) {
+  return editorFenwickSum(E.wrap.tree, y);
+}
+
+// Recount the lines of a row whose width changed
+void editorWrapUpdate(erow *row) {
+  struct editorWrap *w = &E.wrap;
+  int y = row->idx;
+  if (!w->on || w->n != E.numrows || w->cols != E.screencols || y >= w->n)
+    return;
+  int d = editorWrapLines(y) - (editorWrapPrefix(y + 1) - editorWrapPrefix(y));
+  editorFenwickAdd(w->tree, w->n, y, d);
+}
+
+// First line of row y counted from the top of the file, hidden rows being
+// on the line of their fold
+int editorWrapRowToScreen(int y) {
+  editorWrapValidate();
+  if (y >= E.numrows)
+    return editorWrapPrefix(E.numrows) + y - E.numrows;
+  int run = editorFoldRun(y);
+  if (run != -1 && y <= E.folds.hidden[run].end)
+    y = E.folds.hidden[run].start - 1;
+  return editorWrapPrefix(y);
+}
+
+// Row shown on line s counted from the top of the file, found by walking
+// down the tree to the last row starting at or before it
+int editorWrapScreenToRow(int s) {
+  editorWrapValidate();
+  int y = editorFenwickFind(E.wrap.tree, E.wrap.n, &s);
+  // Lines past the last row count as rows
+  return y < E.wrap.n ? y : y + s;
+}
+
+// Wrapped line of the row the cursor is on
+int editorCursorLine() {
+  if (!E.wrap.on || E.cy >= E.numrows)
+    return 0;
+  int line = E.rx / E.screencols;
+  int lines = editorWrapLines(E.cy);
+  if (line >= lines)
+    line = lines - 1;
+  return line > 0 ? line : 0;
+}
+
+// Line at the top of the screen counted from the top of the file
+int editorScreenTop() {
+  return editorRowToScreen(E.rowoff) + E.lineoff;
+}
+
+// Turn soft wrap on or off
+void editorSetWrap(int on) {
+  E.wrap.on = on;
+  E.lineoff = 0;
+  E.coloff = 0;
+  editorWrapInvalidate();
+  if (!on) {
+    free(E.wrap.tree);
+    E.wrap.tree = NULL;
+  }
+}
+
+/* Editor Functions */
+
+// Insert character
+void editorInsertChar(int c) {
+  if (E.cy == E.numrows) {
+    editorInsertRow(E.numrows, "", 0);
+  }
+  editorRowInsertChar(&E.row[E.cy], E.cx, c);
+  E.cx++;
+}
+
+// Handle Enter key
+void editorInsertNewline() {
+  if (E.cx == 0) {
+    editorInsertRow(E.cy, "", 0);
+  } else {
+    erow *row = editorRowResident(&E.row[E.cy]);
+    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+    row = &E.row[E.cy];
+    journalEdit(E.cy, E.cx, row->size - E.cx, NULL, 0);
+    editorRowPatch(row, E.cx, row->size - E.cx, NULL, 0);
+  }
+  E.cy++;
+  E.cx = 0;
+}
+
+// Append row
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorRowReplace(row, row->size, 0, s, len);
+}
+
+// Delete character
+void editorDelChar() {
+  if (E.cy == E.numrows)
+    return;
+  if (E.cx == 0 && E.cy == 0)
+    return;
+
+  erow *row = editorRowResident(&E.row[E.cy]);
+  if (E.cx > 0) {
+    int at = editorRowPrevCx(row, E.cx);
+    editorRowReplace(row, at, E.cx - at, NULL, 0);
+    E.cx = at;
+  } else {
+    if (!editorRowFits((size_t)E.row[E.cy - 1].size + row->size))
+      return;
+    E.cx = E.row[E.cy - 1].size;
+    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+    editorDelRow(E.cy);
+    E.cy--;
+  }
+}
+
+/* Swap Journal */
+
+// Swap file path for a file: .name.hswp next to it
+char *journalPath(const char *filename) {
+  const char *base = strrchr(filename, '/');
+  int dirlen = base ? base - filename + 1 : 0;
+  base = base ? base + 1 : filename;
+  char *path = malloc(dirlen + strlen(base) + 7);
+  sprintf(path, "%.*s.%s.hswp", dirlen, filename, base);
+  return path;
+}
+
+// Append raw bytes to a growing buffer of records
+void journalGrow(char **buf, size_t *len, size_t *cap, const void *s,
+                 size_t n) {
+  if (*len + n > *cap) {
+    *cap = (*len + n) * 2;
+    *buf = realloc(*buf, *cap);
+  }
+  memcpy(&(*buf)[*len], s, n);
+  *len += n;
+}
+
+// Append raw bytes to the pending records, caller holds the lock
+void journalPut(struct editorJournal *j, const void *s, size_t len) {
+  if (len == 0)
+    return;
+  journalGrow(&j->buf, &j->len, &j->cap, s, len);
+  if (j->keeping)
+    journalGrow(&j->kept, &j->keptlen, &j->keptcap, s, len);
+}
+
+// Append an unsigned LEB128 number, caller holds the lock
+void journalPutNum(struct editorJournal *j, uint64_t v) {
+  unsigned char b[10];
+  int n = 0;
+  do {
+    b[n] = v & 0x7f;
+    v >>= 7;
+    if (v)
+      b[n] |= 0x80;
+    n++;
+  } while (v);
+  journalPut(j, b, n);
+}
+
+// Append the header identifying the file the records apply to
+void journalPutHeader(struct editorJournal *j, struct stat *st) {
+  journalPut(j, HELIS_SWAP_MAGIC, 8);
+  journalPutNum(j, st->st_ino);
+  journalPutNum(j, st->st_size);
+  journalPutNum(j, st->st_mtim.tv_sec);
+  journalPutNum(j, st->st_mtim.tv_nsec);
+}
+
+// Write the records out as they come, fsyncing at most every
+// HELIS_SWAP_SYNC_MS so that a burst of edits costs one sync
+void *journalWriter(void *arg) {
+  struct editorJournal *j = arg;
+  int unsynced = 0;
+
+  pthread_mutex_lock(&j->lock);
+  while (1) {
+    if (!j->len && !j->reset && !j->stop) {
+      if (!unsynced) {
+        pthread_cond_wait(&j->cond, &j->lock);
+        continue;
+      }
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += HELIS_SWAP_SYNC_MS / 1000;
+      ts.tv_nsec += (HELIS_SWAP_SYNC_MS % 1000) * 1000000L;
+      if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+      }
+      if (pthread_cond_timedwait(&j->cond, &j->lock, &ts) != ETIMEDOUT)
+        continue;
+      pthread_mutex_unlock(&j->lock);
+      fdatasync(j->fd);
+      unsynced = 0;
+      pthread_mutex_lock(&j->lock);
+      continue;
+    }
+
+    // Take the batch and write it without holding the lock
+    char *buf = j->buf;
+    size_t len = j->len;
+    int reset = j->reset;
+    int stop = j->stop;
+    j->buf = NULL;
+    j->len = j->cap = 0;
+    j->reset = 0;
+    pthread_mutex_unlock(&j->lock);
+
+    if (reset && ftruncate(j->fd, 0) == -1)
+      len = 0;
+    editorWriteAll(j->fd, buf, len);
+    free(buf);
+    unsynced = 1;
+
+    if (stop) {
+      fdatasync(j->fd);
+      return NULL;
+    }
+    pthread_mutex_lock(&j->lock);
+  }
+}
+
+// Start journaling the buffer, appending to an existing swap file when
+// recovering and refusing to clobber one otherwise
+void journalOpen(int recovering) {
+  if (E.filename == NULL || E.journal)
+    return;
+
+  char *path = journalPath(E.filename);
+  int flags = O_WRONLY | O_APPEND | O_CLOEXEC | O_CREAT;
+  int fd = open(path, recovering ? flags : flags | O_EXCL, 0600);
+  if (fd == -1) {
+    if (errno == EEXIST)
+      editorSetStatusMessage("Swap file %s exists, recover with helis -r",
+                             path);
+    free(path);
+    return;
+  }
+
+  struct editorJournal *j = calloc(1, sizeof(*j));
+  j->path = path;
+  j->fd = fd;
+  pthread_mutex_init(&j->lock, NULL);
+  pthread_cond_init(&j->cond, NULL);
+  if (!recovering)
+    journalPutHeader(j, &E.disk_stat);
+  if (pthread_create(&j->thread, NULL, journalWriter, j) != 0) {
+    close(fd);
+    unlink(path);
+    free(path);
+    free(j->buf);
+    free(j);
+    return;
+  }
+  E.journal = j;
+}
+
+// Stop journaling, removing the swap file unless keep is set
+void journalClose(int keep) {
+  struct editorJournal *j = E.journal;
+  if (j == NULL)
+    return;
+  E.journal = NULL;
+
+  pthread_mutex_lock(&j->lock);
+  j->stop = 1;
+  pthread_cond_signal(&j->cond);
+  pthread_mutex_unlock(&j->lock);
+  pthread_join(j->thread, NULL);
+
+  close(j->fd);
+  if (!keep)
+    unlink(j->path);
+  free(j->path);
+  free(j->buf);
+  free(j->kept);
+  free(j);
+}
+
+// Keep a copy of the records from now on, as a save is starting
+void journalKeep() {
+  struct editorJournal *j = E.journal;
+  if (j == NULL)
+    return;
+  pthread_mutex_lock(&j->lock);
+  j->keeping = 1;
+  j->keptlen = 0;
+  pthread_mutex_unlock(&j->lock);
+}
+
+// Stop keeping records. Once saved, the swap file starts over for the
+// file on disk with the records kept, those of the edits made meanwhile
+void journalRebase(int saved) {
+  struct editorJournal *j = E.journal;
+  if (j == NULL)
+    return;
+  pthread_mutex_lock(&j->lock);
+  j->keeping = 0;
+  if (saved) {
+    j->len = 0;
+    j->reset = 1;
+    journalPutHeader(j, &E.disk_stat);
+    journalPut(j, j->kept, j->keptlen);
+    pthread_cond_signal(&j->cond);
+  }
+  free(j->kept);
+  j->kept = NULL;
+  j->keptlen = j->keptcap = 0;
+  pthread_mutex_unlock(&j->lock);
+}
+
+// Drop all records, the file on disk now matches the buffer
+void journalReset() {
+  struct editorJournal *j = E.journal;
+  if (j == NULL)
+    return;
+  pthread_mutex_lock(&j->lock);
+  j->len = 0;
+  j->reset = 1;
+  journalPutHeader(j, &E.disk_stat);
+  pthread_cond_signal(&j->cond);
+  pthread_mutex_unlock(&j->lock);
+}
+
+// Record replacing del chars at (row, at) with len chars of s
+void journalEdit(int row, int at, int del, const char *s, int len) {
+  struct editorJournal *j = E.journal;
+  if (j == NULL)
+    return;
+  pthread_mutex_lock(&j->lock);
+  journalPut(j, "e", 1);
+  journalPutNum(j, row);
+  journalPutNum(j, at);
+  journalPutNum(j, del);
+  journalPutNum(j, len);
+  journalPut(j, s, len);
+  pthread_cond_signal(&j->cond);
+  pthread_mutex_unlock(&j->lock);
+}
+
+// Record replacing del rows at `at` with n rows
+void journalRows(int at, int del, char **lines, size_t *lens, int n) {
+  struct editorJournal *j = E.journal;
+  if (j == NULL)
+    return;
+  pthread_mutex_lock(&j->lock);
+  journalPut(j, "r", 1);
+  journalPutNum(j, at);
+  journalPutNum(j, del);
+  journalPutNum(j, n);
+  for (int k = 0; k < n; k++) {
+    journalPutNum(j, lens[k]);
+    journalPut(j, lines[k], lens[k]);
+  }
+  pthread_cond_signal(&j->cond);
+  pthread_mutex_unlock(&j->lock);
+}
+
+// Read an unsigned LEB128 number, returns 0 past the end
+int journalGetNum(const unsigned char **p, const unsigned char *end,
+                  uint64_t *v) {
+  *v = 0;
+  for (int shift = 0; *p < end && shift < 64; shift += 7) {
+    unsigned char b = *(*p)++;
+    *v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return 1;
+  }
+  return 0;
+}
+
+// Replay the swap file of the open file onto the buffer, returns the
+// number of edits applied or -1 if the journal can't be used
+int journalReplay() {
+  char *path = journalPath(E.filename);
+  int fd = open(path, O_RDONLY);
+  free(path);
+  if (fd == -1)
+    return -1;
+
+  struct stat st;
+  unsigned char *data = NULL;
+  ssize_t len = 0;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    data = malloc(st.st_size);
+    while (len < st.st_size) {
+      ssize_t n = read(fd, data + len, st.st_size - len);
+      if (n <= 0)
+        break;
+      len += n;
+    }
+  }
+  close(fd);
+
+  const unsigned char *p = data, *end = data + len;
+  uint64_t ino, size, sec, nsec;
+  if (len < 8 || memcmp(p, HELIS_SWAP_MAGIC, 8) != 0 ||
+      (p += 8, !journalGetNum(&p, end, &ino)) ||
+      !journalGetNum(&p, end, &size) || !journalGetNum(&p, end, &sec) ||
+      !journalGetNum(&p, end, &nsec) || ino != (uint64_t)E.disk_stat.st_ino ||
+      size != (uint64_t)E.disk_stat.st_size ||
+      sec != (uint64_t)E.disk_stat.st_mtim.tv_sec ||
+      nsec != (uint64_t)E.disk_stat.st_mtim.tv_nsec) {
+    free(data);
+    return -1;
+  }
+
+  // A record cut short by the crash ends the replay
+  int applied = 0;
+  while (p < end) {
+    const unsigned char *rec = p++;
+    uint64_t a, b, c, n;
+    if (*rec == 'e') {
+      if (!journalGetNum(&p, end, &a) || !journalGetNum(&p, end, &b) ||
+          !journalGetNum(&p, end, &c) || !journalGetNum(&p, end, &n) ||
+          n > (uint64_t)(end - p))
+        break;
+      if (a < (uint64_t)E.numrows && b + c <= (uint64_t)E.row[a].size)
+        editorRowPatch(&E.row[a], b, c, (const char *)p, n);
+      p += n;
+    } else if (*rec == 'r') {
+      if (!journalGetNum(&p, end, &a) || !journalGetNum(&p, end, &b) ||
+          !journalGetNum(&p, end, &n) || n > (uint64_t)(end - p))
+        break;
+      char **lines = malloc(sizeof(char *) * (n ? n : 1));
+      size_t *lens = malloc(sizeof(size_t) * (n ? n : 1));
+      uint64_t k;
+      for (k = 0; k < n; k++) {
+        if (!journalGetNum(&p, end, &c) || c > (uint64_t)(end - p))
+          break;
+        lines[k] = (char *)p;
+        lens[k] = c;
+        p += c;
+      }
+      if (k == n)
+        editorReplaceRows(a, b, lines, lens, n);
+      free(lines);
+      free(lens);
+      if (k < n)
+        break;
+    } else {
+      break;
+    }
+    applied++;
+  }
+  free(data);
+  E.dirty = applied;
+  return applied;
+}
+
+/* Open Cache */
+
+// Path of the open cache of a file, NULL if there is nowhere to keep it
+char *editorCachePath(const char *filename) {
+  char real[PATH_MAX];
+  if (realpath(filename, real) == NULL)
+    return NULL;
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char dir[PATH_MAX];
+  if (xdg && *xdg)
+    snprintf(dir, sizeof(dir), "%s/helis", xdg);
+  else if (home && *home)
+    snprintf(dir, sizeof(dir), "%s/.cache/helis", home);
+  else
+    return NULL;
+  char *path = malloc(strlen(dir) + 18);
+  sprintf(path, "%s/%016llx", dir,
+          (unsigned long long)editorHashBytes(real, strlen(real)));
+  return path;
+}
+
+// Hash of what the lexer states of the rows depend on
+uint64_t editorCacheSyntax() {
+  struct editorSyntax *s = E.syntax;
+  if (s == NULL)
+    return 0;
+  char key[512];
+  snprintf(key, sizeof(key), "%s\n%s\n%s\n%s\n%d\n%s", s->filetype,
+           s->singleline_comment_start ? s->singleline_comment_start : "",
+           s->multiline_comment_start ? s->multiline_comment_start : "",
+           s->multiline_comment_end ? s->multiline_comment_end : "",
+           s->flags, HELIS_VERSION);
+  return editorHashBytes(key, strlen(key));
+}
+
+// Build the rows from the open cache of the file, whose len bytes are in
+// buf and whose hash is hash, leaving them cold in compressed blocks as a
+// load without the cache would, and freeing buf. Rows are only highlighted
+// once they are drawn, starting from the lexer state the cache has for the
+// row before. Returns -1, with buf still the caller's, if there is no
+// valid cache
+int editorCacheLoad(char *buf, size_t len, uint64_t hash) {
+  char *path = editorCachePath(E.filename);
+  if (path == NULL)
+    return -1;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  free(path);
+  if (fd == -1)
+    return -1;
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 &&
+      (size_t)st.st_size >= sizeof(struct editorCacheHeader))
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  const struct editorCacheHeader *h = map;
+  const struct editorCacheRow *r = (const void *)(h + 1);
+  size_t rows = (st.st_size - sizeof(*h)) / sizeof(*r);
+  int ok = memcmp(h->magic, HELIS_CACHE_MAGIC, 8) == 0 && h->size == len &&
+           h->mtime_sec == E.disk_stat.st_mtim.tv_sec &&
+           h->mtime_nsec == E.disk_stat.st_mtim.tv_nsec &&
+           h->syntax == editorCacheSyntax() && h->numrows == rows &&
+           rows > 0 && rows <= INT_MAX &&
+           sizeof(*h) + rows * sizeof(*r) == (size_t)st.st_size &&
+           h->rows_hash == editorHashBytes((const char *)r,
+                                           rows * sizeof(*r)) &&
+           h->hash == hash;
+  for (size_t y = 0; ok && y < rows; y++)
+    ok = r[y].off <= len && r[y].len <= len - r[y].off &&
+         r[y].len <= HELIS_MAX_ROW;
+  if (!ok) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  E.row = calloc(rows, sizeof(erow));
+  char *raw = NULL;
+  size_t y = 0;
+  while (y < rows) {
+    // Runs of rows as editorFreezeRows packs them, their chars fitting an
+    // int
+    size_t start = y;
+    int rawlen = 0;
+    while (y < rows && y - start < HELIS_BLOCK_ROWS &&
+           r[y].len <= (uint32_t)(HELIS_MAX_ROW - rawlen))
+      rawlen += r[y++].len;
+    raw = realloc(raw, rawlen ? rawlen : 1);
+    int off = 0;
+    for (size_t j = start; j < y; j++) {
+      memcpy(&raw[off], &buf[r[j].off], r[j].len);
+      off += r[j].len;
+    }
+    struct editorBlock *b = editorBlockPack(raw, rawlen, y - start);
+
+    off = 0;
+    for (size_t j = start; j < y; j++) {
+      erow *row = &E.row[j];
+      row->idx = j;
+      row->size = r[j].len;
+      row->hl_open_comment = (r[j].flags & CACHE_OPEN_COMMENT) != 0;
+      row->width = -1;
+      row->block = b;
+      row->boff = off;
+      off += row->size;
+      row->brackets_stale = !(r[j].flags & CACHE_BRACKETS);
+      for (int k = 0; k < 3; k++) {
+        row->brackets[k].delta = r[j].brackets[k][0];
+        row->brackets[k].min = r[j].brackets[k][1];
+      }
+    }
+  }
+  free(raw);
+  free(buf);
+  E.numrows = rows;
+  editorWrapInvalidate();
+  munmap(map, st.st_size);
+  return 0;
+}
+
+// Write the open cache of the buffer as it was just read from or written
+// to disk, with contents hashing to hash. Row y starts at offs[y] of the
+// file, or with offs NULL right after the newline ending the row before
+void editorCacheSave(uint64_t hash, const uint64_t *offs) {
+  if (HELIS_CACHE_ROWS <= 0 || E.numrows < HELIS_CACHE_ROWS)
+    return;
+  char *path = editorCachePath(E.filename);
+  if (path == NULL)
+    return;
+  // Create the cache directory, and the one it is in
+  char *slash = strrchr(path, '/');
+  *slash = '\0';
+  char *up = strrchr(path, '/');
+  if (up) {
+    *up = '\0';
+    mkdir(path, 0700);
+    *up = '/';
+  }
+  mkdir(path, 0700);
+  *slash = '/';
+
+  // Written aside and renamed over, so that a reader never sees it partial
+  char *tmp = malloc(strlen(path) + 16);
+  sprintf(tmp, "%s.%d", path, (int)getpid());
+  size_t size = sizeof(struct editorCacheHeader) +
+                E.numrows * sizeof(struct editorCacheRow);
+  // Built in memory and written, a full disk then fails the write instead
+  // of faulting on a mapping
+  char *data = calloc(1, size);
+  if (data == NULL) {
+    free(tmp);
+    free(path);
+    return;
+  }
+
+  struct editorCacheHeader *h = (void *)data;
+  struct editorCacheRow *r = (void *)(h + 1);
+  uint64_t off = 0;
+  for (int y = 0; y < E.numrows; y++) {
+    erow *row = &E.row[y];
+    r[y].off = offs ? offs[y] : off;
+    r[y].len = row->size;
+    r[y].flags = row->hl_open_comment ? CACHE_OPEN_COMMENT : 0;
+    off += row->size + 1;
+    // Cold rows that were never highlighted are left to be summed up
+    // when they are
+    if (row->chars)
+      editorRowBrackets(row);
+    if (row->brackets_stale)
+      continue;
+    int fits = 1;
+    for (int k = 0; k < 3; k++) {
+      r[y].brackets[k][0] = row->brackets[k].delta;
+      r[y].brackets[k][1] = row->brackets[k].min;
+      fits &= row->brackets[k].delta == r[y].brackets[k][0] &&
+              row->brackets[k].min == r[y].brackets[k][1];
+    }
+    if (fits)
+      r[y].flags |= CACHE_BRACKETS;
+  }
+  memcpy(h->magic, HELIS_CACHE_MAGIC, 8);
+  h->size = E.disk_stat.st_size;
+  h->mtime_sec = E.disk_stat.st_mtim.tv_sec;
+  h->mtime_nsec = E.disk_stat.st_mtim.tv_nsec;
+  h->hash = hash;
+  h->syntax = editorCacheSyntax();
+  h->rows_hash = editorHashBytes((const char *)r, E.numrows * sizeof(*r));
+  h->numrows = E.numrows;
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd != -1) {
+    int ok = editorWriteAll(fd, data, size) == 0;
+    if (close(fd) == -1 || !ok || rename(tmp, path) == -1)
+      unlink(tmp);
+  }
+  free(data);
+  free(tmp);
+  free(path);
+}
+
+/* File I/O */
+
+// FNV-1a hash of a byte string following the bytes hashed to h
+uint64_t editorHashMore(uint64_t h, const char *s, size_t len) {
+  for (size_t j = 0; j < len; j++) {
+    h ^= (unsigned char)s[j];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// FNV-1a hash of a byte string
+uint64_t editorHashBytes(const char *s, size_t len) {
+  return editorHashMore(1469598103934665603ULL, s, len);
+}
+
+// Watch the directory of the file, so that replacing it by rename is seen
+void editorWatchFile() {
+  if (E.inotify_fd != -1)
+    close(E.inotify_fd);
+  E.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (E.inotify_fd == -1 || E.filename == NULL)
+    return;
+
+  char *dir = strdup(E.filename);
+  char *slash = strrchr(dir, '/');
+  if (slash)
+    slash[slash == dir] = '\0';
+  if (inotify_add_watch(E.inotify_fd, slash ? dir : ".",
+                        IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) == -1) {
+    close(E.inotify_fd);
+    E.inotify_fd = -1;
+  }
+  free(dir);
+}
+
+// Same file contents as recorded at last open or save
+int editorSameDiskStat(struct stat *a, struct stat *b) {
+  return a->st_ino == b->st_ino && a->st_dev == b->st_dev &&
+         a->st_size == b->st_size &&
+         a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+         a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// Row holds exactly the len bytes of s
+int editorRowIs(erow *row, const char *s, size_t len) {
+  return (size_t)row->size == len && memcmp(editorRowChars(row), s, len) == 0;
+}
+
+// Reload the file replacing only the rows that differ from the buffer
+void editorReload() {
+  editorSaveWait();
+  editorGapClose();
+  FILE *fp = fopen(E.filename, "r");
+  if (!fp) {
+    editorSetStatusMessage("Can't reload: %s", strerror(errno));
+    return;
+  }
+  struct stat st;
+  fstat(fileno(fp), &st);
+
+  int n = 0, cap = 0;
+  char **lines = NULL;
+  size_t *lens = NULL;
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    while (linelen > 0 &&
+           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+      linelen--;
+    if (n == cap) {
+      cap = cap ? cap * 2 : 1024;
+      lines = realloc(lines, sizeof(char *) * cap);
+      lens = realloc(lens, sizeof(size_t) * cap);
+    }
+    lines[n] = malloc(linelen + 1);
+    memcpy(lines[n], line, linelen);
+    lens[n] = linelen;
+    n++;
+  }
+  free(line);
+  fclose(fp);
+
+  // Unchanged head and tail of the file
+  int min = n < E.numrows ? n : E.numrows;
+  int head = 0, tail = 0;
+  while (head < min && editorRowIs(&E.row[head], lines[head], lens[head]))
+    head++;
+  while (tail < min - head &&
+         editorRowIs(&E.row[E.numrows - 1 - tail], lines[n - 1 - tail],
+                     lens[n - 1 - tail]))
+    tail++;
+
+  int del = E.numrows - head - tail;
+  int ins = n - head - tail;
+  int failed =
+      (del || ins) &&
+      editorReplaceRows(head, del, &lines[head], &lens[head], ins) == -1;
+  for (int j = 0; j < n; j++)
+    free(lines[j]);
+  free(lines);
+  free(lens);
+  // The buffer is left as it was, and differs from the file
+  if (failed) {
+    E.disk_changed = 1;
+    editorSetStatusMessage("Can't reload: line too long");
+    return;
+  }
+
+  // Keep the cursor on the same text when it is after the change
+  if (E.cy >= head + del)
+    E.cy += ins - del;
+  if (E.cy > E.numrows)
+    E.cy = E.numrows;
+  if (E.cy < E.numrows && E.cx > E.row[E.cy].size)
+    E.cx = E.row[E.cy].size;
+
+  E.dirty = 0;
+  E.disk_changed = 0;
+  E.disk_stat = st;
+  journalReset();
+  editorSetStatusMessage("Reloaded from disk, %d lines changed",
+                         del > ins ? del : ins);
+}
+
+// React to a change of the file on disk
+void editorCheckDisk() {
+  struct stat st;
+  if (E.filename == NULL || stat(E.filename, &st) == -1)
+    return;
+  if (editorSameDiskStat(&st, &E.disk_stat))
+    return;
+  // Our own save is changing it
+  if (E.save)
+    return;
+
+  if (E.dirty) {
+    E.disk_changed = 1;
+    editorSetStatusMessage(
+        "WARNING!!! File changed on disk. :e! to reload, :w! to overwrite");
+  } else {
+    editorReload();
+  }
+  editorRefreshScreen();
+}
+
+// Drop the rows loaded from a file that can't be opened after all,
+// returns -1 with errno set to err
+int editorOpenFail(int err) {
+  for (int j = 0; j < E.numrows; j++)
+    editorFreeRow(&E.row[j]);
+  free(E.row);
+  E.row = NULL;
+  E.numrows = 0;
+  E.dirty = 0;
+  memset(&E.disk_stat, 0, sizeof(E.disk_stat));
+  errno = err;
+  return -1;
+}
+
+// Open file in the editor, returns -1 leaving the buffer empty if it isn't
+// a regular file or has a line too long to edit
+int editorOpen(char *filename) {
+  free(E.filename);
+  // Set File Name
+  E.filename = strdup(filename);
+
+  // Set highlight
+  editorSelectSyntaxHighlight();
+
+  // Read the whole file
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    die("open");
+  fstat(fd, &E.disk_stat);
+  if (!S_ISREG(E.disk_stat.st_mode) ||
+      (uint64_t)E.disk_stat.st_size >= SIZE_MAX / 2) {
+    int err = S_ISDIR(E.disk_stat.st_mode)   ? EISDIR
+              : S_ISREG(E.disk_stat.st_mode) ? EFBIG
+                                             : EINVAL;
+    close(fd);
+    return editorOpenFail(err);
+  }
+  size_t len = 0, cap = (size_t)E.disk_stat.st_size + 1;
+  char *buf = malloc(cap);
+  if (buf == NULL)
+    die("malloc");
+  ssize_t nread;
+  while ((nread = read(fd, &buf[len], cap - len)) > 0) {
+    len += nread;
+    if (len == cap && (buf = realloc(buf, cap *= 2)) == NULL)
+      die("realloc");
+  }
+  if (nread == -1)
+    die("read");
+  close(fd);
+  uint64_t hash = editorHashBytes(buf, len);
+
+  if (editorCacheLoad(buf, len, hash) == -1) {
+    // Copy line form file into erow struct
+    int frozen = 0;
+    uint64_t *offs = NULL;
+    size_t cap_offs = 0;
+    char *p = buf, *end = buf + len;
+    while (p < end) {
+      char *nl = memchr(p, '\n', end - p);
+      char *e = nl ? nl : end;
+      while (e > p && e[-1] == '\r')
+        e--;
+      // Rows and their count are ints
+      if ((size_t)(e - p) > HELIS_MAX_ROW || E.numrows == INT_MAX) {
+        free(buf);
+        free(offs);
+        return editorOpenFail(EFBIG);
+      }
+      if ((size_t)E.numrows == cap_offs) {
+        cap_offs = cap_offs ? cap_offs * 2 : 1024;
+        offs = realloc(offs, sizeof(uint64_t) * cap_offs);
+      }
+      offs[E.numrows] = p - buf;
+      editorInsertRow(E.numrows, p, e - p);
+      p = nl ? nl + 1 : end;
+      // Pack rows while loading so that big files are never fully resident
+      if (E.numrows - frozen >= HELIS_BLOCK_ROWS * 4 &&
+          E.numrows >= HELIS_COLD_ROWS) {
+        editorFreezeRows(frozen);
+        frozen = E.numrows;
+      }
+    }
+    free(buf);
+    editorCacheSave(hash, offs);
+    free(offs);
+    editorFreezeRows(frozen);
+  }
+  // Set dirtiness to false
+  E.dirty = 0;
+
+  editorWatchFile();
+  journalOpen(0);
+  return 0;
+}
+
+// Whether a file can be opened, -1 with errno set if not
+int editorCanOpen(const char *filename) {
+  struct stat st;
+  if (access(filename, R_OK) == -1 || stat(filename, &st) == -1)
+    return -1;
+  if (!S_ISREG(st.st_mode)) {
+    errno = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+// Open a file and replay its swap journal onto it
+void editorRecover(char *filename) {
+  if (editorOpen(filename) == -1) {
+    editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+    return;
+  }
+  int applied = journalReplay();
+  if (applied == -1) {
+    editorSetStatusMessage("No usable swap file for %s", filename);
+    return;
+  }
+  journalOpen(1);
+  editorSetStatusMessage("Recovered %d edits, :w to keep them", applied);
+}
+
+// Switch the buffer to another file, refusing to drop unsaved changes;
+// returns -1 if it didn't
+int editorOpenFile(char *filename) {
+  editorSaveWait();
+  if (E.dirty) {
+    editorSetStatusMessage("No write since last change, :w first");
+    return -1;
+  }
+  if (editorCanOpen(filename) == -1) {
+    editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+    return -1;
+  }
+
+  journalClose(0);
+  editorWordsFree();
+  editorFoldsFree();
+  editorCursorsClear();
+  editorSearchFree();
+  for (int j = 0; j < E.numrows; j++)
+    editorFreeRow(&E.row[j]);
+  free(E.row);
+  E.row = NULL;
+  E.numrows = 0;
+  E.cx = E.cy = 0;
+  E.rowoff = E.coloff = 0;
+  E.lineoff = 0;
+  E.cold_rowoff = 0;
+  E.gaprow = -1;
+  E.disk_changed = 0;
+  if (editorOpen(filename) == -1) {
+    editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+    return -1;
+  }
+  editorSetStatusMessage("\"%s\" %d lines", E.filename, E.numrows);
+  return 0;
+}
+
+// Write n bytes of a save, hashing them if the open cache needs it
+int editorSaveOut(struct editorSave *s, int fd, const char *p, size_t n) {
+  if (s->hash)
+    s->sum = editorHashMore(s->sum, p, n);
+  return editorWriteAll(fd, p, n);
+}
+
+// Write the snapshot of a save to its file, gathering short rows into
+// bigger writes and decompressing cold ones into a buffer of its own. It
+// goes to a temporary file renamed over the original once synced, so a
+// crash meanwhile leaves the file as the swap file knows it
+void *editorSaveWriter(void *arg) {
+  struct editorSave *s = arg;
+  char *buf = malloc(HELIS_SAVE_BUF);
+  char *cold = NULL;
+  struct editorBlock *block = NULL; // Block decompressed into cold
+  size_t blen = 0;
+  s->sum = editorHashBytes(NULL, 0);
+
+  // Through a symlink, the file it points to is the one replaced
+  char *path = realpath(s->filename, NULL);
+  if (path == NULL)
+    path = strdup(s->filename);
+  char *tmp = malloc(strlen(path) + 16);
+  char *slash = strrchr(path, '/');
+  int dirlen = slash ? slash - path + 1 : 0;
+  sprintf(tmp, "%.*s.%s.XXXXXX", dirlen, path, &path[dirlen]);
+  int fd = mkostemp(tmp, O_CLOEXEC);
+  int ok = fd != -1 && buf;
+  struct stat orig;
+  if (ok && stat(path, &orig) == 0) {
+    // Fails unless root or only the group changes, the save goes on
+    fchown(fd, orig.st_uid, orig.st_gid);
+    ok = fchmod(fd, orig.st_mode & 07777) == 0;
+  } else if (ok) {
+    ok = fchmod(fd, s->mode) == 0;
+  }
+  for (int y = 0; ok && y < s->numrows; y++) {
+    struct editorSaveRow *r = &s->rows[y];
+    const char *chars = r->chars;
+    if (chars == NULL) {
+      if (r->block != block) {
+        block = r->block;
+        free(cold);
+        cold = malloc(block->rawlen ? block->rawlen : 1);
+        if (cold == NULL ||
+            editorLzDecompress(block->data, block->clen, cold,
+                               block->rawlen) == -1) {
+          errno = cold ? EIO : ENOMEM;
+          ok = 0;
+          break;
+        }
+      }
+      chars = &cold[r->boff];
+    }
+
+    size_t size = (size_t)r->size + 1;
+    if (blen + size > HELIS_SAVE_BUF) {
+      ok = editorSaveOut(s, fd, buf, blen) == 0;
+      blen = 0;
+    }
+    if (ok && size > HELIS_SAVE_BUF) {
+      ok = editorSaveOut(s, fd, chars, r->size) == 0 &&
+           editorSaveOut(s, fd, "\n", 1) == 0;
+    } else if (ok) {
+      memcpy(&buf[blen], chars, r->size);
+      buf[blen + r->size] = '\n';
+      blen += size;
+    }
+  }
+  if (ok && blen)
+    ok = editorSaveOut(s, fd, buf, blen) == 0;
+  if (ok)
+    ok = fsync(fd) == 0 && fstat(fd, &s->st) == 0;
+  if (fd != -1 && close(fd) == -1)
+    ok = 0;
+  if (ok)
+    ok = rename(tmp, path) == 0;
+  s->err = ok ? 0 : errno ? errno : EIO;
+  if (fd != -1 && !ok)
+    unlink(tmp);
+  free(tmp);
+  free(path);
+  free(buf);
+  free(cold);
+
+  pthread_mutex_lock(&s->lock);
+  s->finished = 1;
+  pthread_mutex_unlock(&s->lock);
+  write(s->wake, "s", 1);
+  return NULL;
+}
+
+// Wrap up the save once its writer is done: take the file on disk as the
+// one edited, dirty only by the edits made while it was written
+void editorSaveFinish() {
+  struct editorSave *s = E.save;
+  if (s->threaded)
+    pthread_join(s->thread, NULL);
+  E.save = NULL;
+  for (int j = 0; j < E.numrows; j++)
+    E.row[j].shared = 0;
+  for (int j = 0; j < s->norphans; j++)
+    free(s->orphans[j]);
+  for (int y = 0; y < s->numrows; y++) {
+    if (s->rows[y].chars == NULL)
+      editorBlockRelease(s->rows[y].block);
+  }
+
+  if (s->err == 0) {
+    E.disk_stat = s->st;
+    E.disk_changed = 0;
+    E.dirty -= s->dirty;
+    // The rows only match the file if nothing changed meanwhile
+    if (E.dirty == 0 && s->hash)
+      editorCacheSave(s->sum, NULL);
+    // A swap file started now would miss the edits made meanwhile
+    if (E.journal)
+      journalRebase(1);
+    else if (E.dirty == 0)
+      journalOpen(0);
+    editorSetStatusMessage("%zu bytes writen to disk", s->len);
+  } else {
+    journalRebase(0);
+    editorSetStatusMessage("Filed ot save: I/o error: %s", strerror(s->err));
+  }
+
+  pthread_mutex_destroy(&s->lock);
+  free(s->orphans);
+  free(s->rows);
+  free(s->filename);
+  free(s);
+}
+
+// Wrap up the save if its writer is done, unless a prompt is up
+void editorSaveWake() {
+  struct editorSave *s = E.save;
+  if (s == NULL || E.prompting)
+    return;
+  pthread_mutex_lock(&s->lock);
+  int finished = s->finished;
+  pthread_mutex_unlock(&s->lock);
+  if (finished) {
+    editorSaveFinish();
+    editorRefreshScreen();
+  }
+}
+
+// Wait for the save in progress, if any, to be done
+void editorSaveWait() {
+  if (E.save)
+    editorSaveFinish();
+}
+
+// Save file changes to disk, force overwrites changes made by others. The
+// rows are snapshotted, sharing their chars until edited, and written by a
+// background thread while editing goes on
+void editorSave(int force) {
+  editorSaveWait();
+  editorGapClose();
+  if (E.filename == NULL) {
+    E.filename = editorPrompt("Save as: %s", NULL);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntaxHighlight();
+    editorWatchFile();
+  }
+
+  // Don't clobber a file that was changed on disk since we read it
+  struct stat st;
+  if (!force && E.disk_stat.st_ino && stat(E.filename, &st) == 0 &&
+      !editorSameDiskStat(&st, &E.disk_stat))
+    E.disk_changed = 1;
+  if (!force && E.disk_changed) {
+    editorSetStatusMessage("File changed on disk, use :w! to overwrite");
+    return;
+  }
+
+  struct editorSave *s = calloc(1, sizeof(*s));
+  if (s)
+    s->rows = malloc(sizeof(struct editorSaveRow) * (E.numrows + 1));
+  if (s == NULL || s->rows == NULL) {
+    free(s);
+    editorSetStatusMessage("Can't save: %s", strerror(ENOMEM));
+    return;
+  }
+  for (int y = 0; y < E.numrows; y++) {
+    erow *row = &E.row[y];
+    struct editorSaveRow *r = &s->rows[y];
+    r->chars = row->chars;
+    r->size = row->size;
+    s->len += (size_t)row->size + 1;
+    if (row->chars) {
+      row->shared = 1;
+    } else {
+      r->block = row->block;
+      r->boff = row->boff;
+      row->block->refs++;
+    }
+  }
+  s->numrows = E.numrows;
+  s->filename = strdup(E.filename);
+  s->dirty = E.dirty;
+  s->wake = E.wake[1];
+  s->hash = HELIS_CACHE_ROWS > 0 && E.numrows >= HELIS_CACHE_ROWS;
+  mode_t mask = umask(0);
+  umask(mask);
+  s->mode = 0644 & ~mask;
+  pthread_mutex_init(&s->lock, NULL);
+  E.save = s;
+  journalKeep();
+
+  if (pthread_create(&s->thread, NULL, editorSaveWriter, s) == 0) {
+    s->threaded = 1;
+    editorSetStatusMessage("Writing \"%s\"...", E.filename);
+  } else {
+    editorSaveWriter(s);
+    editorSaveFinish();
+  }
+}
+
+/* Find */
+
+// Substring matcher (Boyer-Moore-Horspool)
+struct editorMatcher {
+  const char *pat;
+  int len;
+  int skip[256]; // Shift for the byte under the pattern's last position
+};
+
+// Prepare a matcher for pat
+void editorMatcherInit(struct editorMatcher *m, const char *pat, int len) {
+  m->pat = pat;
+  m->len = len;
+  for (int c = 0; c < 256; c++)
+    m->skip[c] = len;
+  for (int j = 0; j < len - 1; j++)
+    m->skip[(unsigned char)pat[j]] = len - 1 - j;
+}
+
+// Index of the first match in s[from..len), or -1
+int editorMatcherFind(struct editorMatcher *m, const char *s, int len,
+                      int from) {
+  int plen = m->len;
+  if (plen == 0 || plen > len - from)
+    return -1;
+  if (plen == 1) {
+    const char *hit = memchr(&s[from], m->pat[0], len - from);
+    return hit ? hit - s : -1;
+  }
+
+  unsigned char last = m->pat[plen - 1];
+  int i = from;
+  while (i <= len - plen) {
+    unsigned char c = s[i + plen - 1];
+    if (c == last && memcmp(&s[i], m->pat, plen - 1) == 0)
+      return i;
+    i += m->skip[c];
+  }
+  return -1;
+}
+
+// Matches of a row, as offsets into its chars
+struct editorSearchRow {
+  int *at;
+  int n, cap;
+};
+
+// Matches of the last search in every row, kept up to date as rows are
+// edited, with a Fenwick tree of their counts to rank them
+struct editorSearch {
+  char *query;
+  struct editorMatcher m;
+  struct editorSearchRow *rows; // One per row of the file
+  int n;                        // Number of rows
+  int *tree;                    // Match counts of rows, 1-based
+  int tree_ok;                  // Whether tree is up to date with rows
+  int highlight;                // Whether matches are shown
+};
+
+// Find the matches of row y, overlapping ones included
+void editorSearchScan(struct editorSearch *s, int y) {
+  struct editorSearchRow *r = &s->rows[y];
+  erow *row = &E.row[y];
+  // Cold rows are searched without making them resident
+  const char *chars = editorRowChars(row);
+  r->n = 0;
+  int at = editorMatcherFind(&s->m, chars, row->size, 0);
+  while (at != -1) {
+    if (r->n == r->cap) {
+      r->cap = r->cap ? r->cap * 2 : 4;
+      r->at = realloc(r->at, sizeof(int) * r->cap);
+    }
+    r->at[r->n++] = at;
+    at = editorMatcherFind(&s->m, chars, row->size, at + 1);
+  }
+}
+
+// Drop the last search
+void editorSearchFree() {
+  struct editorSearch *s = E.search;
+  if (!s)
+    return;
+  for (int y = 0; y < s->n; y++)
+    free(s->rows[y].at);
+  free(s->rows);
+  free(s->tree);
+  free(s->query);
+  free(s);
+  E.search = NULL;
+}
+
+// Search the file for query. When query extends the last one only rows
+// that had matches can have some, so only those are searched again
+void editorSearchStart(const char *query) {
+  int len = strlen(query);
+  struct editorSearch *s = E.search;
+  if (len == 0) {
+    editorSearchFree();
+    return;
+  }
+  int narrow = s && len >= s->m.len && memcmp(query, s->query, s->m.len) == 0;
+  if (!narrow) {
+    editorSearchFree();
+    s = E.search = calloc(1, sizeof(struct editorSearch));
+    s->rows = calloc(E.numrows ? E.numrows : 1, sizeof(struct editorSearchRow));
+    s->n = E.numrows;
+  }
+  free(s->query);
+  s->query = strdup(query);
+  editorMatcherInit(&s->m, s->query, len);
+  for (int y = 0; y < s->n; y++) {
+    if (!narrow || s->rows[y].n > 0)
+      editorSearchScan(s, y);
+  }
+  s->tree_ok = 0;
+  s->highlight = 1;
+}
+
+// Count the matches of every row again if rows were added or removed
+void editorSearchValidate(struct editorSearch *s) {
+  if (s->tree_ok)
+    return;
+  s->tree = realloc(s->tree, sizeof(int) * (s->n + 1));
+  for (int y = 0; y < s->n; y++)
+    s->tree[y + 1] = s->rows[y].n;
+  editorFenwickBuild(s->tree, s->n);
+  s->tree_ok = 1;
+}
+
+// Number of matches of row y before chars offset x
+int editorSearchBefore(struct editorSearchRow *r, int x) {
+  int lo = 0, hi = r->n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (r->at[mid] < x)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Search an edited row again
+void editorSearchUpdate(erow *row) {
+  struct editorSearch *s = E.search;
+  if (!s || row->idx >= s->n)
+    return;
+  int old = s->rows[row->idx].n;
+  editorSearchScan(s, row->idx);
+  if (s->tree_ok)
+    editorFenwickAdd(s->tree, s->n, row->idx, s->rows[row->idx].n - old);
+}
+
+// Length of the matches of the search, 0 without one
+int editorSearchLen() {
+  return E.search ? E.search->m.len : 0;
+}
+
+// Follow del chars at `at` of a row being replaced with len chars. Only
+// matches that can overlap the edit are searched for again, the ones after
+// it are moved
+void editorSearchEdit(erow *row, int at, int del, int len) {
+  struct editorSearch *s = E.search;
+  if (!s || row->idx >= s->n)
+    return;
+  struct editorSearchRow *r = &s->rows[row->idx];
+  int plen = s->m.len;
+
+  // Matches starting in [from, at + del) touched the old chars, the new
+  // ones can start in [from, at + len)
+  int from = at - plen + 1 > 0 ? at - plen + 1 : 0;
+  int lo = editorSearchBefore(r, from);
+  int hi = editorSearchBefore(r, at + del);
+  int end = at + len + plen - 1 < row->size ? at + len + plen - 1 : row->size;
+  int buf[64], *found = buf, nfound = 0, capfound = 64;
+  int i = editorMatcherFind(&s->m, row->chars, end, from);
+  for (; i != -1; i = editorMatcherFind(&s->m, row->chars, end, i + 1)) {
+    if (nfound == capfound) {
+      capfound *= 2;
+      if (found == buf) {
+        found = malloc(sizeof(int) * capfound);
+        memcpy(found, buf, sizeof(buf));
+      } else {
+        found = realloc(found, sizeof(int) * capfound);
+      }
+    }
+    found[nfound++] = i;
+  }
+
+  int old = r->n;
+  int n = r->n - (hi - lo) + nfound;
+  if (n > r->cap) {
+    r->cap = n * 2;
+    r->at = realloc(r->at, sizeof(int) * r->cap);
+  }
+  if (r->n > hi)
+    memmove(&r->at[lo + nfound], &r->at[hi], sizeof(int) * (r->n - hi));
+  if (nfound)
+    memcpy(&r->at[lo], found, sizeof(int) * nfound);
+  if (found != buf)
+    free(found);
+  r->n = n;
+  for (int j = lo + nfound; j < n; j++)
+    r->at[j] += len - del;
+  if (s->tree_ok)
+    editorFenwickAdd(s->tree, s->n, row->idx, n - old);
+}
+
+// Follow del rows at `at` being replaced with n rows, searching the new ones
+void editorSearchShift(int at, int del, int n) {
+  struct editorSearch *s = E.search;
+  if (!s)
+    return;
+  for (int y = at; y < at + del; y++)
+    free(s->rows[y].at);
+  if (n > del)
+    s->rows = realloc(s->rows, sizeof(struct editorSearchRow) * (s->n + n - del));
+  memmove(&s->rows[at + n], &s->rows[at + del],
+          sizeof(struct editorSearchRow) * (s->n - at - del));
+  memset(&s->rows[at], 0, sizeof(struct editorSearchRow) * n);
+  s->n += n - del;
+  for (int y = at; y < at + n; y++)
+    editorSearchScan(s, y);
+  s->tree_ok = 0;
+}
+
+// Tell which match the cursor is on, out of how many
+void editorSearchReport() {
+  struct editorSearch *s = E.search;
+  if (!s)
+    return;
+  editorSearchValidate(s);
+  int total = editorFenwickSum(s->tree, s->n);
+  if (total == 0) {
+    editorSetStatusMessage("Pattern not found: %s", s->query);
+    return;
+  }
+  if (E.cy >= s->n)
+    return;
+  struct editorSearchRow *r = &s->rows[E.cy];
+  int i = editorSearchBefore(r, E.cx);
+  if (i < r->n && r->at[i] == E.cx)
+    editorSetStatusMessage("match %d of %d", editorFenwickSum(s->tree, E.cy) + i + 1,
+                           total);
+}
+
+// Move the cursor to the first match after it (dir 1) or the last one
+// before it (dir -1), wrapping around the file, and tell which one it is
+int editorSearchJump(int dir) {
+  struct editorSearch *s = E.search;
+  if (!s) {
+    editorSetStatusMessage("No previous search");
+    editorMacroAbort();
+    return -1;
+  }
+  editorSearchValidate(s);
+  int total = editorFenwickSum(s->tree, s->n);
+  if (total == 0) {
+    editorSetStatusMessage("Pattern not found: %s", s->query);
+    editorMacroAbort();
+    return -1;
+  }
+
+  // Rank of the match to go to among all of them
+  int k;
+  if (E.cy >= s->n) {
+    k = dir > 0 ? 0 : total - 1;
+  } else {
+    struct editorSearchRow *r = &s->rows[E.cy];
+    int before = editorFenwickSum(s->tree, E.cy);
+    if (dir > 0) {
+      k = before + editorSearchBefore(r, E.cx + 1);
+      if (k == total)
+        k = 0;
+    } else {
+      k = before + editorSearchBefore(r, E.cx) - 1;
+      if (k < 0)
+        k = total - 1;
+    }
+  }
+
+  int rest = k;
+  int y = editorFenwickFind(s->tree, s->n, &rest);
+  E.cy = y;
+  E.cx = s->rows[y].at[rest];
+  s->highlight = 1;
+  editorSearchReport();
+  return 0;
+}
+
+// First match of row y drawn at or after render offset j, or -1
+int editorSearchFirst(erow *row, int j) {
+  struct editorSearch *s = E.search;
+  if (!s || !s->highlight || row->idx >= s->n || s->rows[row->idx].n == 0)
+    return -1;
+  struct editorSearchRow *r = &s->rows[row->idx];
+  // Matches ending before j are not drawn
+  int i = editorSearchBefore(r, editorRowRenderToCx(row, j) - s->m.len + 1);
+  return i < r->n ? i : -1;
+}
+
+// Render offsets of match i of a row in *from and *to. Returns i, or -1
+// past the last match
+int editorSearchRender(erow *row, int i, int *from, int *to) {
+  struct editorSearch *s = E.search;
+  if (i == -1 || i >= s->rows[row->idx].n)
+    return -1;
+  int at = s->rows[row->idx].at[i];
+  *from = editorRowCxToRender(row, at);
+  *to = editorRowCxToRender(row, at + s->m.len);
+  return i;
+}
+
+// Callback for find
+void editorFindCallback(char *query, int key) {
+  // Where the cursor was when the search started, -1 between searches
+  static int origin_y = -1;
+  static int origin_x;
+
+  if (key == '\r' || key == '\x1b') {
+    if (key == '\x1b')
+      editorSearchFree();
+    else
+      editorSearchReport();
+    origin_y = -1;
+    return;
+  }
+  if (origin_y == -1) {
+    origin_y = E.cy;
+    origin_x = E.cx;
+  }
+  if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    editorSearchJump(1);
+  } else if (key == ARROW_LEFT || key == ARROW_UP) {
+    editorSearchJump(-1);
+  } else {
+    // The query changed, look for its first match from where the search
+    // started
+    editorSearchStart(query);
+    E.cy = origin_y;
+    E.cx = origin_x;
+    if (E.search && editorSearchJump(1) == 0)
+      E.rowoff = E.numrows;
+  }
+}
+
+// Find in text
+void editorFind() {
+  // Save cursor position
+  int saved_cx = E.cx;
+  int saved_cy = E.cy;
+  int saved_coloff = E.coloff;
+  int saved_rowoff = E.rowoff;
+  int saved_lineoff = E.lineoff;
+
+  char *query =
+      editorPrompt("Search: %s (Use ESC/Arrow/Enter)", editorFindCallback);
+  if (query) {
+    free(query);
+  } else {
+    // Restore cursor position
+    E.cx = saved_cx;
+    E.cy = saved_cy;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
+    E.lineoff = saved_lineoff;
+  }
+}
+
+/* Multiple Cursors */
+
+// Order cursors by row, then column
+int editorCursorCmp(const void *a, const void *b) {
+  const struct editorCursor *ca = a, *cb = b;
+  if (ca->y != cb->y)
+    return ca->y < cb->y ? -1 : 1;
+  return (ca->x > cb->x) - (ca->x < cb->x);
+}
+
+// Keep the extra cursors in the buffer and in order, dropping those that
+// met another cursor or the main one
+void editorCursorsMerge() {
+  struct editorCursors *cs = &E.cursors;
+  for (int j = 0; j < cs->n; j++) {
+    struct editorCursor *c = &cs->c[j];
+    if (c->y >= E.numrows)
+      c->y = E.numrows > 0 ? E.numrows - 1 : 0;
+    int size = c->y < E.numrows ? E.row[c->y].size : 0;
+    if (c->x > size)
+      c->x = size;
+  }
+  if (cs->n == 0)
+    return;
+  qsort(cs->c, cs->n, sizeof(struct editorCursor), editorCursorCmp);
+  int kept = 0;
+  for (int j = 0; j < cs->n; j++) {
+    struct editorCursor c = cs->c[j];
+    if ((c.y == E.cy && c.x == E.cx) ||
+        (kept > 0 && editorCursorCmp(&c, &cs->c[kept - 1]) == 0))
+      continue;
+    cs->c[kept++] = c;
+  }
+  cs->n = kept;
+}
+
+// Drop the extra cursors
+void editorCursorsClear() {
+  E.cursors.n = 0;
+}
+
+// Add an extra cursor at x of row y
+void editorCursorsAdd(int y, int x) {
+  struct editorCursors *cs = &E.cursors;
+  if (cs->n == cs->cap) {
+    cs->cap = cs->cap ? cs->cap * 2 : 8;
+    cs->c = realloc(cs->c, sizeof(struct editorCursor) * cs->cap);
+  }
+  cs->c[cs->n++] = (struct editorCursor){x, y};
+  editorCursorsMerge();
+  editorSetStatusMessage("%d cursors", cs->n + 1);
+}
+
+// Add a cursor on the row below the lowest cursor, in the screen column of
+// the main one
+void editorCursorsAddBelow() {
+  struct editorCursors *cs = &E.cursors;
+  int y = E.cy;
+  if (cs->n && cs->c[cs->n - 1].y > y)
+    y = cs->c[cs->n - 1].y;
+  y = editorNextVisible(y, 1);
+  if (E.cy >= E.numrows || y >= E.numrows)
+    return;
+  int rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+  editorCursorsAdd(y, editorRowRxToCx(&E.row[y], rx));
+}
+
+// Add a cursor on the next match of the word under the main cursor, going
+// on after the match added last and around the end of the file
+void editorCursorsAddNext() {
+  struct editorCursors *cs = &E.cursors;
+  if (E.cy >= E.numrows)
+    return;
+  erow *row = &E.row[E.cy];
+  const char *s = editorRowChars(row);
+  int w0 = E.cx, w1 = E.cx;
+  while (w0 > 0 && editorIsWordChar(s[w0 - 1]))
+    w0--;
+  while (w1 < row->size && editorIsWordChar(s[w1]))
+    w1++;
+  if (w0 == w1) {
+    editorSetStatusMessage("No word under the cursor");
+    return;
+  }
+  int len = w1 - w0;
+  char *word = malloc(len);
+  memcpy(word, &s[w0], len);
+  struct editorMatcher m;
+  editorMatcherInit(&m, word, len);
+
+  int y = cs->n ? cs->next_y : E.cy;
+  int from = cs->n ? cs->next_x : w1;
+  int wrapped = 0; // Back on the word under the main cursor
+  for (int k = 0; k <= E.numrows && !wrapped; k++) {
+    if (y >= E.numrows)
+      y = 0;
+    const char *t = editorRowChars(&E.row[y]);
+    int tlen = E.row[y].size;
+    for (int at = from; (at = editorMatcherFind(&m, t, tlen, at)) != -1;
+         at++) {
+      if ((at > 0 && editorIsWordChar(t[at - 1])) ||
+          (at + len < tlen && editorIsWordChar(t[at + len])))
+        continue;
+      if (y == E.cy && at == w0) {
+        wrapped = 1;
+        break;
+      }
+      cs->next_y = y;
+      cs->next_x = at + len;
+      editorCursorsAdd(y, at + E.cx - w0);
+      free(word);
+      return;
+    }
+    y++;
+    from = 0;
+  }
+  free(word);
+  editorSetStatusMessage("No more matches");
+}
+
+// Index of the first extra cursor on row y or after it
+int editorCursorsFirst(int y) {
+  struct editorCursors *cs = &E.cursors;
+  int lo = 0, hi = cs->n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (cs->c[mid].y < y)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Render offset of extra cursor j if it is on row, -1 otherwise
+int editorCursorsRender(erow *row, int j) {
+  struct editorCursors *cs = &E.cursors;
+  if (j >= cs->n || cs->c[j].y != row->idx)
+    return -1;
+  return editorRowCxToRender(row, cs->c[j].x);
+}
+
+// Move the cursor for a movement key all cursors follow
+void editorCursorMove(int c) {
+  switch (c) {
+  case '0':
+  case HOME_KEY:
+    E.cx = 0;
+    break;
+  case '$':
+  case END_KEY:
+    if (E.cy < E.numrows)
+      E.cx = E.row[E.cy].size;
+    break;
+  default:
+    editorMoveCursor(c);
+  }
+}
+
+// Make every extra cursor follow a movement key
+void editorCursorsMove(int c) {
+  struct editorCursors *cs = &E.cursors;
+  int cx = E.cx, cy = E.cy;
+  for (int j = 0; j < cs->n; j++) {
+    E.cx = cs->c[j].x;
+    E.cy = cs->c[j].y;
+    editorCursorMove(c);
+    cs->c[j].x = E.cx;
+    cs->c[j].y = E.cy;
+  }
+  E.cx = cx;
+  E.cy = cy;
+  editorCursorsMerge();
+}
+
+// All cursors, the main one included, in order. *main is its index
+struct editorCursor *editorCursorsAll(int *main) {
+  struct editorCursors *cs = &E.cursors;
+  struct editorCursor *all = malloc(sizeof(struct editorCursor) * (cs->n + 1));
+  struct editorCursor me = {E.cx, E.cy};
+  *main = editorCursorsFirst(E.cy);
+  while (*main < cs->n && editorCursorCmp(&cs->c[*main], &me) < 0)
+    (*main)++;
+  memcpy(all, cs->c, sizeof(struct editorCursor) * *main);
+  all[*main] = me;
+  memcpy(&all[*main + 1], &cs->c[*main],
+         sizeof(struct editorCursor) * (cs->n - *main));
+  return all;
+}
+
+// Take the cursors back from editorCursorsAll
+void editorCursorsSetAll(struct editorCursor *all, int main) {
+  struct editorCursors *cs = &E.cursors;
+  E.cx = all[main].x;
+  E.cy = all[main].y;
+  memcpy(cs->c, all, sizeof(struct editorCursor) * main);
+  memcpy(&cs->c[main], &all[main + 1],
+         sizeof(struct editorCursor) * (cs->n - main));
+  free(all);
+  editorCursorsMerge();
+}
+
+// Apply a keystroke's edit at every cursor at once: the char before (dir
+// -1) or after (dir 1) each cursor is deleted, or with dir 0 the len chars
+// of s are inserted. The cursors of a row are edited as one replace of the
+// span they cover, so each row is patched, journaled and highlighted once
+// however many cursors it has. Deleting never joins rows
+void editorCursorsEdit(int dir, const char *s, int len) {
+  editorCursorsMerge();
+  int main;
+  struct editorCursor *all = editorCursorsAll(&main);
+  int n = E.cursors.n + 1;
+  if (dir == 0 && all[n - 1].y == E.numrows)
+    editorInsertRow(E.numrows, "", 0);
+
+  char *buf = NULL;
+  int cap = 0;
+  for (int i = 0, j; i < n; i = j) {
+    erow *row = editorRowResident(&E.row[all[i].y]);
+    // Cursors i to j are on the row, their edits span [from, to)
+    int from = -1, to = 0, blen = 0;
+    for (j = i; j < n && all[j].y == all[i].y; j++) {
+      int x = all[j].x;
+      int a = (dir < 0 && x > 0) ? editorRowPrevCx(row, x) : x;
+      int b = (dir > 0 && x < row->size) ? editorRowNextCx(row, x) : x;
+      if (a < to)
+        a = to;
+      if (b < a)
+        b = a;
+      if (from == -1)
+        from = to = a;
+      if (blen + (a - to) + len >= cap) {
+        cap = (blen + (a - to) + len) * 2 + 16;
+        buf = realloc(buf, cap);
+      }
+      memcpy(&buf[blen], &row->chars[to], a - to);
+      blen += a - to;
+      if (len)
+        memcpy(&buf[blen], s, len);
+      blen += len;
+      all[j].x = from + blen;
+      to = b;
+    }
+    if (to > from || blen > 0)
+      editorRowReplace(row, from, to - from, buf, blen);
+  }
+  free(buf);
+  editorCursorsSetAll(all, main);
+}
+
+// Split the row at every cursor. Going from the last cursor back, the rows
+// of the cursors before it are still where they were
+void editorCursorsNewline() {
+  editorCursorsMerge();
+  int main;
+  struct editorCursor *all = editorCursorsAll(&main);
+  int n = E.cursors.n + 1;
+  for (int i = n - 1; i >= 0; i--) {
+    E.cy = all[i].y;
+    E.cx = all[i].x;
+    editorInsertNewline();
+  }
+  // Each split before a cursor added a row above it
+  for (int i = 0; i < n; i++) {
+    all[i].y += i + 1;
+    all[i].x = 0;
+  }
+  editorCursorsSetAll(all, main);
+}
+
+// Run a normal mode key at the extra cursors: they follow movement keys
+// and take part in x and in entering insert mode, any other key drops
+// them. Returns 1 if the key was fully handled
+int editorCursorsNormalKey(int c) {
+  switch (c) {
+  case ARROW_LEFT:
+  case ARROW_DOWN:
+  case ARROW_UP:
+  case ARROW_RIGHT:
+  case 'h':
+  case 'j':
+  case 'k':
+  case 'l':
+  case '0':
+  case '$':
+  case HOME_KEY:
+  case END_KEY:
+    editorCursorsMove(c);
+    return 0;
+  case ' ':
+  case BACKSPACE:
+  case CTRL_KEY('h'):
+    editorCursorsMove(ARROW_LEFT);
+    return 0;
+  case DEL_KEY:
+  case 'a':
+    editorCursorsMove(ARROW_RIGHT);
+    return 0;
+  case '\r':
+    editorCursorsMove(ARROW_DOWN);
+    return 0;
+  case 'I':
+    editorCursorsMove('0');
+    return 0;
+  case 'A':
+    editorCursorsMove('$');
+    return 0;
+  case 'x':
+    editorCursorsEdit(1, NULL, 0);
+    return 1;
+  case 'i':
+  case CTRL_KEY('n'):
+  case CTRL_KEY('j'):
+    return 0;
+  default:
+    editorCursorsClear();
+    return 0;
+  }
+}
+
+// Run an insert mode key at every cursor. Returns 1 if the key was fully
+// handled
+int editorCursorsInsertKey(int c) {
+  switch (c) {
+  case '\r':
+    editorCursorsNewline();
+    return 1;
+  case BACKSPACE:
+  case CTRL_KEY('h'):
+    editorCursorsEdit(-1, NULL, 0);
+    return 1;
+  case DEL_KEY:
+    editorCursorsEdit(1, NULL, 0);
+    return 1;
+  case ARROW_LEFT:
+  case ARROW_DOWN:
+  case ARROW_UP:
+  case ARROW_RIGHT:
+  case HOME_KEY:
+  case END_KEY:
+    editorCursorsMove(c);
+    return 0;
+  case CTRL_KEY('l'):
+  case '\x1b':
+    return 0;
+  case PAGE_UP:
+  case PAGE_DOWN:
+  case CTRL_KEY('n'):
+  case CTRL_KEY('p'):
+    editorCursorsClear();
+    return 0;
+  default: {
+    char ch = c;
+    editorCursorsEdit(0, &ch, 1);
+    return 1;
+  }
+  }
+}
+
+/* Append Buffer */
+
+// Dynamic string
+struct abuf {
+  char *b;
+  size_t len;
+};
+
+// Empty abuf
+#define ABUF_INIT                                                              \
+  { NULL, 0 }
+
+// Append to dynamic string
+void abAppend(struct abuf *ab, const char *s, size_t len) {
+  // realloc to zero bytes would free the buffer
+  if (len == 0)
+    return;
+  // Allocate memory for new string
+  char *new = realloc(ab->b, ab->len + len);
+
+  if (new == NULL)
+    return;
+  // Append string into buffer
+  memcpy(&new[ab->len], s, len);
+  // Update buffer
+  ab->b = new;
+  ab->len += len;
+}
+
+void abFree(struct abuf *ab) { free(ab->b); }
+
+/* Substitute */
+
+// Parse a line address at *p into a row index, returns 0 if there is none
+int editorParseAddress(char **p, int *y) {
+  if (isdigit((unsigned char)**p)) {
+    *y = strtol(*p, p, 10) - 1;
+  } else if (**p == '.') {
+    *y = E.cy;
+    (*p)++;
+  } else if (**p == '$') {
+    *y = E.numrows - 1;
+    (*p)++;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+// Parse an optional range of rows (%, N, N,M with . and $), the current
+// row when absent; returns -1 on an invalid range
+int editorParseRange(char **p, int *y0, int *y1) {
+  *y0 = *y1 = E.cy;
+  if (**p == '%') {
+    (*p)++;
+    *y0 = 0;
+    *y1 = E.numrows - 1;
+  } else if (editorParseAddress(p, y0)) {
+    *y1 = *y0;
+    if (**p == ',') {
+      (*p)++;
+      if (!editorParseAddress(p, y1))
+        return -1;
+    }
+  }
+  if (*y1 >= E.numrows)
+    *y1 = E.numrows - 1;
+  if (*y0 < 0 || *y0 > *y1)
+    return -1;
+  return 0;
+}
+
+// Copy a s/// field up to the unescaped delimiter, unescaping it. If amps
+// is given it gets a flag per char of the field, set on each unescaped &
+char *editorSubstField(char **p, char delim, int *len, char **amps) {
+  char *out = malloc(strlen(*p) + 1);
+  char *amp = amps ? calloc(strlen(*p) + 1, 1) : NULL;
+  *len = 0;
+  while (**p && **p != delim) {
+    if (**p == '\\' && ((*p)[1] == delim || (*p)[1] == '\\' ||
+                         (*p)[1] == '&'))
+      (*p)++;
+    else if (amp && **p == '&')
+      amp[*len] = 1;
+    out[(*len)++] = *(*p)++;
+  }
+  if (**p == delim)
+    (*p)++;
+  out[*len] = '\0';
+  if (amps)
+    *amps = amp;
+  return out;
+}
+
+// :[range]s/pat/rep/[g] with a literal pattern; & in rep is the match.
+// Scans every row once, builds the rewritten rows in a scratch buffer and
+// re-highlights only the rows that changed
+void editorSubstitute(int y0, int y1, char *args) {
+  char delim = *args++;
+  int patlen, replen;
+  char *amp; // The & of rep that stand for the match
+  char *pat = editorSubstField(&args, delim, &patlen, NULL);
+  char *rep = editorSubstField(&args, delim, &replen, &amp);
+  int global = strchr(args, 'g') != NULL;
+
+  if (patlen == 0) {
+    editorSetStatusMessage("Empty pattern");
+    free(pat);
+    free(rep);
+    free(amp);
+    return;
+  }
+
+  struct editorMatcher m;
+  editorMatcherInit(&m, pat, patlen);
+
+  struct abuf ab = ABUF_INIT;
+  int count = 0, lines = 0, last = -1, too_long = 0;
+  int cascade = -1; // Row whose highlight must follow a comment change
+  for (int y = y0; y <= y1; y++) {
+    erow *row = &E.row[y];
+    int at = editorMatcherFind(&m, editorRowChars(row), row->size, 0);
+    if (at == -1) {
+      if (cascade == y) {
+        editorUpdateSyntax(row);
+        cascade = -1;
+      }
+      continue;
+    }
+
+    // Highlighted below, along with any pending cascade
+    if (row->chars == NULL)
+      editorRowThaw(row);
+    ab.len = 0;
+    int from = 0, before = count;
+    while (at != -1) {
+      abAppend(&ab, &row->chars[from], at - from);
+      for (int j = 0; j < replen; j++) {
+        if (amp[j])
+          abAppend(&ab, &row->chars[at], patlen);
+        else
+          abAppend(&ab, &rep[j], 1);
+      }
+      from = at + patlen;
+      count++;
+      at = global ? editorMatcherFind(&m, row->chars, row->size, from) : -1;
+    }
+    abAppend(&ab, &row->chars[from], row->size - from);
+    // Rows that would get too long are left as they are
+    if (ab.len > HELIS_MAX_ROW) {
+      count = before;
+      too_long++;
+      if (cascade == y) {
+        editorUpdateSyntax(row);
+        cascade = -1;
+      }
+      continue;
+    }
+
+    // Swap in the new chars, journaling them as one row edit
+    journalEdit(y, 0, row->size, ab.b, ab.len);
+    editorWordsScan(row->chars, row->size, -1);
+    editorRowDropChars(row);
+    row->chars = malloc(ab.len + 1);
+    if (ab.len)
+      memcpy(row->chars, ab.b, ab.len);
+    row->chars[ab.len] = '\0';
+    row->size = ab.len;
+    editorWordsScan(row->chars, row->size, 1);
+    editorSearchUpdate(row);
+    editorRenderRow(row);
+    cascade = editorHighlightRow(row) ? y + 1 : -1;
+    E.dirty++;
+    lines++;
+    last = y;
+  }
+  if (cascade != -1 && cascade < E.numrows)
+    editorUpdateSyntax(&E.row[cascade]);
+  abFree(&ab);
+
+  if (count) {
+    E.cy = last;
+    E.cx = 0;
+    if (too_long)
+      editorSetStatusMessage("%d substitutions on %d lines, %d lines too long",
+                             count, lines, too_long);
+    else
+      editorSetStatusMessage("%d substitutions on %d lines", count, lines);
+  } else if (too_long) {
+    editorSetStatusMessage("Line too long");
+  } else {
+    editorSetStatusMessage("Pattern not found: %s", pat);
+  }
+  free(pat);
+  free(rep);
+  free(amp);
+}
+
+/* Filter */
+
+// Lines read back from a filter, and the start of the next one
+struct editorFilterOut {
+  char **lines;
+  size_t *lens;
+  int n, cap;
+  struct abuf part;
+};
+
+// Add a line read back from a filter, without its CR if it has one
+void editorFilterPush(struct editorFilterOut *o, const char *s, size_t len) {
+  while (len > 0 && s[len - 1] == '\r')
+    len--;
+  if (o->n == o->cap) {
+    o->cap = o->cap ? o->cap * 2 : 256;
+    o->lines = realloc(o->lines, sizeof(char *) * o->cap);
+    o->lens = realloc(o->lens, sizeof(size_t) * o->cap);
+  }
+  o->lines[o->n] = malloc(len + 1);
+  if (len)
+    memcpy(o->lines[o->n], s, len);
+  o->lens[o->n++] = len;
+}
+
+// Split bytes read back from a filter into lines. Lines that came whole
+// are copied straight from s, a line cut by the read waits in part
+void editorFilterLines(struct editorFilterOut *o, const char *s, size_t len) {
+  while (len > 0) {
+    const char *nl = memchr(s, '\n', len);
+    size_t n = nl ? (size_t)(nl - s) : len;
+    if (!nl) {
+      abAppend(&o->part, s, n);
+      return;
+    }
+    if (o->part.len) {
+      abAppend(&o->part, s, n);
+      editorFilterPush(o, o->part.b, o->part.len);
+      o->part.len = 0;
+    } else {
+      editorFilterPush(o, s, n);
+    }
+    s += n + 1;
+    len -= n + 1;
+  }
+}
+
+// Fill buf with rows up to y1, from *off of row *y on, each followed by a
+// newline; returns the bytes filled, 0 once all rows are in
+size_t editorFilterFill(char *buf, size_t cap, int *y, size_t *off, int y1) {
+  size_t len = 0;
+  while (len < cap && *y <= y1) {
+    erow *row = &E.row[*y];
+    size_t size = row->size;
+    if (*off < size) {
+      size_t n = size - *off < cap - len ? size - *off : cap - len;
+      memcpy(&buf[len], editorRowChars(row) + *off, n);
+      len += n;
+      *off += n;
+    } else {
+      buf[len++] = '\n';
+      (*y)++;
+      *off = 0;
+    }
+  }
+  return len;
+}
+
+// :[range]!cmd, replacing the rows of the range with what cmd prints when
+// given them. Rows are streamed to cmd while its output is read back, so
+// neither side waits on the other, and the output lands as one bulk
+// replace. The rows stay as they were if cmd fails; Ctrl-C stops it
+void editorFilter(int y0, int y1, char *cmd) {
+  while (*cmd == ' ')
+    cmd++;
+  if (*cmd == '\0') {
+    editorSetStatusMessage("No command");
+    return;
+  }
+  int in[2], out[2], err[2];
+  if (pipe2(in, O_CLOEXEC) == -1) {
+    editorSetStatusMessage("Can't run %s: %s", cmd, strerror(errno));
+    return;
+  }
+  if (pipe2(out, O_CLOEXEC) == -1) {
+    close(in[0]);
+    close(in[1]);
+    editorSetStatusMessage("Can't run %s: %s", cmd, strerror(errno));
+    return;
+  }
+  if (pipe2(err, O_CLOEXEC) == -1) {
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    editorSetStatusMessage("Can't run %s: %s", cmd, strerror(errno));
+    return;
+  }
+  // Spawned rather than forked, which would copy the page tables of
+  // the whole buffer
+  posix_spawn_file_actions_t fa;
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_adddup2(&fa, in[0], STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&fa, out[1], STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&fa, err[1], STDERR_FILENO);
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t sigs;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attr, &sigs);
+  // In a group of its own, to stop the whole pipeline of cmd at once
+  posix_spawnattr_setpgroup(&attr, 0);
+  posix_spawnattr_setflags(&attr,
+                           POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+  char *argv[] = {"sh", "-c", cmd, NULL};
+  pid_t pid;
+  int e = posix_spawn(&pid, "/bin/sh", &fa, &attr, argv, environ);
+  posix_spawn_file_actions_destroy(&fa);
+  posix_spawnattr_destroy(&attr);
+  close(in[0]);
+  close(out[1]);
+  close(err[1]);
+  if (e != 0) {
+    close(in[1]);
+    close(out[0]);
+    close(err[0]);
+    editorSetStatusMessage("Can't run %s: %s", cmd, strerror(e));
+    return;
+  }
+  fcntl(in[1], F_SETFL, O_NONBLOCK);
+  fcntl(out[0], F_SETFL, O_NONBLOCK);
+  fcntl(err[0], F_SETFL, O_NONBLOCK);
+  // A cmd that stops reading early makes writes fail instead
+  void (*old_pipe)(int) = signal(SIGPIPE, SIG_IGN);
+
+  // Rows on their way to cmd, and its output on the way back
+  char *buf = malloc(HELIS_FILTER_BUF);
+  char *rbuf = malloc(HELIS_FILTER_BUF);
+  size_t blen = 0, bpos = 0;
+  int y = y0;
+  size_t off = 0;
+  struct editorFilterOut o = {NULL, NULL, 0, 0, ABUF_INIT};
+  char msg[80]; // Start of what cmd said on stderr
+  size_t msglen = 0;
+  int to = in[1], from = out[0], efd = err[0];
+  int interrupted = 0;
+  while (from != -1 || efd != -1) {
+    // Keys typed meanwhile are kept for later, unless the buffer is full
+    int keys = E.inpos > 0 || E.inlen < HELIS_INPUT_BUF;
+    struct pollfd fds[4] = {{to, POLLOUT, 0},
+                            {from, POLLIN, 0},
+                            {efd, POLLIN, 0},
+                            {keys ? STDIN_FILENO : -1, POLLIN, 0}};
+    if (poll(fds, 4, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (fds[0].revents) {
+      if (bpos == blen) {
+        blen = editorFilterFill(buf, HELIS_FILTER_BUF, &y, &off, y1);
+        bpos = 0;
+      }
+      ssize_t n = blen ? write(to, &buf[bpos], blen - bpos) : 0;
+      if (n > 0) {
+        bpos += n;
+      } else if (blen == 0 || (errno != EAGAIN && errno != EINTR)) {
+        // All rows are in, or cmd is done reading
+        close(to);
+        to = -1;
+      }
+    }
+    if (fds[1].revents) {
+      ssize_t n = read(from, rbuf, HELIS_FILTER_BUF);
+      if (n > 0) {
+        editorFilterLines(&o, rbuf, n);
+      } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        close(from);
+        from = -1;
+      }
+    }
+    if (fds[2].revents) {
+      char ebuf[256];
+      ssize_t n = read(efd, ebuf, sizeof(ebuf));
+      if (n > 0) {
+        size_t keep = sizeof(msg) - 1 - msglen;
+        if ((size_t)n < keep)
+          keep = n;
+        memcpy(&msg[msglen], ebuf, keep);
+        msglen += keep;
+      } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        close(efd);
+        efd = -1;
+      }
+    }
+    if (fds[3].revents)
+      editorFillInput(0);
+    // Ctrl-C is taken, the keys after it are left for later. A server
+    // client going away stops cmd as well
+    char *intr = memchr(&E.inbuf[E.inpos], CTRL_KEY('c'), E.inlen - E.inpos);
+    if (intr || Srv.gone) {
+      if (intr)
+        E.inpos = intr - E.inbuf + 1;
+      kill(-pid, SIGTERM);
+      interrupted = 1;
+      break;
+    }
+  }
+  if (to != -1)
+    close(to);
+  if (from != -1)
+    close(from);
+  if (efd != -1)
+    close(efd);
+  free(buf);
+  free(rbuf);
+  if (o.part.len)
+    editorFilterPush(&o, o.part.b, o.part.len);
+  abFree(&o.part);
+  int status = 0;
+  while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+    ;
+  signal(SIGPIPE, old_pipe);
+
+  msg[msglen] = '\0';
+  msg[strcspn(msg, "\n")] = '\0';
+  if (interrupted) {
+    editorSetStatusMessage("Interrupted");
+  } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    editorSetStatusMessage("%s failed%s%s", cmd, msglen ? ": " : "", msg);
+  } else if (editorReplaceRows(y0, y1 - y0 + 1, o.lines, o.lens, o.n) == 0) {
+    E.cy = y0 < E.numrows ? y0 : E.numrows;
+    E.cx = 0;
+    editorSetStatusMessage("%d lines filtered into %d", y1 - y0 + 1, o.n);
+  }
+  for (int j = 0; j < o.n; j++)
+    free(o.lines[j]);
+  free(o.lines);
+  free(o.lens);
+}
+
+/* File Finder */
+
+// Load the rules of the .gitignore at path, NULL if it can't be read
+struct editorIgnore *editorIgnoreLoad(const char *path, struct stat *st) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return NULL;
+  struct editorIgnore *ig = calloc(1, sizeof(struct editorIgnore));
+  ig->baselen = strlen(path) - strlen(".gitignore");
+  ig->mtime = st->st_mtim;
+
+  int cap = 0;
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &linecap, fp)) != -1) {
+    while (len > 0 && isspace((unsigned char)line[len - 1]))
+      len--;
+    line[len] = '\0';
+    char *p = line;
+    int flags = 0;
+    if (*p == '\0' || *p == '#')
+      continue;
+    if (*p == '!') {
+      flags |= IGNORE_NEGATE;
+      p++;
+    }
+    // Escaped leading ! or #
+    if (*p == '\\')
+      p++;
+    if (line[len - 1] == '/') {
+      flags |= IGNORE_DIR;
+      line[--len] = '\0';
+    }
+    // A leading **/ matches in any directory, like no slash at all
+    while (strncmp(p, "**/", 3) == 0)
+      p += 3;
+    if (strchr(p, '/')) {
+      flags |= IGNORE_ANCHORED;
+      if (*p == '/')
+        p++;
+    }
+    if (*p == '\0')
+      continue;
+
+    if (ig->n == cap) {
+      cap = cap ? cap * 2 : 16;
+      ig->patterns = realloc(ig->patterns, sizeof(char *) * cap);
+      ig->flags = realloc(ig->flags, sizeof(int) * cap);
+    }
+    ig->patterns[ig->n] = strdup(p);
+    ig->flags[ig->n] = flags;
+    ig->n++;
+  }
+  free(line);
+  fclose(fp);
+  return ig;
+}
+
+// Free the rules of a .gitignore
+void editorIgnoreFree(struct editorIgnore *ig) {
+  if (ig == NULL)
+    return;
+  for (int j = 0; j < ig->n; j++)
+    free(ig->patterns[j]);
+  free(ig->patterns);
+  free(ig->flags);
+  free(ig);
+}
+
+// Whether the rules of chain exclude path, name being its last component;
+// the deepest .gitignore and the last matching rule in it decide. The
+// .git directory and swap files are always left out
+int editorIgnored(struct editorIgnore *chain, const char *path,
+                  const char *name, int isdir) {
+  int len = strlen(name);
+  if (strcmp(name, ".git") == 0 ||
+      (len > 5 && strcmp(&name[len - 5], ".hswp") == 0))
+    return 1;
+  for (struct editorIgnore *ig = chain; ig; ig = ig->parent) {
+    for (int j = ig->n - 1; j >= 0; j--) {
+      int flags = ig->flags[j];
+      if ((flags & IGNORE_DIR) && !isdir)
+        continue;
+      int m = (flags & IGNORE_ANCHORED)
+                  ? fnmatch(ig->patterns[j], path + ig->baselen, FNM_PATHNAME)
+                  : fnmatch(ig->patterns[j], name, 0);
+      if (m == 0)
+        return !(flags & IGNORE_NEGATE);
+    }
+  }
+  return 0;
+}
+
+// Hand paths dropped from the index to the main thread, which frees them
+// once the candidates it matches against stop pointing at them
+void editorFinderDiscard(struct editorFinder *f, char **paths, int n) {
+  pthread_mutex_lock(&f->lock);
+  if (f->ngarbage + n > f->capgarbage) {
+    f->capgarbage = (f->ngarbage + n) * 2;
+    f->garbage = realloc(f->garbage, sizeof(char *) * f->capgarbage);
+  }
+  memcpy(&f->garbage[f->ngarbage], paths, sizeof(char *) * n);
+  f->ngarbage += n;
+  pthread_mutex_unlock(&f->lock);
+}
+
+// Free a directory dropped from the index with everything below it
+void editorDirFree(struct editorFinder *f, struct editorDir *d) {
+  editorFinderDiscard(f, d->files, d->nfiles);
+  free(d->files);
+  for (int j = 0; j < d->ndirs; j++)
+    editorDirFree(f, d->dirs[j]);
+  free(d->dirs);
+  editorIgnoreFree(d->ignore);
+  free(d->path);
+  free(d);
+}
+
+// Order of directories by path
+int editorDirCmp(const void *a, const void *b) {
+  return strcmp((*(struct editorDir **)a)->path,
+                (*(struct editorDir **)b)->path);
+}
+
+// Queue a directory for the walker threads
+void editorWalkPush(struct editorFinder *f, struct editorDir *d,
+                    struct editorIgnore *chain, int force) {
+  pthread_mutex_lock(&f->qlock);
+  if (f->njobs == f->capjobs) {
+    f->capjobs = f->capjobs ? f->capjobs * 2 : 64;
+    f->jobs = realloc(f->jobs, sizeof(struct editorWalkJob) * f->capjobs);
+  }
+  f->jobs[f->njobs++] = (struct editorWalkJob){d, chain, force};
+  pthread_cond_signal(&f->qcond);
+  pthread_mutex_unlock(&f->qlock);
+}
+
+// Join a directory path ("" for the working directory) and a name
+char *editorJoinPath(const char *dir, const char *name) {
+  int dlen = strlen(dir), nlen = strlen(name);
+  int sep = dlen && dir[dlen - 1] != '/';
+  char *path = malloc(dlen + sep + nlen + 1);
+  memcpy(path, dir, dlen);
+  path[dlen] = '/';
+  memcpy(&path[dlen + sep], name, nlen + 1);
+  return path;
+}
+
+// Paths of the entries of directory dir that chain doesn't exclude, split
+// into files and subdirectories
+void editorListDir(const char *dir, struct editorIgnore *chain,
+                   char ***files, int *nfiles, char ***dirs, int *ndirs) {
+  int capfiles = 0, capdirs = 0;
+  *files = *dirs = NULL;
+  *nfiles = *ndirs = 0;
+
+  DIR *dp = opendir(dir[0] ? dir : ".");
+  if (dp == NULL)
+    return;
+  struct dirent *de;
+  while ((de = readdir(dp)) != NULL) {
+    const char *name = de->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+      continue;
+    char *path = editorJoinPath(dir, name);
+
+    // Symlinks to directories are listed as files, so walks can't loop
+    int isdir = de->d_type == DT_DIR;
+    if (de->d_type == DT_UNKNOWN) {
+      struct stat st;
+      isdir = lstat(path, &st) == 0 && S_ISDIR(st.st_mode);
+    }
+    if (editorIgnored(chain, path, name, isdir)) {
+      free(path);
+    } else if (isdir) {
+      if (*ndirs == capdirs) {
+        capdirs = capdirs ? capdirs * 2 : 8;
+        *dirs = realloc(*dirs, sizeof(char *) * capdirs);
+      }
+      (*dirs)[(*ndirs)++] = path;
+    } else {
+      if (*nfiles == capfiles) {
+        capfiles = capfiles ? capfiles * 2 : 16;
+        *files = realloc(*files, sizeof(char *) * capfiles);
+      }
+      (*files)[(*nfiles)++] = path;
+    }
+  }
+  closedir(dp);
+}
+
+// Read the entries of a directory, keeping the nodes of subdirectories
+// that were already in the index
+void editorDirRead(struct editorFinder *f, struct editorDir *d,
+                   struct editorIgnore *chain) {
+  char **files, **paths;
+  int nfiles, ndirs;
+  editorListDir(d->path, chain, &files, &nfiles, &paths, &ndirs);
+  struct editorDir **dirs = malloc(sizeof(struct editorDir *) * (ndirs + 1));
+  for (int j = 0; j < ndirs; j++) {
+    dirs[j] = calloc(1, sizeof(struct editorDir));
+    dirs[j]->path = paths[j];
+  }
+  free(paths);
+
+  // Subdirectories already indexed keep their nodes, so that only the
+  // ones that changed are read again
+  char *kept = calloc(d->ndirs + 1, 1);
+  for (int j = 0; j < ndirs; j++) {
+    struct editorDir **old =
+        d->ndirs ? bsearch(&dirs[j], d->dirs, d->ndirs,
+                           sizeof(struct editorDir *), editorDirCmp)
+                 : NULL;
+    if (old) {
+      free(dirs[j]->path);
+      free(dirs[j]);
+      dirs[j] = *old;
+      kept[old - d->dirs] = 1;
+    }
+  }
+  for (int j = 0; j < d->ndirs; j++)
+    if (!kept[j])
+      editorDirFree(f, d->dirs[j]);
+  free(kept);
+  free(d->dirs);
+  if (ndirs)
+    qsort(dirs, ndirs, sizeof(struct editorDir *), editorDirCmp);
+  d->dirs = dirs;
+  d->ndirs = ndirs;
+
+  editorFinderDiscard(f, d->files, d->nfiles);
+  free(d->files);
+  d->files = files;
+  d->nfiles = nfiles;
+}
+
+// Same modification time
+int editorSameMtime(struct timespec *a, struct timespec *b) {
+  return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+// Bring one directory of the index up to date and queue its subdirectories
+void editorWalkDir(struct editorFinder *f, struct editorWalkJob *job) {
+  struct editorDir *d = job->dir;
+  int plen = strlen(d->path);
+  int force = job->force;
+  struct stat st;
+
+  // Changed rules can hide or reveal anything below the directory
+  char *gitignore = editorJoinPath(d->path, ".gitignore");
+  if (stat(gitignore, &st) == 0 && S_ISREG(st.st_mode)) {
+    if (d->ignore == NULL || !editorSameMtime(&d->ignore->mtime, &st.st_mtim)) {
+      editorIgnoreFree(d->ignore);
+      d->ignore = editorIgnoreLoad(gitignore, &st);
+      force = 1;
+    }
+  } else if (d->ignore) {
+    editorIgnoreFree(d->ignore);
+    d->ignore = NULL;
+    force = 1;
+  }
+  free(gitignore);
+  struct editorIgnore *chain = job->chain;
+  if (d->ignore) {
+    d->ignore->parent = chain;
+    chain = d->ignore;
+  }
+
+  if (stat(plen ? d->path : ".", &st) == -1)
+    memset(&st, 0, sizeof(st));
+  if (force || st.st_mtim.tv_sec == 0 ||
+      !editorSameMtime(&d->mtime, &st.st_mtim)) {
+    editorDirRead(f, d, chain);
+    d->mtime = st.st_mtim;
+  }
+
+  for (int j = 0; j < d->ndirs; j++)
+    editorWalkPush(f, d->dirs[j], chain, force);
+}
+
+// Walker thread, takes directories off the queue until it is empty and
+// no other walker can add more
+void *editorWalkWorker(void *arg) {
+  struct editorFinder *f = arg;
+  pthread_mutex_lock(&f->qlock);
+  while (1) {
+    while (f->njobs == 0 && f->active > 0)
+      pthread_cond_wait(&f->qcond, &f->qlock);
+    if (f->njobs == 0)
+      break;
+    struct editorWalkJob job = f->jobs[--f->njobs];
+    f->active++;
+    pthread_mutex_unlock(&f->qlock);
+    editorWalkDir(f, &job);
+    pthread_mutex_lock(&f->qlock);
+    if (--f->active == 0 && f->njobs == 0)
+      pthread_cond_broadcast(&f->qcond);
+  }
+  pthread_mutex_unlock(&f->qlock);
+  return NULL;
+}
+
+// Bitmask of the chars of s, lowercased, for rejecting paths quickly
+uint64_t editorFuzzyMask(const char *s, int len) {
+  uint64_t mask = 0;
+  for (int j = 0; j < len; j++) {
+    unsigned char c = tolower((unsigned char)s[j]);
+    if (c >= 'a' && c <= 'z')
+      mask |= 1ULL << (c - 'a');
+    else if (isdigit(c))
+      mask |= 1ULL << (26 + c - '0');
+    else
+      mask |= 1ULL << (36 + c % 28);
+  }
+  return mask;
+}
+
+// Count the files below a directory of the index
+int editorDirCount(struct editorDir *d) {
+  int n = d->nfiles;
+  for (int j = 0; j < d->ndirs; j++)
+    n += editorDirCount(d->dirs[j]);
+  return n;
+}
+
+// Add the files below a directory of the index to the candidates
+void editorDirCollect(struct editorDir *d, struct editorCandidate *c,
+                      int *n) {
+  for (int j = 0; j < d->nfiles; j++) {
+    struct editorCandidate *cand = &c[(*n)++];
+    cand->path = d->files[j];
+    cand->len = strlen(cand->path);
+    cand->mask = editorFuzzyMask(cand->path, cand->len);
+    cand->lower = d->files[j];
+    for (int k = 0; k < cand->len; k++) {
+      if (isupper((unsigned char)cand->path[k])) {
+        cand->lower = malloc(cand->len + 1);
+        for (k = 0; k <= cand->len; k++)
+          cand->lower[k] = tolower((unsigned char)cand->path[k]);
+        break;
+      }
+    }
+    const char *slash = strrchr(cand->path, '/');
+    cand->base = slash ? slash - cand->path + 1 : 0;
+  }
+  for (int j = 0; j < d->ndirs; j++)
+    editorDirCollect(d->dirs[j], c, n);
+}
+
+// Walk coordinator thread, refreshes the index and publishes its files
+void *editorFinderWalk(void *arg) {
+  struct editorFinder *f = arg;
+  f->njobs = f->active = 0;
+  editorWalkPush(f, &f->root, NULL, 0);
+  pthread_t workers[HELIS_FINDER_THREADS];
+  int nworkers = 0;
+  while (nworkers < HELIS_FINDER_THREADS - 1 &&
+         pthread_create(&workers[nworkers], NULL, editorWalkWorker, f) == 0)
+    nworkers++;
+  editorWalkWorker(f);
+  while (nworkers > 0)
+    pthread_join(workers[--nworkers], NULL);
+
+  int n = 0;
+  struct editorCandidate *cand =
+      malloc(sizeof(struct editorCandidate) * (editorDirCount(&f->root) + 1));
+  editorDirCollect(&f->root, cand, &n);
+  pthread_mutex_lock(&f->lock);
+  f->next = cand;
+  f->nnext = n;
+  pthread_mutex_unlock(&f->lock);
+  write(f->wake, "f", 1);
+  return NULL;
+}
+
+// Start refreshing the index in the background
+void editorFinderRescan(struct editorFinder *f) {
+  if (pthread_create(&f->thread, NULL, editorFinderWalk, f) == 0)
+    f->walking = 1;
+}
+
+// Score of a path matching the lowercased query q as a subsequence at or
+// after from, -1 if it doesn't. The match is the shortest window ending
+// where the earliest one does; matches at word starts, in the basename and
+// in runs score higher, skipped chars cost a point each
+int editorFuzzyWindow(const struct editorCandidate *c, const char *q,
+                      int qlen, int from) {
+  const char *s = c->lower;
+  const char *p = s + from, *end = s + c->len;
+  for (int k = 0; k < qlen; k++) {
+    p = memchr(p, q[k], end - p);
+    if (p == NULL)
+      return -1;
+    p++;
+  }
+  const char *start = p;
+  for (int k = qlen - 1; k >= 0; k--)
+    start = memrchr(s, q[k], start - s);
+
+  int score = 0, prev = -2, k = 0;
+  for (int j = start - s; k < qlen; j++) {
+    if (s[j] != q[k])
+      continue;
+    char before = j ? c->path[j - 1] : '/';
+    score += 16;
+    if (before == '/' || before == '_' || before == '-' || before == '.' ||
+        before == ' ')
+      score += 24;
+    else if (islower((unsigned char)before) &&
+             isupper((unsigned char)c->path[j]))
+      score += 16;
+    if (j == prev + 1)
+      score += 20;
+    if (j >= c->base)
+      score += 8;
+    prev = j;
+    k++;
+  }
+  return score - ((p - start) - qlen);
+}
+
+// Score of a path for the lowercased query q, -1 if it doesn't match;
+// short paths win ties
+int editorFuzzyScore(const struct editorCandidate *c, const char *q,
+                     int qlen) {
+  int score = editorFuzzyWindow(c, q, qlen, 0);
+  if (score >= 0 && c->base > 0) {
+    int base = editorFuzzyWindow(c, q, qlen, c->base);
+    if (base > score)
+      score = base;
+  }
+  return score < 0 ? -1 : score * 64 + 63 - (c->len < 63 ? c->len : 63);
+}
+
+// Keep candidate idx among the best ones, as many as the screen shows
+void editorMatchRank(struct editorMatchJob *job, int idx, int score) {
+  int max = E.screenrows > 1 ? E.screenrows - 1 : 1;
+  if (job->ntop == max && score <= job->topscore[max - 1])
+    return;
+  int j = job->ntop < max ? job->ntop++ : max - 1;
+  while (j > 0 && job->topscore[j - 1] < score) {
+    job->top[j] = job->top[j - 1];
+    job->topscore[j] = job->topscore[j - 1];
+    j--;
+  }
+  job->top[j] = idx;
+  job->topscore[j] = score;
+}
+
+// Matcher thread, drops the hits of its slice that don't match the query
+void *editorMatchSlice(void *arg) {
+  struct editorMatchJob *job = arg;
+  int *hits = job->f->hits;
+  for (int j = job->from; j < job->to; j++) {
+    struct editorCandidate *c = &job->f->cand[hits[j]];
+    if (job->qmask & ~c->mask)
+      continue;
+    int score = editorFuzzyScore(c, job->q, job->qlen);
+    if (score < 0)
+      continue;
+    hits[job->from + job->n++] = hits[j];
+    editorMatchRank(job, hits[j], score);
+  }
+  return NULL;
+}
+
+// Match the index against query, filtering only the previous hits when
+// the query just got longer. Big sets of hits are split among threads
+void editorFinderMatch(struct editorFinder *f, const char *query) {
+  int qlen = strlen(query);
+  char *q = malloc(qlen + 1);
+  for (int j = 0; j <= qlen; j++)
+    q[j] = tolower((unsigned char)query[j]);
+
+  if (f->query == NULL || strncmp(q, f->query, strlen(f->query)) != 0) {
+    f->hits = realloc(f->hits, sizeof(int) * (f->ncand + 1));
+    for (int j = 0; j < f->ncand; j++)
+      f->hits[j] = j;
+    f->nhits = f->ncand;
+  }
+
+  // Sized here, the screen may have changed since the last match
+  int max = E.screenrows > 1 ? E.screenrows - 1 : 1;
+  f->top = realloc(f->top, sizeof(int) * max);
+  f->topscore = realloc(f->topscore, sizeof(int) * max);
+  int nthreads = f->nhits / HELIS_MATCH_SLICE + 1;
+  if (nthreads > HELIS_FINDER_THREADS)
+    nthreads = HELIS_FINDER_THREADS;
+  struct editorMatchJob jobs[HELIS_FINDER_THREADS];
+  pthread_t threads[HELIS_FINDER_THREADS];
+  int *tops = malloc(sizeof(int) * max * 2 * nthreads);
+  for (int t = 0; t < nthreads; t++) {
+    jobs[t] = (struct editorMatchJob){.f = f, .q = q, .qlen = qlen};
+    jobs[t].qmask = editorFuzzyMask(q, qlen);
+    jobs[t].from = (long)f->nhits * t / nthreads;
+    jobs[t].to = (long)f->nhits * (t + 1) / nthreads;
+    jobs[t].top = &tops[max * 2 * t];
+    jobs[t].topscore = &tops[max * (2 * t + 1)];
+  }
+  int started = 1;
+  while (started < nthreads && pthread_create(&threads[started], NULL,
+                                              editorMatchSlice,
+                                              &jobs[started]) == 0)
+    started++;
+  for (int t = started; t < nthreads; t++)
+    editorMatchSlice(&jobs[t]);
+  editorMatchSlice(&jobs[0]);
+  for (int t = 1; t < started; t++)
+    pthread_join(threads[t], NULL);
+
+  // Gather the slices in order, so ties rank as if matched in one pass
+  struct editorMatchJob all = {.top = f->top, .topscore = f->topscore};
+  int n = 0;
+  for (int t = 0; t < nthreads; t++) {
+    memmove(&f->hits[n], &f->hits[jobs[t].from], sizeof(int) * jobs[t].n);
+    n += jobs[t].n;
+    for (int j = 0; j < jobs[t].ntop; j++)
+      editorMatchRank(&all, jobs[t].top[j], jobs[t].topscore[j]);
   }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  E.cx++;
+  free(tops);
+  f->nhits = n;
+  f->ntop = all.ntop;
+  free(f->query);
+  f->query = q;
+  if (f->sel >= f->ntop)
+    f->sel = f->ntop ? f->ntop - 1 : 0;
 }
 
-// Handle Enter key
-void editorInsertNewline() {
-  if (E.cx == 0) {
-    editorInsertRow(E.cy, "", 0);
-  } else {
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+// Take the index published by a finished walk
+void editorFinderWake() {
+  struct editorFinder *f = E.finder;
+  if (f == NULL || !f->walking)
+    return;
+  pthread_mutex_lock(&f->lock);
+  struct editorCandidate *next = f->next;
+  char **garbage = f->garbage;
+  int nnext = f->nnext, ngarbage = f->ngarbage;
+  if (next) {
+    f->next = NULL;
+    f->garbage = NULL;
+    f->ngarbage = f->capgarbage = 0;
   }
-  E.cy++;
-  E.cx = 0;
+  pthread_mutex_unlock(&f->lock);
+  if (next == NULL)
+    return;
+
+  pthread_join(f->thread, NULL);
+  f->walking = 0;
+  for (int j = 0; j < f->ncand; j++)
+    if (f->cand[j].lower != f->cand[j].path)
+      free(f->cand[j].lower);
+  free(f->cand);
+  f->cand = next;
+  f->ncand = nnext;
+  for (int j = 0; j < ngarbage; j++)
+    free(garbage[j]);
+  free(garbage);
+
+  // Match again from scratch, the hits index the old candidates
+  char *query = f->query;
+  f->query = NULL;
+  editorFinderMatch(f, query ? query : "");
+  free(query);
+  if (f->open)
+    editorRefreshScreen();
 }
 
-// Append row
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+// Append the text s to a line already col columns wide, up to the screen
+// width; control chars and invalid UTF-8 show as ?, returns the new width
+int editorDrawText(struct abuf *ab, const char *s, int len, int col) {
+  for (int j = 0; j < len;) {
+    int n = 1, w = 1, cp = (unsigned char)s[j];
+    if (cp >= 0x80) {
+      n = editorUtf8Decode(&s[j], len - j, &cp);
+      w = editorCodepointWidth(cp);
+    }
+    if (col + w > E.screencols)
+      break;
+    if (cp == -1 || (cp < 0x80 && iscntrl(cp)))
+      abAppend(ab, cp == '\t' ? " " : "?", 1);
+    else
+      abAppend(ab, &s[j], n);
+    col += w;
+    j += n;
+  }
+  return col;
 }
 
-// Delete character
-void editorDelChar() {
-  if (E.cy == E.numrows)
+// Drawing screen line r of the text area while the finder is open
+void editorFinderDrawRow(struct abuf *ab, int r) {
+  struct editorFinder *f = E.finder;
+  if (r == E.screenrows - 1) {
+    char info[80];
+    int len = snprintf(info, sizeof(info), "  %d/%d files%s", f->nhits,
+                       f->ncand, f->walking ? ", indexing..." : "");
+    abAppend(ab, info, len < E.screencols ? len : E.screencols);
     return;
-  if (E.cx == 0 && E.cy == 0)
+  }
+  if (r >= f->ntop)
     return;
 
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0) {
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
-  } else {
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-    editorDelRow(E.cy);
-    E.cy--;
-  }
+  const char *s = f->cand[f->top[r]].path;
+  int len = f->cand[f->top[r]].len;
+  if (r == f->sel)
+    abAppend(ab, "\x1b[7m> ", 6);
+  else
+    abAppend(ab, "  ", 2);
+  editorDrawText(ab, s, len, 2);
+  if (r == f->sel)
+    abAppend(ab, "\x1b[27m", 5);
 }
 
-/* File I/O */
-
-// Convert array of rows to string
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  int j;
-  for (j = 0; j < E.numrows; j++) {
-    // Add byte for \n
-    totlen += E.row[j].size + 1;
-  }
-  *buflen = totlen;
-
-  char *buf = malloc(totlen);
-  char *p = buf;
-  // Copy each row into buffer
-  for (j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    // Append newline
-    *p = '\n';
-    p++;
+// Handle keys typed into the finder prompt
+void editorFinderCallback(char *query, int key) {
+  struct editorFinder *f = E.finder;
+  int down = key == ARROW_DOWN || key == CTRL_KEY('n');
+  int up = key == ARROW_UP || key == CTRL_KEY('p');
+  // Match once per burst of typed keys
+  if (key == '\x1b' || (!up && !down && key != '\r' && editorInputPending(0)))
+    return;
+  if (f->query == NULL || strcasecmp(query, f->query) != 0) {
+    f->sel = 0;
+    editorFinderMatch(f, query);
   }
 
-  return buf;
+  if (down && f->sel + 1 < f->ntop)
+    f->sel++;
+  else if (up && f->sel > 0)
+    f->sel--;
+  else if (key == '\r' && f->sel < f->ntop)
+    f->choice = strdup(f->cand[f->top[f->sel]].path);
 }
 
-// Open file in the editor
-void editorOpen(char *filename) {
-  free(E.filename);
-  // Set File Name
-  E.filename = strdup(filename);
+// Pick a file to open by fuzzy matching its path
+void editorFinder() {
+  if (E.finder == NULL) {
+    struct editorFinder *f = calloc(1, sizeof(struct editorFinder));
+    f->root.path = strdup("");
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_mutex_init(&f->qlock, NULL);
+    pthread_cond_init(&f->qcond, NULL);
+    f->wake = E.wake[1];
+    E.finder = f;
+  }
+  struct editorFinder *f = E.finder;
+  // Each time the finder opens the index catches up with the disk
+  if (!f->walking)
+    editorFinderRescan(f);
+
+  f->open = 1;
+  f->sel = 0;
+  editorFinderMatch(f, "");
+  char *query = editorPrompt("Find file: %s", editorFinderCallback);
+  free(query);
+  f->open = 0;
+
+  char *choice = f->choice;
+  f->choice = NULL;
+  if (choice) {
+    editorOpenFile(choice);
+    free(choice);
+  }
+}
 
-  // Set highlight
-  editorSelectSyntaxHighlight();
+/* Grep */
 
-  // Open file stream
-  FILE *fp = fopen(filename, "r");
-  if (!fp)
-    die("fopen");
+// Line matching a :grep pattern
+struct editorGrepHit {
+  char *path; // Shared by the hits of a file
+  int line;   // Row of the match
+  int col;    // Offset of the match in the row's chars
+  char *text; // The row, cut to HELIS_GREP_TEXT bytes
+};
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
+// Directory waiting to be searched
+struct editorGrepJob {
+  char *path;
+  struct editorIgnore *chain; // Rules in effect in the directory
+};
 
-  // Copy line form file into erow struct
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 &&
-           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-      linelen--;
-    editorInsertRow(E.numrows, line, linelen);
+// Last :grep, searched by a pool of threads that stream their hits to the
+// main thread through the wake pipe
+struct editorGrep {
+  char *pat;
+  struct editorMatcher m;
+  char *root;                    // Directory searched, "" for the working one
+  pthread_t thread;              // Search coordinator
+  int running;                   // Coordinator not joined yet, main thread only
+  pthread_mutex_t qlock;         // Guards the queue, ignores and stop
+  pthread_cond_t qcond;
+  struct editorGrepJob *jobs;
+  int njobs, capjobs;
+  int active;                    // Jobs being processed
+  int stop;                      // Searchers should give up
+  struct editorIgnore **ignores; // Rules loaded on the way
+  int nignores, capignores;
+
+  pthread_mutex_t lock;          // Guards the fields below
+  struct editorGrepHit *pending; // Hits not taken by the main thread yet
+  int npending, cappending;
+  char **paths;                  // Paths of the files with hits
+  int npaths, cappaths;
+  int nfiles;                    // Files searched so far
+  int finished;                  // Search is over
+  int wake;                      // Wake pipe of the editor
+
+  struct editorGrepHit *hits;    // Hits taken by the main thread
+  int nhits, caphits;
+  int cur;                       // Hit jumped to or selected, -1 for none
+  int off;                       // First hit shown by the list
+  int open;                      // List is on screen
+};
+
+// Queue a directory for the searcher threads
+void editorGrepPush(struct editorGrep *g, char *path,
+                    struct editorIgnore *chain) {
+  pthread_mutex_lock(&g->qlock);
+  if (g->njobs == g->capjobs) {
+    g->capjobs = g->capjobs ? g->capjobs * 2 : 64;
+    g->jobs = realloc(g->jobs, sizeof(struct editorGrepJob) * g->capjobs);
   }
-  free(line);
-  // Closing file stream
-  fclose(fp);
-  // Set dirtiness to false
-  E.dirty = 0;
+  g->jobs[g->njobs++] = (struct editorGrepJob){path, chain};
+  pthread_cond_signal(&g->qcond);
+  pthread_mutex_unlock(&g->qlock);
 }
 
-// Save file changes to disk
-void editorSave() {
-  if (E.filename == NULL) {
-    E.filename = editorPrompt("Save as: %s", NULL);
-    if (E.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
-      return;
-    }
-    editorSelectSyntaxHighlight();
+// Search one file, mapped rather than read, for the pattern
+void editorGrepFile(struct editorGrep *g, char *path) {
+  struct editorGrepHit *hits = NULL;
+  int nhits = 0, cap = 0;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+      st.st_size == 0 || st.st_size > INT_MAX) {
+    if (fd != -1)
+      close(fd);
+    free(path);
+    return;
   }
-
-  int len;
-  char *buf = editorRowsToString(&len);
-
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes writen to disk", len);
-        return;
+  int size = st.st_size;
+  char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  // Files with a NUL near the start are taken for binary
+  if (data != MAP_FAILED &&
+      memchr(data, '\0', size < HELIS_GREP_BINARY ? size : HELIS_GREP_BINARY) ==
+          NULL) {
+    int line = 0, ls = 0, at = 0;
+    while ((at = editorMatcherFind(&g->m, data, size, at)) != -1) {
+      // Count the lines up to the match
+      const char *nl;
+      while ((nl = memchr(&data[ls], '\n', at - ls)) != NULL) {
+        ls = nl - data + 1;
+        line++;
       }
+      const char *eol = memchr(&data[at], '\n', size - at);
+      int le = eol ? eol - data : size;
+      int tlen = le - ls;
+      while (tlen > 0 && data[ls + tlen - 1] == '\r')
+        tlen--;
+      if (tlen > HELIS_GREP_TEXT)
+        tlen = HELIS_GREP_TEXT;
+
+      if (nhits == cap) {
+        cap = cap ? cap * 2 : 16;
+        hits = realloc(hits, sizeof(struct editorGrepHit) * cap);
+      }
+      struct editorGrepHit *h = &hits[nhits++];
+      h->path = path;
+      h->line = line;
+      h->col = at - ls;
+      h->text = malloc(tlen + 1);
+      memcpy(h->text, &data[ls], tlen);
+      h->text[tlen] = '\0';
+      // One hit per line
+      at = le + 1;
+      if (at >= size)
+        break;
     }
-    close(fd);
   }
-  free(buf);
-  editorSetStatusMessage("Filed ot save: I/o error: %s", strerror(errno));
+  if (data != MAP_FAILED)
+    munmap(data, size);
+
+  pthread_mutex_lock(&g->lock);
+  g->nfiles++;
+  if (nhits) {
+    if (g->npending + nhits > g->cappending) {
+      g->cappending = (g->npending + nhits) * 2;
+      g->pending =
+          realloc(g->pending, sizeof(struct editorGrepHit) * g->cappending);
+    }
+    memcpy(&g->pending[g->npending], hits,
+           sizeof(struct editorGrepHit) * nhits);
+    // One wake byte per batch the main thread hasn't taken yet
+    if (g->npending == 0)
+      write(g->wake, "g", 1);
+    g->npending += nhits;
+    if (g->npaths == g->cappaths) {
+      g->cappaths = g->cappaths ? g->cappaths * 2 : 64;
+      g->paths = realloc(g->paths, sizeof(char *) * g->cappaths);
+    }
+    g->paths[g->npaths++] = path;
+  } else {
+    free(path);
+  }
+  pthread_mutex_unlock(&g->lock);
+  free(hits);
 }
 
-/* Find */
+// Rules in effect in directory dir, chain being those above it
+struct editorIgnore *editorGrepIgnore(struct editorGrep *g, const char *dir,
+                                      struct editorIgnore *chain) {
+  char *gitignore = editorJoinPath(dir, ".gitignore");
+  struct stat st;
+  struct editorIgnore *ig = NULL;
+  if (stat(gitignore, &st) == 0 && S_ISREG(st.st_mode))
+    ig = editorIgnoreLoad(gitignore, &st);
+  free(gitignore);
+  if (ig == NULL)
+    return chain;
+
+  ig->parent = chain;
+  pthread_mutex_lock(&g->qlock);
+  if (g->nignores == g->capignores) {
+    g->capignores = g->capignores ? g->capignores * 2 : 16;
+    g->ignores =
+        realloc(g->ignores, sizeof(struct editorIgnore *) * g->capignores);
+  }
+  g->ignores[g->nignores++] = ig;
+  pthread_mutex_unlock(&g->qlock);
+  return ig;
+}
 
-// Callback for find
-void editorFindCallback(char *query, int key) {
-  // Search forward and backward
-  static int last_match = -1;
-  static int direction = 1;
+// Search the files of a directory and queue its subdirectories
+void editorGrepDir(struct editorGrep *g, struct editorGrepJob *job) {
+  struct editorIgnore *chain = editorGrepIgnore(g, job->path, job->chain);
+  char **files, **dirs;
+  int nfiles, ndirs;
+  editorListDir(job->path, chain, &files, &nfiles, &dirs, &ndirs);
+  for (int j = 0; j < ndirs; j++)
+    editorGrepPush(g, dirs[j], chain);
+  for (int j = 0; j < nfiles; j++)
+    editorGrepFile(g, files[j]);
+  free(files);
+  free(dirs);
+  free(job->path);
+}
 
-  // Highlight of search
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
+// Searcher thread, takes directories off the queue until it is empty and
+// no other searcher can add more, or the search is stopped
+void *editorGrepWorker(void *arg) {
+  struct editorGrep *g = arg;
+  pthread_mutex_lock(&g->qlock);
+  while (1) {
+    while (g->njobs == 0 && g->active > 0 && !g->stop)
+      pthread_cond_wait(&g->qcond, &g->qlock);
+    if (g->njobs == 0 || g->stop)
+      break;
+    struct editorGrepJob job = g->jobs[--g->njobs];
+    g->active++;
+    pthread_mutex_unlock(&g->qlock);
+    editorGrepDir(g, &job);
+    pthread_mutex_lock(&g->qlock);
+    if (--g->active == 0 && g->njobs == 0)
+      pthread_cond_broadcast(&g->qcond);
+  }
+  pthread_mutex_unlock(&g->qlock);
+  return NULL;
+}
 
-  if (saved_hl) {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
+// Search coordinator thread, runs the searchers and reports the end
+void *editorGrepRun(void *arg) {
+  struct editorGrep *g = arg;
+  // Rules of the directories from the working one down to the root
+  struct editorIgnore *chain = NULL;
+  if (g->root[0] && g->root[0] != '/' && strstr(g->root, "..") == NULL) {
+    char *dir = strdup(g->root);
+    chain = editorGrepIgnore(g, "", chain);
+    for (char *slash = strchr(dir, '/'); slash; slash = strchr(slash + 1, '/')) {
+      *slash = '\0';
+      chain = editorGrepIgnore(g, dir, chain);
+      *slash = '/';
+    }
+    free(dir);
   }
+  editorGrepPush(g, strdup(g->root), chain);
+  pthread_t workers[HELIS_GREP_THREADS];
+  int nworkers = 0;
+  while (nworkers < HELIS_GREP_THREADS - 1 &&
+         pthread_create(&workers[nworkers], NULL, editorGrepWorker, g) == 0)
+    nworkers++;
+  editorGrepWorker(g);
+  while (nworkers > 0)
+    pthread_join(workers[--nworkers], NULL);
+
+  pthread_mutex_lock(&g->lock);
+  g->finished = 1;
+  pthread_mutex_unlock(&g->lock);
+  write(g->wake, "g", 1);
+  return NULL;
+}
 
-  if (key == '\r' || key == '\x1b') {
-    last_match = -1;
-    direction = 1;
+// Stop the last :grep and free its results
+void editorGrepFree() {
+  struct editorGrep *g = E.grep;
+  if (g == NULL)
     return;
-  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    direction = 1;
-  } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = -1;
-  } else {
-    last_match = -1;
-    direction = 1;
-  }
-
-  if (last_match == -1)
-    direction = 1;
-  int current = last_match;
-
-  int i;
-  for (i = 0; i < E.numrows; i++) {
-    current += direction;
-    if (current == -1)
-      current = E.numrows - 1;
-    else if (current == E.numrows)
-      current = 0;
-
-    erow *row = &E.row[current];
-    char *match = strstr(row->render, query);
-    if (match) {
-      last_match = current;
-      E.cy = current;
-      E.cx = editorRowRxToCx(row, match - row->render);
-      E.rowoff = E.numrows;
-
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
-    }
+  E.grep = NULL;
+  if (g->running) {
+    pthread_mutex_lock(&g->qlock);
+    g->stop = 1;
+    pthread_cond_broadcast(&g->qcond);
+    pthread_mutex_unlock(&g->qlock);
+    pthread_join(g->thread, NULL);
   }
+
+  for (int j = 0; j < g->njobs; j++)
+    free(g->jobs[j].path);
+  free(g->jobs);
+  for (int j = 0; j < g->nignores; j++)
+    editorIgnoreFree(g->ignores[j]);
+  free(g->ignores);
+  for (int j = 0; j < g->npending; j++)
+    free(g->pending[j].text);
+  free(g->pending);
+  for (int j = 0; j < g->nhits; j++)
+    free(g->hits[j].text);
+  free(g->hits);
+  for (int j = 0; j < g->npaths; j++)
+    free(g->paths[j]);
+  free(g->paths);
+  pthread_mutex_destroy(&g->lock);
+  pthread_mutex_destroy(&g->qlock);
+  pthread_cond_destroy(&g->qcond);
+  free(g->pat);
+  free(g->root);
+  free(g);
 }
 
-// Find in text
-void editorFind() {
-  // Save cursor position
-  int saved_cx = E.cx;
-  int saved_cy = E.cy;
-  int saved_coloff = E.coloff;
-  int saved_rowoff = E.rowoff;
+// Take the hits the searchers found since the last wake
+void editorGrepWake() {
+  struct editorGrep *g = E.grep;
+  if (g == NULL || !g->running)
+    return;
+  pthread_mutex_lock(&g->lock);
+  if (g->nhits + g->npending > g->caphits) {
+    g->caphits = (g->nhits + g->npending) * 2;
+    g->hits = realloc(g->hits, sizeof(struct editorGrepHit) * g->caphits);
+  }
+  memcpy(&g->hits[g->nhits], g->pending,
+         sizeof(struct editorGrepHit) * g->npending);
+  g->nhits += g->npending;
+  g->npending = 0;
+  int finished = g->finished;
+  pthread_mutex_unlock(&g->lock);
+
+  if (finished) {
+    pthread_join(g->thread, NULL);
+    g->running = 0;
+  }
+  if (g->open)
+    editorRefreshScreen();
+}
 
-  char *query =
-      editorPrompt("Search: %s (Use ESC/Arrow/Enter)", editorFindCallback);
-  if (query) {
-    free(query);
+// Start searching the files under a directory for a pattern, args being
+// the pattern, quoted if it has spaces, and the directory if not the
+// working one; returns -1 if it couldn't start
+int editorGrepStart(char *args) {
+  while (*args == ' ')
+    args++;
+  char *pat = args, *dir;
+  if (*args == '"' || *args == '\'') {
+    pat = args + 1;
+    dir = strchr(pat, *args);
+    if (dir == NULL) {
+      editorSetStatusMessage("Unterminated pattern");
+      return -1;
+    }
+    *dir++ = '\0';
   } else {
-    // Restore cursor position
-    E.cx = saved_cx;
-    E.cy = saved_cy;
-    E.coloff = saved_coloff;
-    E.rowoff = saved_rowoff;
+    dir = strchr(pat, ' ');
+    if (dir)
+      *dir++ = '\0';
+    else
+      dir = "";
+  }
+  while (*dir == ' ')
+    dir++;
+  int dlen = strlen(dir);
+  while (dlen > 0 && dir[dlen - 1] == ' ')
+    dir[--dlen] = '\0';
+  if (*pat == '\0') {
+    editorSetStatusMessage("Usage: grep pattern [dir]");
+    return -1;
+  }
+  struct stat st;
+  if (dlen && (stat(dir, &st) == -1 || !S_ISDIR(st.st_mode))) {
+    editorSetStatusMessage("Not a directory: %s", dir);
+    return -1;
   }
-}
 
-/* Append Buffer */
+  editorGrepFree();
+  struct editorGrep *g = calloc(1, sizeof(struct editorGrep));
+  g->pat = strdup(pat);
+  editorMatcherInit(&g->m, g->pat, strlen(g->pat));
+  g->root = strdup(strcmp(dir, ".") == 0 ? "" : dir);
+  g->cur = -1;
+  g->wake = E.wake[1];
+  pthread_mutex_init(&g->lock, NULL);
+  pthread_mutex_init(&g->qlock, NULL);
+  pthread_cond_init(&g->qcond, NULL);
+  if (pthread_create(&g->thread, NULL, editorGrepRun, g) != 0) {
+    free(g->pat);
+    free(g->root);
+    free(g);
+    editorSetStatusMessage("Can't start the search");
+    return -1;
+  }
+  g->running = 1;
+  E.grep = g;
+  return 0;
+}
 
-// Dynamic string
-struct abuf {
-  char *b;
-  int len;
-};
+// Open the file of hit k at the match
+void editorGrepJump(int k) {
+  struct editorGrep *g = E.grep;
+  struct editorGrepHit *h = &g->hits[k];
+  struct stat st;
+  if (stat(h->path, &st) == -1 || E.filename == NULL ||
+      st.st_ino != E.disk_stat.st_ino || st.st_dev != E.disk_stat.st_dev) {
+    if (editorOpenFile(h->path) == -1)
+      return;
+  }
 
-// Empty abuf
-#define ABUF_INIT                                                              \
-  { NULL, 0 }
+  g->cur = k;
+  E.cy = h->line < E.numrows ? h->line : E.numrows;
+  E.cx = 0;
+  if (E.cy < E.numrows && h->col <= E.row[E.cy].size)
+    E.cx = h->col;
+  editorSetStatusMessage("(%d of %d%s) %s:%d", k + 1, g->nhits,
+                         g->running ? "+" : "", h->path, h->line + 1);
+}
 
-// Append to dynamic string
-void abAppend(struct abuf *ab, const char *s, int len) {
-  // Allocate memory for new string
-  char *new = realloc(ab->b, ab->len + len);
+// Jump to the next (dir 1) or previous (dir -1) hit of the last :grep
+void editorGrepNext(int dir) {
+  struct editorGrep *g = E.grep;
+  if (g == NULL || g->nhits == 0) {
+    editorSetStatusMessage("No grep results");
+    return;
+  }
+  int k = g->cur + dir;
+  if (g->cur == -1)
+    k = 0;
+  if (k < 0 || k >= g->nhits) {
+    editorSetStatusMessage("No more items");
+    return;
+  }
+  editorGrepJump(k);
+}
 
-  if (new == NULL)
+// Drawing screen line r of the text area while the grep list is open
+void editorGrepDrawRow(struct abuf *ab, int r) {
+  struct editorGrep *g = E.grep;
+  char buf[80];
+  if (r == E.screenrows - 1) {
+    pthread_mutex_lock(&g->lock);
+    int nfiles = g->nfiles;
+    pthread_mutex_unlock(&g->lock);
+    int len = snprintf(buf, sizeof(buf), "  %d matches in %d files%s",
+                       g->nhits, nfiles, g->running ? ", searching..." : "");
+    abAppend(ab, buf, len < E.screencols ? len : E.screencols);
     return;
-  // Append string into buffer
-  memcpy(&new[ab->len], s, len);
-  // Update buffer
-  ab->b = new;
-  ab->len += len;
+  }
+  int k = g->off + r;
+  if (k >= g->nhits)
+    return;
+
+  struct editorGrepHit *h = &g->hits[k];
+  if (k == g->cur)
+    abAppend(ab, "\x1b[7m> ", 6);
+  else
+    abAppend(ab, "  ", 2);
+  int col = editorDrawText(ab, h->path, strlen(h->path), 2);
+  int len = snprintf(buf, sizeof(buf), ":%d: ", h->line + 1);
+  col = editorDrawText(ab, buf, len, col);
+  editorDrawText(ab, h->text, strlen(h->text), col);
+  if (k == g->cur)
+    abAppend(ab, "\x1b[27m", 5);
 }
 
-void abFree(struct abuf *ab) { free(ab->b); }
+// Browse the hits of the last :grep, which keep coming while the search
+// runs; Enter jumps to the selected one
+void editorGrepList() {
+  struct editorGrep *g = E.grep;
+  if (g == NULL) {
+    editorSetStatusMessage("No grep results");
+    return;
+  }
+  if (g->cur == -1)
+    g->cur = 0;
+  int page = E.screenrows > 1 ? E.screenrows - 1 : 1;
+  g->open = 1;
+  while (1) {
+    if (g->cur >= g->nhits)
+      g->cur = g->nhits ? g->nhits - 1 : 0;
+    if (g->cur < g->off)
+      g->off = g->cur;
+    if (g->cur >= g->off + page)
+      g->off = g->cur - page + 1;
+    editorSetStatusMessage("grep %s: j/k to move, Enter to open, ESC to close",
+                           g->pat);
+    if (!editorInputPending(0))
+      editorRefreshScreen();
+
+    int c = editorReadKey();
+    if (c == '\x1b' || c == 'q') {
+      break;
+    } else if (c == '\r') {
+      if (g->cur < g->nhits) {
+        g->open = 0;
+        editorGrepJump(g->cur);
+        return;
+      }
+    } else if (c == 'j' || c == ARROW_DOWN) {
+      g->cur++;
+    } else if ((c == 'k' || c == ARROW_UP) && g->cur > 0) {
+      g->cur--;
+    } else if (c == PAGE_DOWN) {
+      g->cur += page;
+    } else if (c == PAGE_UP) {
+      g->cur = g->cur > page ? g->cur - page : 0;
+    } else if (c == 'g') {
+      g->cur = 0;
+    } else if (c == 'G') {
+      g->cur = g->nhits;
+    }
+  }
+  g->open = 0;
+  if (g->nhits == 0)
+    g->cur = -1;
+  editorSetStatusMessage("");
+}
 
 /* Output */
 
@@ -858,12 +7021,24 @@ void editorScroll() {
     E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
   }
 
-  if (E.cy < E.rowoff) {
-    E.rowoff = E.cy;
+  // Jumps into a closed fold open it
+  if (editorRowHidden(E.cy))
+    editorFoldReveal(E.cy);
+  // Rows are counted on screen, where a closed fold takes one and a
+  // wrapped row as many as it wraps to
+  int top = editorScreenTop();
+  int cur = editorRowToScreen(E.cy) + editorCursorLine();
+  if (cur < top) {
+    top = cur;
   }
-  if (E.cy >= E.rowoff + E.screenrows) {
-    E.rowoff = E.cy - E.screenrows + 1;
+  if (cur >= top + E.screenrows) {
+    top = cur - E.screenrows + 1;
   }
+  E.rowoff = editorScreenToRow(top);
+  E.lineoff = top - editorRowToScreen(E.rowoff);
+  // Wrapped rows never scroll sideways
+  if (E.wrap.on)
+    return;
   if (E.rx < E.coloff) {
     E.coloff = E.rx;
   }
@@ -871,78 +7046,200 @@ void editorScroll() {
     E.coloff = E.rx - E.screencols + 1;
   }
 }
-// Drawing rows
-void editorDrawRows(struct abuf *ab) {
-  int r;
-  for (r = 0; r < E.screenrows; r++) {
-    // Rows in the file
-    int filerow = r + E.rowoff;
-    if (filerow >= E.numrows) {
-      if (E.numrows == 0 && r == E.screenrows / 3) {
-        // Printing editor version
-        char welcome[80];
-        int welcomelen = snprintf(welcome, sizeof(welcome),
-                                  "Helis editor -- version %s", HELIS_VERSION);
-        // If welcome string is longer then terminal columns number, truncate it
-        if (welcomelen > E.screencols)
-          welcomelen = E.screencols;
-        // Centering the welcome message
-        int padding = (E.screencols - welcomelen) / 2;
-        if (padding) {
-          abAppend(ab, ">", 1);
-          padding--;
-        }
-        while (padding--)
-          abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcomelen);
-      } else {
+// Drawing a closed fold as its size and its first row
+void editorDrawFold(struct abuf *ab, int filerow, int rows) {
+  if (filerow == E.gaprow)
+    editorGapClose();
+  erow *row = &E.row[filerow];
+  const char *s = editorRowChars(row);
+  int len = row->size;
+  while (len > 0 && (*s == ' ' || *s == '\t')) {
+    s++;
+    len--;
+  }
+  char info[32];
+  int n = snprintf(info, sizeof(info), "+--%4d lines: ", rows);
+  abAppend(ab, "\x1b[36m", 5);
+  editorDrawText(ab, s, len, editorDrawText(ab, info, n, 0));
+  abAppend(ab, "\x1b[39m", 5);
+}
+
+// Drawing screen line r of the text area
+void editorDrawRow(struct abuf *ab, int r) {
+  if (E.finder && E.finder->open) {
+    editorFinderDrawRow(ab, r);
+    return;
+  }
+  if (E.grep && E.grep->open) {
+    editorGrepDrawRow(ab, r);
+    return;
+  }
+  // Rows in the file
+  int s = editorScreenTop() + r;
+  int filerow = editorScreenToRow(s);
+  // A wrapped row shows a screen width of its columns on each line
+  int coloff = E.coloff;
+  if (E.wrap.on && filerow < E.numrows)
+    coloff = (s - editorRowToScreen(filerow)) * E.screencols;
+  int run = editorFoldRun(filerow + 1);
+  if (filerow < E.numrows && run != -1 &&
+      E.folds.hidden[run].start == filerow + 1) {
+    editorDrawFold(ab, filerow, E.folds.hidden[run].end - filerow + 1);
+  } else if (filerow >= E.numrows) {
+    if (E.numrows == 0 && r == E.screenrows / 3) {
+      // Printing editor version
+      char welcome[80];
+      int welcomelen = snprintf(welcome, sizeof(welcome),
+                                "Helis editor -- version %s", HELIS_VERSION);
+      // If welcome string is longer then terminal columns number, truncate it
+      if (welcomelen > E.screencols)
+        welcomelen = E.screencols;
+      // Centering the welcome message
+      int padding = (E.screencols - welcomelen) / 2;
+      if (padding) {
         abAppend(ab, ">", 1);
+        padding--;
       }
+      while (padding--)
+        abAppend(ab, " ", 1);
+      abAppend(ab, welcome, welcomelen);
     } else {
-      int len = E.row[filerow].rsize - E.coloff;
-      if (len < 0)
-        len = 0;
-      if (len > E.screencols)
-        len = E.screencols;
-
-      char *c = &E.row[filerow].render[E.coloff];
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
-      int current_color = -1;
-      int j;
-      for (j = 0; j < len; j++) {
-        if (iscntrl(c[j])) {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
+      abAppend(ab, ">", 1);
+    }
+  } else {
+    erow *row = editorRowResident(&E.row[filerow]);
+    char *c = row->render;
+    unsigned char *hl = row->hl;
+    int current_color = -1;
+    int sel_start, sel_end;
+    if (!editorSelectionRange(filerow, &sel_start, &sel_end))
+      sel_start = sel_end = -1;
+    int selected = 0;
+    int end = coloff + E.screencols;
+    // Extra cursors on the row, walked along with j
+    int cur = editorCursorsFirst(filerow);
+    int cur_at = editorCursorsRender(row, cur);
+
+    // On ASCII rows render bytes are columns, so skip straight to coloff,
+    // on other long rows to the chunk it is in
+    int j = 0, col = 0;
+    if (row->ascii) {
+      j = col = coloff < row->rsize ? coloff : row->rsize;
+    } else if (row->chunks) {
+      struct erowChunk *ch = editorRowFindChunk(row, coloff, CHUNK_RX);
+      j = ch->ri;
+      col = ch->rx;
+    }
+    // Matches of the search on the row, walked along with j
+    int m_from = 0, m_to = 0;
+    int match = editorSearchRender(row, editorSearchFirst(row, j), &m_from,
+                                   &m_to);
+    // The render of a long row being typed into goes on past its gap
+    int gap = editorRowGapRi(row);
+    while (j < row->rsize && col < end) {
+      if (j >= gap && c == row->render) {
+        c += row->rgap;
+        hl += row->rgap;
+      }
+      int lim = j < gap ? gap : row->rsize;
+      int n = 1, w = 1, cp = (unsigned char)c[j];
+      if (cp >= 0x80) {
+        n = editorUtf8Decode(&c[j], lim - j, &cp);
+        w = editorCodepointWidth(cp);
+      }
+      // Chars left of the screen
+      if (col + w <= coloff) {
+        col += w;
+        j += n;
+        continue;
+      }
+
+      while (cur_at != -1 && cur_at < j)
+        cur_at = editorCursorsRender(row, ++cur);
+      while (match != -1 && m_to <= j)
+        match = editorSearchRender(row, match + 1, &m_from, &m_to);
+      int h = (match != -1 && j >= m_from) ? HL_MATCH : hl[j];
+
+      // Show the visual selection, a matching bracket pair and the extra
+      // cursors in reverse video
+      int in_sel = (col >= sel_start && col < sel_end) || j == cur_at ||
+                   (E.pair_y != -1 &&
+                    ((filerow == E.cy && j == E.pair_from) ||
+                     (filerow == E.pair_y && j == E.pair_at)));
+      if (in_sel != selected) {
+        abAppend(ab, in_sel ? "\x1b[7m" : "\x1b[27m", in_sel ? 4 : 5);
+        selected = in_sel;
+      }
+
+      if (cp == -1 || (cp < 0x80 && iscntrl(cp))) {
+        char sym = (cp >= 0 && cp <= 26) ? '@' + cp : '?';
+        abAppend(ab, "\x1b[7m", 4);
+        abAppend(ab, &sym, 1);
+        abAppend(ab, "\x1b[m", 3);
+        if (current_color != -1) {
+          char buf[16];
+          int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
+          abAppend(ab, buf, clen);
+        }
+        if (selected)
           abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-          if (current_color != -1) {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
-          }
-        } else if (hl[j] == HL_NORMAL) {
+      } else {
+        if (h == HL_NORMAL) {
           if (current_color != -1) {
             abAppend(ab, "\x1b[39m", 5);
             current_color = -1;
           }
-          abAppend(ab, &c[j], 1);
         } else {
-          int color = editorSyntaxToColor(hl[j]);
+          int color = editorSyntaxToColor(h);
           if (color != current_color) {
             current_color = color;
             char buf[16];
             int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
             abAppend(ab, buf, clen);
           }
-          abAppend(ab, &c[j], 1);
+        }
+        // Wide chars cut by a screen edge are padded with spaces
+        if (col < coloff || col + w > end) {
+          int from = col < coloff ? coloff : col;
+          int to = col + w > end ? end : col + w;
+          while (from++ < to)
+            abAppend(ab, " ", 1);
+        } else {
+          abAppend(ab, &c[j], n);
         }
       }
-      abAppend(ab, "\x1b[39m", 5);
+      col += w;
+      j += n;
     }
+    // An extra cursor at the end of the row
+    while (cur_at != -1 && cur_at < j)
+      cur_at = editorCursorsRender(row, ++cur);
+    if (j >= row->rsize && cur_at == row->rsize && col >= coloff && col < end)
+      abAppend(ab, "\x1b[7m \x1b[27m", 10);
+    abAppend(ab, "\x1b[39;27m", 8);
+  }
+}
+
+// Drawing rows, skipping lines the terminal already shows
+void editorDrawRows(struct abuf *ab) {
+  struct abuf line = ABUF_INIT;
+  for (int r = 0; r < E.screenrows; r++) {
+    line.len = 0;
+    editorDrawRow(&line, r);
     // Clear the line when redrawing
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
+    abAppend(&line, "\x1b[K", 3);
+
+    uint64_t h = editorHashBytes(line.b, line.len);
+    if (E.screen_valid && E.screen[r] == h)
+      continue;
+    E.screen[r] = h;
+    char buf[16];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", r + 1);
+    abAppend(ab, buf, len);
+    abAppend(ab, line.b, line.len);
   }
+  abFree(&line);
+  E.screen_valid = 1;
 }
 
 // Draw status bar
@@ -951,9 +7248,12 @@ void editorDrawStatusBar(struct abuf *ab) {
   abAppend(ab, "\x1b[1;7m", 6);
   char status[80], rstatus[80];
   // File Name, Lines Count and Dirtiness on the left side
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+  char rec[16] = "";
+  if (E.macros.recording)
+    snprintf(rec, sizeof(rec), " recording @%c", E.macros.recording);
+  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s%s",
                      E.filename ? E.filename : "[ No Name ]", E.numrows,
-                     E.dirty ? "(modified)" : "");
+                     E.dirty ? "(modified)" : "", rec);
   // Mode and Line:LinesCount on the right side
   int rlen = snprintf(
       rstatus, sizeof(rstatus), "[%s] | %s | %d:%d", editorModes[E.mode],
@@ -990,53 +7290,204 @@ void editorDrawMessageBar(struct abuf *ab) {
 // Refreshing Screen
 void editorRefreshScreen() {
   editorScroll();
+  editorFindPair();
 
   struct abuf ab = ABUF_INIT;
 
   // Hiding the cursor
   abAppend(&ab, "\x1b[?25l", 6);
-  // Move cursor to the top-left corner
-  abAppend(&ab, "\x1b[1;1H", 6);
+
+  // Scroll the text area when the row offset moved so that only the
+  // exposed lines need drawing
+  int d = editorScreenTop() -
+          (editorRowToScreen(E.screen_rowoff) + E.screen_lineoff);
+  if (E.screen_valid && d != 0 && abs(d) < E.screenrows) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+                       E.screenrows, abs(d), d > 0 ? 'S' : 'T');
+    abAppend(&ab, buf, len);
+    if (d > 0) {
+      memmove(E.screen, &E.screen[d], sizeof(uint64_t) * (E.screenrows - d));
+      memset(&E.screen[E.screenrows - d], 0, sizeof(uint64_t) * d);
+    } else {
+      memmove(&E.screen[-d], E.screen, sizeof(uint64_t) * (E.screenrows + d));
+      memset(E.screen, 0, sizeof(uint64_t) * -d);
+    }
+  }
+  E.screen_rowoff = E.rowoff;
+  E.screen_lineoff = E.lineoff;
 
   editorDrawRows(&ab);
+  // Move cursor to the status bar
+  char pos[16];
+  int poslen = snprintf(pos, sizeof(pos), "\x1b[%d;1H", E.screenrows + 1);
+  abAppend(&ab, pos, poslen);
   editorDrawStatusBar(&ab);
   editorDrawMessageBar(&ab);
 
   // Move cursor to E.rx and E.cy
   char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-           (E.rx - E.coloff) + 1);
+  int line = editorCursorLine();
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
+           editorRowToScreen(E.cy) + line - editorScreenTop() + 1,
+           (E.rx - (E.wrap.on ? line * E.screencols : E.coloff)) + 1);
   abAppend(&ab, buf, strlen(buf));
 
-  // Showing cursor
+  // Showing cursor, a bar in Insert mode and a block otherwise. Set with
+  // the frame so that keys replayed from a macro write nothing
+  abAppend(&ab, E.mode == Insert ? "\033[5 q" : "\033[1 q", 5);
   abAppend(&ab, "\x1b[?25h", 6);
 
   // Write the buffer's contents
-  write(STDOUT_FILENO, ab.b, ab.len);
+  editorWriteAll(STDOUT_FILENO, ab.b, ab.len);
   abFree(&ab);
+  E.last_frame = editorNowMs();
+}
+
+// Ms to hold back the next frame to respect HELIS_MAX_FPS
+int editorFrameDelay() {
+  if (HELIS_MAX_FPS <= 0)
+    return 0;
+  long delay = E.last_frame + 1000 / HELIS_MAX_FPS - editorNowMs();
+  return delay > 0 ? delay : 0;
+}
+
+// Set Status Message
+void editorSetStatusMessage(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+  va_end(ap);
+  E.statusmsg_time = time(NULL);
+}
+
+/* Editor Modes */
+
+// Enter the normal mode
+void editorEnableNormalMode() {
+  E.mode = Normal;
+}
+
+// Enter insert mode
+void editorEnableInsertMode() {
+  E.mode = Insert;
+}
+
+/* Macros */
+
+// Start recording typed keys into the register named by the next key, or
+// stop recording, dropping the q that stopped it
+void editorMacroToggle() {
+  struct editorMacros *m = &E.macros;
+  if (m->recording) {
+    struct editorMacro *reg = &m->reg[m->recording - 'a'];
+    if (reg->len > 0 && reg->keys[reg->len - 1] == 'q')
+      reg->len--;
+    m->recording = 0;
+    editorSetStatusMessage("");
+    return;
+  }
+  int c = editorReadKey();
+  if (c < 'a' || c > 'z')
+    return;
+  m->recording = c;
+  m->reg[c - 'a'].len = 0;
+}
+
+// Record a typed key into the register being recorded
+void editorMacroRecord(int key) {
+  struct editorMacros *m = &E.macros;
+  if (!m->recording)
+    return;
+  struct editorMacro *reg = &m->reg[m->recording - 'a'];
+  if (reg->len == reg->cap) {
+    reg->cap = reg->cap ? reg->cap * 2 : 64;
+    reg->keys = realloc(reg->keys, sizeof(int) * reg->cap);
+  }
+  reg->keys[reg->len++] = key;
+}
+
+// Replay the macro of a register count times, @ being the last replayed
+void editorMacroPlay(int c, int count) {
+  struct editorMacros *m = &E.macros;
+  if (c == '@')
+    c = m->last;
+  if (c < 'a' || c > 'z') {
+    if (c == 0)
+      editorSetStatusMessage("No previous macro");
+    return;
+  }
+  m->last = c;
+  struct editorMacro *reg = &m->reg[c - 'a'];
+  if (reg->len == 0 || count < 1)
+    return;
+  if (m->depth == m->cap) {
+    m->cap = m->cap ? m->cap * 2 : 8;
+    m->play = realloc(m->play, sizeof(struct editorReplay) * m->cap);
+  }
+  // A copy, as the register may be recorded again while it plays
+  struct editorReplay *r = &m->play[m->depth++];
+  r->keys = malloc(sizeof(int) * reg->len);
+  memcpy(r->keys, reg->keys, sizeof(int) * reg->len);
+  r->len = reg->len;
+  r->pos = 0;
+  r->left = count - 1;
 }
 
-// Set Status Message
-void editorSetStatusMessage(const char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
-  va_end(ap);
-  E.statusmsg_time = time(NULL);
+// Stop all replays, as when a command in them failed
+void editorMacroAbort() {
+  struct editorMacros *m = &E.macros;
+  while (m->depth > 0)
+    free(m->play[--m->depth].keys);
 }
 
-/* Editor Modes */
-
-// Enter the normal mode
-void editorEnableNormalMode() {
-  E.mode = Normal;
-  write(STDOUT_FILENO, "\033[1 q", 5);
+// Take the next key of the replay on top into *key, false if there is no
+// replay. Keys typed meanwhile stop them all
+int editorMacroNext(int *key) {
+  struct editorMacros *m = &E.macros;
+  if (m->depth == 0)
+    return 0;
+  if (++m->played % HELIS_MACRO_POLL == 0 &&
+      (E.inpos < E.inlen || editorFillInput(0))) {
+    editorMacroAbort();
+    editorSetStatusMessage("Macro interrupted");
+    return 0;
+  }
+  struct editorReplay *r = &m->play[m->depth - 1];
+  *key = r->keys[r->pos++];
+  // Finished replays come off right away, so a macro replaying itself as
+  // its last key doesn't pile them up
+  while (m->depth > 0) {
+    r = &m->play[m->depth - 1];
+    if (r->pos < r->len)
+      break;
+    if (r->left > 0) {
+      r->left--;
+      r->pos = 0;
+      break;
+    }
+    free(r->keys);
+    m->depth--;
+  }
+  return 1;
 }
 
-// Enter insert mode
-void editorEnableInsertMode() {
-  E.mode = Insert;
-  write(STDOUT_FILENO, "\033[5 q", 5);
+// Whether a macro is being replayed. Once replays are over, rows left to
+// lex are lexed in order, each from the settled state of the row above
+int editorMacroPlaying() {
+  struct editorMacros *m = &E.macros;
+  if (m->depth > 0)
+    return 1;
+  if (m->stale) {
+    m->stale = 0;
+    for (int y = 0; y < E.numrows; y++) {
+      if (E.row[y].hl_stale) {
+        E.row[y].hl_stale = 0;
+        editorUpdateSyntax(&E.row[y]);
+      }
+    }
+  }
+  return 0;
 }
 
 /* Input */
@@ -1048,30 +7499,36 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
   size_t buflen = 0;
   buf[0] = '\0';
+  E.prompting++;
 
   while (1) {
     editorSetStatusMessage(prompt, buf);
-    editorRefreshScreen();
+    if (!editorInputPending(0))
+      editorRefreshScreen();
 
     int c = editorReadKey();
     if (c == DEL_KEY || c == CTRL_KEY('h') ||
         c == BACKSPACE) { // Let user use del, ctrl-h and backspace in prompt
-      if (buflen != 0)
-        buf[--buflen] = '\0';
+      // Drop a whole UTF-8 sequence
+      while (buflen != 0 && (buf[--buflen] & 0xC0) == 0x80)
+        ;
+      buf[buflen] = '\0';
     } else if (c == '\x1b') { // Cancel if user pressed Escape
       editorSetStatusMessage("");
       if (callback)
         callback(buf, c);
       free(buf);
+      E.prompting--;
       return NULL;
     } else if (c == '\r') { // Return if user pressed Enter
       if (buflen != 0) {
         editorSetStatusMessage("");
         if (callback)
           callback(buf, c);
+        E.prompting--;
         return buf;
       }
-    } else if (!iscntrl(c) && c < 128) {
+    } else if (c < 256 && !(c < 128 && iscntrl(c))) {
       if (buflen == bufsize - 1) {
         // Double the size of buffer if user input is big enough
         bufsize *= 2;
@@ -1093,30 +7550,30 @@ void editorMoveCursor(int key) {
   case ARROW_UP:
   case 'k':
     if (E.cy != 0) {
-      E.cy--;
+      E.cy = editorNextVisible(E.cy, -1);
     }
     break;
   case ARROW_DOWN:
   case 'j':
     if (E.cy < E.numrows) {
-      E.cy++;
+      E.cy = editorNextVisible(E.cy, 1);
     }
     break;
   case ARROW_LEFT:
   case 'h':
     if (E.cx != 0) {
-      E.cx--;
+      E.cx = editorRowPrevCx(row, E.cx);
     } else if (E.cy > 0) {
-      E.cy--;
+      E.cy = editorNextVisible(E.cy, -1);
       E.cx = E.row[E.cy].size;
     }
     break;
   case ARROW_RIGHT:
   case 'l':
     if (row && E.cx < row->size) {
-      E.cx++;
+      E.cx = editorRowNextCx(row, E.cx);
     } else if (row && E.cx == row->size) {
-      E.cy++;
+      E.cy = editorNextVisible(E.cy, 1);
       E.cx = 0;
     }
     break;
@@ -1127,6 +7584,279 @@ void editorMoveCursor(int key) {
   if (E.cx > rowlen) {
     E.cx = rowlen;
   }
+  // Keep the cursor off the middle of a multibyte char
+  if (row && !row->ascii)
+    E.cx = editorRowRxToCx(row, editorRowCxToRx(row, E.cx));
+}
+
+/* Visual mode */
+
+// Enter visual mode of the given kind, anchored at the cursor
+void editorEnableVisualMode(enum editorVisualKind kind) {
+  if (E.numrows == 0)
+    return;
+  if (E.cy >= E.numrows) {
+    E.cy = E.numrows - 1;
+    E.cx = 0;
+  }
+  E.mode = Visual;
+  E.vkind = kind;
+  E.vx = E.cx;
+  E.vy = E.cy;
+}
+
+// Ordered selection bounds: rows y0..y1, and either chars x0 of y0 to
+// x1 of y1 or, for block selections, render columns x0..x1
+void editorVisualBounds(int *y0, int *x0, int *y1, int *x1) {
+  int cy = E.cy < E.numrows ? E.cy : E.numrows - 1;
+  int cx = E.cy < E.numrows ? E.cx : 0;
+
+  if (E.vkind == VISUAL_BLOCK) {
+    int vrx = editorRowCxToRx(&E.row[E.vy], E.vx);
+    int crx = editorRowCxToRx(&E.row[cy], cx);
+    *y0 = E.vy < cy ? E.vy : cy;
+    *y1 = E.vy < cy ? cy : E.vy;
+    *x0 = vrx < crx ? vrx : crx;
+    *x1 = vrx < crx ? crx : vrx;
+  } else if (E.vy < cy || (E.vy == cy && E.vx <= cx)) {
+    *y0 = E.vy;
+    *x0 = E.vx;
+    *y1 = cy;
+    *x1 = cx;
+  } else {
+    *y0 = cy;
+    *x0 = cx;
+    *y1 = E.vy;
+    *x1 = E.vx;
+  }
+}
+
+// Chars [from, to) of a row covered by the selection bounds
+void editorVisualRowSpan(int y, int y0, int x0, int y1, int x1, int *from,
+                         int *to) {
+  erow *row = &E.row[y];
+  *from = 0;
+  *to = row->size;
+  if (E.vkind == VISUAL_CHAR) {
+    if (y == y0)
+      *from = x0 < row->size ? x0 : row->size;
+    if (y == y1)
+      *to = editorRowNextCx(row, x1);
+  } else if (E.vkind == VISUAL_BLOCK) {
+    *from = editorRowRxToCx(row, x0);
+    *to = editorRowRxToCx(row, x1 + 1);
+  }
+  if (*to < *from)
+    *to = *from;
+}
+
+// Render columns [start, end) of a row inside the selection
+int editorSelectionRange(int filerow, int *start, int *end) {
+  if (E.mode != Visual)
+    return 0;
+  int y0, x0, y1, x1, from, to;
+  editorVisualBounds(&y0, &x0, &y1, &x1);
+  if (filerow < y0 || filerow > y1)
+    return 0;
+  editorVisualRowSpan(filerow, y0, x0, y1, x1, &from, &to);
+  *start = editorRowCxToRx(&E.row[filerow], from);
+  *end = editorRowCxToRx(&E.row[filerow], to);
+  return 1;
+}
+
+// Empty the register
+void editorRegisterFree() {
+  for (int j = 0; j < E.reg.n; j++)
+    free(E.reg.lines[j]);
+  free(E.reg.lines);
+  free(E.reg.lens);
+  E.reg.lines = NULL;
+  E.reg.lens = NULL;
+  E.reg.n = 0;
+}
+
+// Copy the selection into the register
+void editorYankSelection() {
+  int y0, x0, y1, x1;
+  editorVisualBounds(&y0, &x0, &y1, &x1);
+
+  editorRegisterFree();
+  E.reg.n = y1 - y0 + 1;
+  E.reg.kind = E.vkind;
+  E.reg.lines = malloc(sizeof(char *) * E.reg.n);
+  E.reg.lens = malloc(sizeof(size_t) * E.reg.n);
+  for (int y = y0; y <= y1; y++) {
+    int from, to;
+    editorVisualRowSpan(y, y0, x0, y1, x1, &from, &to);
+    E.reg.lens[y - y0] = to - from;
+    E.reg.lines[y - y0] = malloc(to - from + 1);
+    memcpy(E.reg.lines[y - y0], &editorRowChars(&E.row[y])[from], to - from);
+  }
+}
+
+// Delete the selection, whole rows and joined rows in one bulk replace
+void editorDeleteSelection() {
+  int y0, x0, y1, x1, from, to;
+  editorVisualBounds(&y0, &x0, &y1, &x1);
+
+  if (E.vkind == VISUAL_LINE) {
+    editorReplaceRows(y0, y1 - y0 + 1, NULL, NULL, 0);
+    E.cx = 0;
+  } else if (E.vkind == VISUAL_CHAR && y0 != y1) {
+    erow *first = &E.row[y0], *last = &E.row[y1];
+    editorVisualRowSpan(y0, y0, x0, y1, x1, &from, &to);
+    int head = from;
+    editorVisualRowSpan(y1, y0, x0, y1, x1, &from, &to);
+    size_t len = head + last->size - to;
+    char *joined = malloc(len + 1);
+    memcpy(joined, editorRowChars(first), head);
+    memcpy(&joined[head], &editorRowChars(last)[to], last->size - to);
+    editorReplaceRows(y0, y1 - y0 + 1, &joined, &len, 1);
+    free(joined);
+    E.cx = head;
+  } else {
+    for (int y = y0; y <= y1; y++) {
+      editorVisualRowSpan(y, y0, x0, y1, x1, &from, &to);
+      if (to > from)
+        editorRowReplace(&E.row[y], from, to - from, NULL, 0);
+      if (y == y0)
+        E.cx = from;
+    }
+  }
+
+  E.cy = y0;
+  if (E.cy >= E.numrows)
+    E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+  if (E.cy < E.numrows && E.cx > E.row[E.cy].size)
+    E.cx = E.row[E.cy].size;
+}
+
+// Put the register after the cursor, or before it
+void editorPaste(int before) {
+  struct editorRegister *r = &E.reg;
+  if (r->n == 0)
+    return;
+
+  if (r->kind == VISUAL_LINE) {
+    int at = E.cy < E.numrows ? E.cy + !before : E.numrows;
+    editorReplaceRows(at, 0, r->lines, r->lens, r->n);
+    E.cy = at;
+    E.cx = 0;
+    return;
+  }
+
+  if (E.numrows == 0)
+    editorInsertRow(0, "", 0);
+  if (E.cy >= E.numrows)
+    E.cy = E.numrows - 1;
+  erow *row = editorRowResident(&E.row[E.cy]);
+  int at = (before || row->size == 0) ? E.cx : editorRowNextCx(row, E.cx);
+  if (at > row->size)
+    at = row->size;
+
+  if (r->kind == VISUAL_BLOCK) {
+    int rx = editorRowCxToRx(row, at);
+    for (int k = 0; k < r->n; k++) {
+      if (E.cy + k >= E.numrows)
+        editorInsertRow(E.numrows, "", 0);
+      erow *dst = &E.row[E.cy + k];
+      int width = editorRowCxToRx(dst, dst->size);
+      if (width >= rx || r->lens[k] == 0) {
+        editorRowReplace(dst, editorRowRxToCx(dst, rx), 0, r->lines[k],
+                         r->lens[k]);
+        continue;
+      }
+      // Rows short of the column are padded out to it first
+      int pad = rx - width;
+      char *s = malloc(pad + r->lens[k]);
+      memset(s, ' ', pad);
+      memcpy(&s[pad], r->lines[k], r->lens[k]);
+      editorRowReplace(dst, dst->size, 0, s, pad + r->lens[k]);
+      free(s);
+    }
+    E.cx = at;
+  } else if (r->n == 1) {
+    editorRowReplace(row, at, 0, r->lines[0], r->lens[0]);
+    E.cx = editorRowPrevCx(row, at + r->lens[0]);
+    if (E.cx < at)
+      E.cx = at;
+  } else {
+    // Split the row around the pasted text
+    char **lines = malloc(sizeof(char *) * r->n);
+    size_t *lens = malloc(sizeof(size_t) * r->n);
+    int last = r->n - 1;
+    for (int k = 0; k < r->n; k++) {
+      lines[k] = r->lines[k];
+      lens[k] = r->lens[k];
+    }
+    lens[0] = at + r->lens[0];
+    lines[0] = malloc(lens[0]);
+    memcpy(lines[0], row->chars, at);
+    memcpy(&lines[0][at], r->lines[0], r->lens[0]);
+    lens[last] = r->lens[last] + row->size - at;
+    lines[last] = malloc(lens[last]);
+    memcpy(lines[last], r->lines[last], r->lens[last]);
+    memcpy(&lines[last][r->lens[last]], &row->chars[at], row->size - at);
+
+    editorReplaceRows(E.cy, 1, lines, lens, r->n);
+    free(lines[0]);
+    free(lines[last]);
+    free(lines);
+    free(lens);
+    E.cx = at;
+  }
+}
+
+// Put the lines of the register between the halves of the cursor row,
+// split at the cursor
+void editorPasteSplit() {
+  struct editorRegister *r = &E.reg;
+  if (E.cy >= E.numrows) {
+    editorPaste(0);
+    return;
+  }
+  erow *row = editorRowResident(&E.row[E.cy]);
+  int at = E.cx < row->size ? E.cx : row->size;
+  // The halves are copied out, the row goes away in the replace
+  char *chars = malloc(row->size + 1);
+  memcpy(chars, row->chars, row->size);
+  char **lines = malloc(sizeof(char *) * (r->n + 2));
+  size_t *lens = malloc(sizeof(size_t) * (r->n + 2));
+  lines[0] = chars;
+  lens[0] = at;
+  for (int k = 0; k < r->n; k++) {
+    lines[k + 1] = r->lines[k];
+    lens[k + 1] = r->lens[k];
+  }
+  lines[r->n + 1] = &chars[at];
+  lens[r->n + 1] = row->size - at;
+  editorReplaceRows(E.cy, 1, lines, lens, r->n + 2);
+  free(chars);
+  free(lines);
+  free(lens);
+  E.cy++;
+  E.cx = 0;
+}
+
+// Indent rows y0..y1 by a tab, or outdent them by a tab stop if dir < 0
+void editorShiftRows(int y0, int y1, int dir) {
+  for (int y = y0; y <= y1; y++) {
+    erow *row = editorRowResident(&E.row[y]);
+    if (row->size == 0)
+      continue;
+    if (dir > 0) {
+      editorRowReplace(row, 0, 0, "\t", 1);
+    } else {
+      int n = 0;
+      if (row->chars[0] == '\t')
+        n = 1;
+      else
+        while (n < row->size && n < HELIS_TAB_STOP && row->chars[n] == ' ')
+          n++;
+      if (n)
+        editorRowReplace(row, 0, n, NULL, 0);
+    }
+  }
 }
 
 /* Exit */
@@ -1134,6 +7864,11 @@ void editorMoveCursor(int key) {
 void clearAndExit() {
   write(STDOUT_FILENO, "\x1b[2J", 4);
   write(STDOUT_FILENO, "\x1b[1;1H", 6);
+  editorSaveWait();
+  // The server keeps the buffer, swap journal included
+  if (Srv.attached)
+    editorDetach();
+  journalClose(0);
   exit(0);
 }
 
@@ -1166,14 +7901,65 @@ void editorCmdPrompt() {
 
     clearAndExit();
   } else if (strcmp(query, "write") == 0 || strcmp(query, "w") == 0) {
-    editorSave();
+    editorSave(0);
+    editorEnableNormalMode();
+  } else if (strcmp(query, "write!") == 0 || strcmp(query, "w!") == 0) {
+    editorSave(1);
+    editorEnableNormalMode();
+  } else if (strcmp(query, "edit!") == 0 || strcmp(query, "e!") == 0) {
+    if (E.filename)
+      editorReload();
+    editorEnableNormalMode();
+  } else if (strcmp(query, "find") == 0) {
+    editorFinder();
+    editorEnableNormalMode();
+  } else if (strncmp(query, "grep ", 5) == 0) {
+    editorEnableNormalMode();
+    if (editorGrepStart(query + 5) == 0)
+      editorGrepList();
+  } else if (strcmp(query, "cnext") == 0 || strcmp(query, "cn") == 0) {
+    editorGrepNext(1);
+    editorEnableNormalMode();
+  } else if (strcmp(query, "cprev") == 0 || strcmp(query, "cp") == 0) {
+    editorGrepNext(-1);
+    editorEnableNormalMode();
+  } else if (strcmp(query, "clist") == 0 || strcmp(query, "cl") == 0) {
+    editorEnableNormalMode();
+    editorGrepList();
+  } else if (strcmp(query, "set wrap") == 0) {
+    editorSetWrap(1);
+    editorEnableNormalMode();
+  } else if (strcmp(query, "set nowrap") == 0) {
+    editorSetWrap(0);
+    editorEnableNormalMode();
+  } else if (strcmp(query, "nohlsearch") == 0 || strcmp(query, "noh") == 0) {
+    if (E.search)
+      E.search->highlight = 0;
     editorEnableNormalMode();
   } else {
+    // Commands taking a range of rows
+    char *p = query;
+    int y0, y1;
+    if (query[0] == '\0')
+      ;
+    else if (E.numrows == 0 || editorParseRange(&p, &y0, &y1) == -1)
+      editorSetStatusMessage("Invalid range");
+    else if (p[0] == 's' && p[1] && !isalnum((unsigned char)p[1]))
+      editorSubstitute(y0, y1, p + 1);
+    else if (p[0] == '!' && p != query)
+      editorFilter(y0, y1, p + 1);
+    else if (p[0] == '\0' && p != query)
+      E.cy = y1;
+    else
+      editorSetStatusMessage("Unknown command: %s", query);
     editorEnableNormalMode();
   }
+  free(query);
 }
 // Handle keypress in normal mode
 void editorProcessNormalKeypress(int c) {
+  if (E.cursors.n && editorCursorsNormalKey(c))
+    return;
 
   // Handle Enter
   switch (c) {
@@ -1186,6 +7972,56 @@ void editorProcessNormalKeypress(int c) {
     editorFind();
     break;
 
+    // q to record a macro, @ to replay one, a count before @ to replay
+    // it that many times
+  case 'q':
+    editorMacroToggle();
+    break;
+  case '@':
+    editorMacroPlay(editorReadKey(), 1);
+    break;
+  case '1':
+  case '2':
+  case '3':
+  case '4':
+  case '5':
+  case '6':
+  case '7':
+  case '8':
+  case '9': {
+    int count = c - '0';
+    while ((c = editorReadKey()) >= '0' && c <= '9') {
+      if (count <= (INT_MAX - 9) / 10)
+        count = count * 10 + c - '0';
+    }
+    if (c == '@')
+      editorMacroPlay(editorReadKey(), count);
+    else
+      editorProcessNormalKeypress(c);
+  } break;
+
+    // n/N to the next/previous match of the last search
+  case 'n':
+    editorSearchJump(1);
+    break;
+  case 'N':
+    editorSearchJump(-1);
+    break;
+
+    // Ctrl-P to pick a file
+  case CTRL_KEY('p'):
+    editorFinder();
+    break;
+
+    // Ctrl-N/Ctrl-J to add a cursor on the next match of the word or on
+    // the row below
+  case CTRL_KEY('n'):
+    editorCursorsAddNext();
+    break;
+  case CTRL_KEY('j'):
+    editorCursorsAddBelow();
+    break;
+
     // Basic insert keys
   case 'i':
     editorEnableInsertMode();
@@ -1239,23 +8075,59 @@ void editorProcessNormalKeypress(int c) {
     break;
 
   case 'G':
-    E.cy = E.numrows - 1;
+    // The last row may be in a closed fold
+    E.cy = editorScreenToRow(editorRowToScreen(E.numrows - 1));
+    break;
+
+    // z for folds
+  case 'z':
+    editorFoldCommand(editorReadKey());
+    break;
+
+    // % to the matching bracket
+  case '%':
+    editorJumpToPair();
     break;
 
   case PAGE_UP:
   case PAGE_DOWN: {
+    // A page of screen lines from the top or bottom line of the screen,
+    // and at least a row past a wrapped row taller than the screen
+    int top = editorScreenTop(), y = E.cy;
     if (c == PAGE_UP) {
-      E.cy = E.rowoff;
+      E.cy = editorScreenToRow(top > E.screenrows ? top - E.screenrows : 0);
+      if (E.cy >= y && y > 0)
+        E.cy = editorNextVisible(y, -1);
     } else {
-      E.cy = E.rowoff + E.screenrows - 1;
+      E.cy = editorScreenToRow(top + 2 * E.screenrows - 1);
+      if (E.cy <= y && y < E.numrows)
+        E.cy = editorNextVisible(y, 1);
       if (E.cy > E.numrows)
         E.cy = E.numrows;
     }
-    int times = E.screenrows;
-    while (times--)
-      editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+    // No key, only puts cx back on the new row
+    editorMoveCursor(0);
   } break;
 
+    // Visual modes
+  case 'v':
+    editorEnableVisualMode(VISUAL_CHAR);
+    break;
+  case 'V':
+    editorEnableVisualMode(VISUAL_LINE);
+    break;
+  case CTRL_KEY('v'):
+    editorEnableVisualMode(VISUAL_BLOCK);
+    break;
+
+    // Put yanked text
+  case 'p':
+    editorPaste(0);
+    break;
+  case 'P':
+    editorPaste(1);
+    break;
+
   // Handle x to delete char
   case 'x':
     editorMoveCursor(ARROW_RIGHT);
@@ -1294,6 +8166,12 @@ void editorProcessNormalKeypress(int c) {
 }
 // Handle keypress in insert mode
 void editorProcessInsertKeypress(int c) {
+  // Any other key keeps the completed word
+  if (c != CTRL_KEY('n') && c != CTRL_KEY('p'))
+    editorCompleteEnd();
+  if (E.cursors.n && editorCursorsInsertKey(c))
+    return;
+
   switch (c) {
     // Insert newline on 'Enter'
   case '\r':
@@ -1312,16 +8190,22 @@ void editorProcessInsertKeypress(int c) {
   // Handle PageUP and PageDown
   case PAGE_UP:
   case PAGE_DOWN: {
+    // A page of screen lines from the top or bottom line of the screen,
+    // and at least a row past a wrapped row taller than the screen
+    int top = editorScreenTop(), y = E.cy;
     if (c == PAGE_UP) {
-      E.cy = E.rowoff;
+      E.cy = editorScreenToRow(top > E.screenrows ? top - E.screenrows : 0);
+      if (E.cy >= y && y > 0)
+        E.cy = editorNextVisible(y, -1);
     } else {
-      E.cy = E.rowoff + E.screenrows - 1;
+      E.cy = editorScreenToRow(top + 2 * E.screenrows - 1);
+      if (E.cy <= y && y < E.numrows)
+        E.cy = editorNextVisible(y, 1);
       if (E.cy > E.numrows)
         E.cy = E.numrows;
     }
-    int times = E.screenrows;
-    while (times--)
-      editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+    // No key, only puts cx back on the new row
+    editorMoveCursor(0);
   } break;
 
     // Handle Home and End
@@ -1346,21 +8230,143 @@ void editorProcessInsertKeypress(int c) {
     editorMoveCursor(c);
     break;
 
+    // Complete the word before the cursor
+  case CTRL_KEY('n'):
+  case CTRL_KEY('p'):
+    editorComplete(c == CTRL_KEY('n') ? 1 : -1);
+    break;
+
   default:
     editorInsertChar(c);
   }
 }
-// TODO:
 // Handle keypress in visual mode
+void editorProcessVisualKeypress(int c) {
+  int y0, x0, y1, x1;
+  editorVisualBounds(&y0, &x0, &y1, &x1);
+
+  switch (c) {
+    // Operators end visual mode
+  case 'd':
+  case 'x':
+  case DEL_KEY:
+    editorYankSelection();
+    editorDeleteSelection();
+    editorEnableNormalMode();
+    break;
+  case 'y':
+    editorYankSelection();
+    E.cy = y0;
+    E.cx = (E.vkind == VISUAL_BLOCK) ? editorRowRxToCx(&E.row[y0], x0)
+           : (E.vkind == VISUAL_LINE) ? E.cx
+                                      : x0;
+    editorEnableNormalMode();
+    break;
+  case 'p':
+  case 'P': {
+    // Replace the selection, which then becomes the register
+    struct editorRegister put = E.reg;
+    memset(&E.reg, 0, sizeof(E.reg));
+    editorYankSelection();
+    struct editorRegister cut = E.reg;
+    editorDeleteSelection();
+    E.reg = put;
+    if (put.kind == VISUAL_LINE && E.vkind == VISUAL_CHAR)
+      editorPasteSplit();
+    else
+      editorPaste(put.kind != VISUAL_LINE || y0 < E.numrows);
+    editorRegisterFree();
+    E.reg = cut;
+    editorEnableNormalMode();
+  } break;
+  case '>':
+  case '<':
+    editorShiftRows(y0, y1, c == '>' ? 1 : -1);
+    E.cy = y0;
+    E.cx = 0;
+    editorEnableNormalMode();
+    break;
+
+    // Go to the other end of the selection
+  case 'o': {
+    int x = E.vx, y = E.vy;
+    E.vx = E.cx;
+    E.vy = E.cy;
+    E.cx = x;
+    E.cy = y;
+  } break;
+
+    // Switch kind, or leave when pressing the current kind again
+  case 'v':
+  case 'V':
+  case CTRL_KEY('v'): {
+    enum editorVisualKind kind = (c == 'v')   ? VISUAL_CHAR
+                                 : (c == 'V') ? VISUAL_LINE
+                                              : VISUAL_BLOCK;
+    if (kind == E.vkind)
+      editorEnableNormalMode();
+    else
+      E.vkind = kind;
+  } break;
+
+  case CTRL_KEY('l'):
+  case '\x1b':
+    editorEnableNormalMode();
+    break;
+
+    // Movement works as in normal mode
+  case ARROW_LEFT:
+  case ARROW_DOWN:
+  case ARROW_UP:
+  case ARROW_RIGHT:
+  case 'h':
+  case 'j':
+  case 'k':
+  case 'l':
+  case '0':
+  case '$':
+  case HOME_KEY:
+  case END_KEY:
+  case PAGE_UP:
+  case PAGE_DOWN:
+  case 'G':
+  case '%':
+  case GG_SEQ:
+  case '\r':
+  case ' ':
+  case BACKSPACE:
+  case CTRL_KEY('h'):
+    editorProcessNormalKeypress(c);
+    break;
+  }
+}
+
+// TODO:
 // Handle keypress in cmd mode
 // Make own func:
 /* if (E.cy < E.numrows) */
 /*   E.cx = E.row[E.cy].size; */
 
+// Whether key c only types into the row under the cursor, so that a long
+// row may keep its gap for the next key
+int editorKeyTypes(int c) {
+  if (E.mode != Insert || E.cursors.n || c == CTRL_KEY('n') ||
+      c == CTRL_KEY('p'))
+    return 0;
+  // Deleting at the start of a row joins it to the one above
+  if (c == BACKSPACE || c == CTRL_KEY('h'))
+    return E.cx > 0;
+  return c < ARROW_LEFT && c != '\r' && c != '\x1b' && c != CTRL_KEY('l');
+}
+
 // Handling keypress
 void editorProcessKeypress() {
   int c = editorReadKey();
 
+  // Every other key sees contiguous rows
+  E.typing = editorKeyTypes(c);
+  if (!E.typing)
+    editorGapClose();
   switch (E.mode) {
   case Normal:
     editorProcessNormalKeypress(c);
@@ -1368,14 +8374,15 @@ void editorProcessKeypress() {
   case Insert:
     editorProcessInsertKeypress(c);
     break;
+  case Visual:
+    editorProcessVisualKeypress(c);
+    break;
     /* // TODO: */
-    /* case Visual: */
-    /*   editorProcessVisualKeypress(); */
-    /*   break; */
     /* case Cmd: */
     /*   editorProcessCmdKeypress(); */
     /*   break; */
   }
+  E.typing = 0;
 }
 
 /* Init */
@@ -1395,29 +8402,316 @@ void initEditor() {
   E.statusmsg_time = 0;
   E.mode = Normal;
   E.syntax = NULL;
+  E.inotify_fd = -1;
+  memset(&E.disk_stat, 0, sizeof(E.disk_stat));
+  E.disk_changed = 0;
+  E.journal = NULL;
+  E.inlen = E.inpos = 0;
+  E.last_frame = 0;
+  memset(E.bcache, 0, sizeof(E.bcache));
+  E.cold_rowoff = 0;
+  E.gaprow = -1;
+  E.finder = NULL;
+  E.grep = NULL;
+  E.save = NULL;
+  E.pair_y = -1;
+  E.typing = 0;
+  if (pipe2(E.wake, O_NONBLOCK | O_CLOEXEC) == -1)
+    die("pipe");
+  editorWidthInit();
 
   editorEnableNormalMode();
+}
+
+// Size the text area to a terminal of rows by cols
+void editorResize(int rows, int cols) {
+  E.screenrows = rows - 2;
+  E.screencols = cols;
+  free(E.screen);
+  E.screen = calloc(E.screenrows, sizeof(uint64_t));
+  E.screen_valid = 0;
+  E.screen_rowoff = 0;
+  E.screen_lineoff = 0;
+}
+
+// Edit until quitting
+void editorLoop() {
+  while (1) {
+    if (Srv.gone)
+      editorDetach();
+    // A save that finished during a prompt reports now
+    editorSaveWake();
+    editorRefreshScreen();
+    // Compress the rows the screen moved away from
+    if (abs(E.rowoff - E.cold_rowoff) > HELIS_COLD_DISTANCE / 2)
+      editorFreezeRows(0);
+    editorProcessKeypress();
+    // Apply everything typed meanwhile before drawing the next frame
+    while (editorInputPending(editorFrameDelay()))
+      editorProcessKeypress();
+  }
+}
+
+/* Server */
+
+// Path of the socket the server listens on
+const char *editorSocketPath() {
+  static char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  if (dir && *dir)
+    snprintf(path, sizeof(path), "%s/helis.sock", dir);
+  else
+    snprintf(path, sizeof(path), "/tmp/helis-%d.sock", (int)getuid());
+  return path;
+}
+
+// Leave the attached buffer to the server and drop its client
+void editorDetach() {
+  longjmp(Srv.detach, 1);
+}
+
+// Read the hello of a client: window size, directory and file, one per
+// line. Returns -1 if it is malformed or too slow to come
+int editorServerHello(int fd, int *rows, int *cols, char *cwd, char *file) {
+  char buf[PATH_MAX * 2 + 64];
+  int len = 0, lines = 0;
+  while (lines < 3) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    // Bytes after the hello are keys for the editor, so read one at a time
+    if (len == (int)sizeof(buf) - 1 || poll(&pfd, 1, 1000) <= 0 ||
+        read(fd, &buf[len], 1) != 1)
+      return -1;
+    if (buf[len++] == '\n')
+      lines++;
+  }
+  buf[len] = '\0';
+  char *p = buf, *nl;
+  if (sscanf(p, "%d %d", rows, cols) != 2 || *rows < 3 || *cols < 1)
+    return -1;
+  p = strchr(p, '\n') + 1;
+  nl = strchr(p, '\n');
+  if (nl - p >= PATH_MAX)
+    return -1;
+  memcpy(cwd, p, nl - p);
+  cwd[nl - p] = '\0';
+  p = nl + 1;
+  nl = strchr(p, '\n');
+  if (nl - p >= PATH_MAX)
+    return -1;
+  memcpy(file, p, nl - p);
+  file[nl - p] = '\0';
+  return 0;
+}
+
+// Run the editor on the buffer of file for the client on fd until it
+// quits or goes away
+void editorServeClient(int fd) {
+  int rows, cols;
+  char cwd[PATH_MAX], file[PATH_MAX], real[PATH_MAX];
+  if (editorServerHello(fd, &rows, &cols, cwd, file) == -1) {
+    close(fd);
+    return;
+  }
+  if (chdir(cwd) == -1 || realpath(file, real) == NULL ||
+      editorCanOpen(real) == -1) {
+    char msg[PATH_MAX + 64];
+    int len = snprintf(msg, sizeof(msg), "helis: can't open %s: %s\r\n", file,
+                       strerror(errno));
+    editorWriteAll(fd, msg, len);
+    close(fd);
+    return;
+  }
+
+  int b;
+  for (b = 0; b < Srv.nbufs; b++)
+    if (strcmp(Srv.bufs[b].path, real) == 0)
+      break;
+  int kept = b < Srv.nbufs;
+  if (kept) {
+    E = Srv.bufs[b].state;
+    if (chdir(Srv.bufs[b].cwd) == -1)
+      editorSetStatusMessage("Can't go to %s", Srv.bufs[b].cwd);
+  } else {
+    E = Srv.blank;
+    if (editorOpen(file) == -1) {
+      char msg[PATH_MAX + 64];
+      int len = snprintf(msg, sizeof(msg), "helis: can't open %s: %s\r\n",
+                         file, strerror(errno));
+      editorWriteAll(fd, msg, len);
+      close(fd);
+      free(E.filename);
+      E = Srv.blank;
+      return;
+    }
+    Srv.bufs = realloc(Srv.bufs, sizeof(struct editorBuffer) * (b + 1));
+    Srv.nbufs++;
+    Srv.bufs[b].path = strdup(real);
+    Srv.bufs[b].cwd = strdup(cwd);
+  }
+
+  // The client's socket stands in for the terminal
+  dup2(fd, STDIN_FILENO);
+  dup2(fd, STDOUT_FILENO);
+  close(fd);
+
+  // Everything tied to the previous terminal starts over
+  E.inlen = E.inpos = 0;
+  E.mode = Normal;
+  editorCompleteEnd();
+  if (E.finder)
+    E.finder->open = 0;
+  if (E.grep)
+    E.grep->open = 0;
+  editorResize(rows, cols);
+  editorSetStatusMessage("\"%s\" %d lines, :q detaches", E.filename,
+                         E.numrows);
+  if (kept)
+    editorCheckDisk();
+  // The wake bytes of its threads went to whichever buffer was attached
+  editorFinderWake();
+  editorGrepWake();
+
+  Srv.attached = 1;
+  Srv.gone = 0;
+  if (setjmp(Srv.detach) == 0)
+    editorLoop();
+  Srv.attached = 0;
+  Srv.gone = 0;
+  editorSaveWait();
+
+  // A file opened meanwhile becomes the buffer's file
+  if (E.filename && realpath(E.filename, real)) {
+    free(Srv.bufs[b].path);
+    Srv.bufs[b].path = strdup(real);
+  }
+  Srv.bufs[b].state = E;
+  int devnull = open("/dev/null", O_RDWR);
+  dup2(devnull, STDIN_FILENO);
+  dup2(devnull, STDOUT_FILENO);
+  close(devnull);
+}
 
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1)
+// Serve buffers to helis --remote clients, one terminal at a time
+int editorServer() {
+  const char *path = editorSocketPath();
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    die("socket");
+  // A socket nobody answers on is left over from a server that died
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    fprintf(stderr, "helis: a server is already running on %s\n", path);
+    return 1;
+  }
+  unlink(path);
+  mode_t mask = umask(077);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(fd, 8) == -1) {
+    perror(path);
+    return 1;
+  }
+  umask(mask);
+  Srv.fd = fd;
+  signal(SIGPIPE, SIG_IGN);
+
+  initEditor();
+  Srv.blank = E;
+  int devnull = open("/dev/null", O_RDWR);
+  dup2(devnull, STDIN_FILENO);
+  dup2(devnull, STDOUT_FILENO);
+  close(devnull);
+
+  while (1) {
+    int client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    if (client == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      die("accept");
+    }
+    editorServeClient(client);
+  }
+}
+
+// Attach this terminal to the server's buffer of filename, passing keys
+// to it and its frames back until it lets go
+int editorRemote(char *filename) {
+  const char *path = editorSocketPath();
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    fprintf(stderr, "helis: no server on %s, start one with helis --server\n",
+            path);
+    return 1;
+  }
+
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)) == NULL)
+    die("getcwd");
+  enableRawMode();
+  int rows, cols;
+  if (getWindowSize(&rows, &cols) == -1)
     die("getWindowSize");
-  E.screenrows -= 2;
+  char *hello;
+  int len = asprintf(&hello, "%d %d\n%s\n%s\n", rows, cols, cwd, filename);
+  if (len == -1 || editorWriteAll(fd, hello, len) == -1)
+    die("write");
+  free(hello);
+
+  struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}};
+  char buf[65536];
+  while (1) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      die("poll");
+    }
+    if (fds[0].revents) {
+      ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+      if (n > 0 && editorWriteAll(fd, buf, n) == -1)
+        break;
+    }
+    if (fds[1].revents) {
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n <= 0)
+        break;
+      editorWriteAll(STDOUT_FILENO, buf, n);
+    }
+  }
+  close(fd);
+  return 0;
 }
 
 // Main
 int main(int argc, char *argv[]) {
+  if (argc >= 2 && strcmp(argv[1], "--server") == 0)
+    return editorServer();
+  if (argc >= 2 && strcmp(argv[1], "--remote") == 0) {
+    if (argc < 3) {
+      fprintf(stderr, "Usage: helis --remote file\n");
+      return 1;
+    }
+    return editorRemote(argv[2]);
+  }
+
   enableRawMode();
   initEditor();
-  if (argc >= 2) {
-    editorOpen(argv[1]);
+  int rows, cols;
+  if (getWindowSize(&rows, &cols) == -1)
+    die("getWindowSize");
+  editorResize(rows, cols);
+  if (argc >= 3 && strcmp(argv[1], "-r") == 0) {
+    editorRecover(argv[2]);
+  } else if (argc >= 2 && editorOpen(argv[1]) == -1) {
+    editorSetStatusMessage("Can't open %s: %s", argv[1], strerror(errno));
   }
 
-  editorSetStatusMessage(
-      "HELP: w/write(cmd) = save | '/'(normal) = find | q/quit(cmd) = quit");
-
-  while (1) {
-    editorRefreshScreen();
-    editorProcessKeypress();
-  }
+  if (E.statusmsg[0] == '\0')
+    editorSetStatusMessage(
+        "HELP: w/write(cmd) = save | '/'(normal) = find | q/quit(cmd) = quit");
 
+  editorLoop();
   return 0;
 }